@@ -0,0 +1,187 @@
+/*  =========================================================================
+    fty_common_socket_arena - Arena allocator for the buffers of a request
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_ARENA_H_INCLUDED
+#define FTY_COMMON_SOCKET_ARENA_H_INCLUDED
+
+#include "fty_common_socket_frame.h"
+
+#include <cstddef>
+#include <memory>
+#include <scoped_allocator>
+#include <string>
+#include <vector>
+
+namespace fty
+{
+    /**
+     * \brief Bump allocator for the short lived buffers of a request.
+     *
+     * Allocations are carved out of blocks of blockSize bytes, and released
+     * all at once by rewinding the arena: the blocks are kept for the next
+     * requests, so in a steady state nothing comes from the global heap.
+     * Allocations larger than a block get a block of their own, freed when
+     * the arena is rewound before it.
+     * Not thread safe: each thread uses its own arena.
+     */
+    class SocketArena
+    {
+    public:
+        explicit SocketArena(size_t blockSize = 16 * 1024);
+        
+        SocketArena(const SocketArena &) = delete;
+        SocketArena & operator=(const SocketArena &) = delete;
+        
+        void * allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+        
+        // Position of the arena, to release what is allocated after it
+        struct Mark
+        {
+            size_t block;
+            size_t offset;
+        };
+        
+        Mark mark() const { return Mark{m_block, m_offset}; }
+        void rewind(const Mark & mark);
+        
+        // Release everything, keeping the blocks
+        void reset() { rewind(Mark{0, 0}); }
+        
+        // Rewind the arena when going out of scope
+        class Scope
+        {
+        public:
+            explicit Scope(SocketArena & arena)
+            :   m_arena(arena), m_mark(arena.mark())
+            {}
+            
+            ~Scope() { m_arena.rewind(m_mark); }
+            
+            Scope(const Scope &) = delete;
+            Scope & operator=(const Scope &) = delete;
+        
+        private:
+            //attributs
+            SocketArena & m_arena;
+            Mark m_mark;
+        };
+        
+        // Bytes held in blocks
+        size_t capacity() const;
+        
+        // Arena of the calling thread, used for the requests handled and the
+        // messages encoded on it
+        static SocketArena & threadArena();
+    
+    private:
+        struct Block
+        {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+        
+        //attributs
+        size_t m_blockSize;
+        std::vector<Block> m_blocks;
+        size_t m_block = 0;
+        size_t m_offset = 0;
+    };
+    
+    /**
+     * \brief Standard allocator taking its memory from a SocketArena.
+     *        Deallocation is a no-op, the memory comes back when the arena
+     *        is rewound.
+     */
+    template <typename T>
+    class SocketArenaAllocator
+    {
+    public:
+        using value_type = T;
+        
+        explicit SocketArenaAllocator(SocketArena & arena)
+        :   m_arena(&arena)
+        {}
+        
+        template <typename U>
+        SocketArenaAllocator(const SocketArenaAllocator<U> & other)
+        :   m_arena(other.arena())
+        {}
+        
+        T * allocate(size_t count)
+        {
+            return static_cast<T *>(m_arena->allocate(count * sizeof(T), alignof(T)));
+        }
+        
+        void deallocate(T *, size_t)
+        {
+        }
+        
+        SocketArena * arena() const { return m_arena; }
+    
+    private:
+        //attributs
+        SocketArena * m_arena;
+    };
+    
+    template <typename T, typename U>
+    bool operator==(const SocketArenaAllocator<T> & left, const SocketArenaAllocator<U> & right)
+    {
+        return left.arena() == right.arena();
+    }
+    
+    template <typename T, typename U>
+    bool operator!=(const SocketArenaAllocator<T> & left, const SocketArenaAllocator<U> & right)
+    {
+        return !(left == right);
+    }
+    
+    // Payload whose frames are allocated in an arena, with the vector:
+    //     SocketArenaPayload reply{SocketArenaAllocator<SocketArenaString>(arena)};
+    //     reply.emplace_back("frame");
+    using SocketArenaString = std::basic_string<char, std::char_traits<char>, SocketArenaAllocator<char>>;
+    using SocketArenaPayload = std::vector<SocketArenaString, std::scoped_allocator_adaptor<SocketArenaAllocator<SocketArenaString>>>;
+    
+    /**
+     * \brief Handler of SocketBasicServer which doesn't use the global heap.
+     *
+     * The request frames view the buffer the request was received in, and
+     * the reply is built in the arena of the thread calling the handler.
+     * Both are released as soon as the reply is written or queued, so
+     * nothing from them may be kept after handleRequest returns.
+     */
+    class SocketArenaServer
+    {
+    public:
+        virtual ~SocketArenaServer() = default;
+        
+        // An empty reply is not sent
+        virtual void handleRequest(const std::string & sender, const SocketPayload & request, SocketArenaPayload & reply) = 0;
+    };
+
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_arena_test (bool verbose);
+//  @end
+
+#endif
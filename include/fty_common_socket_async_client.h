@@ -0,0 +1,102 @@
+/*  =========================================================================
+    fty_common_socket_async_client - Asynchronous client pipelining requests over one unix socket
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_ASYNC_CLIENT_H_INCLUDED
+#define FTY_COMMON_SOCKET_ASYNC_CLIENT_H_INCLUDED
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fty
+{
+    // This class is thread safe.
+    //
+    // Requests are written one after the other on a single connection,
+    // without waiting for the previous replies. The server answers the
+    // requests of a connection in order, so replies are matched to the
+    // requests in the order they were sent. Handlers must always reply.
+    //
+    // Each connection has one thread, owned by the client, which writes the
+    // requests and delivers the replies: asyncRequest() only queues the
+    // request and never waits for the socket. Callbacks are called with no
+    // lock held, so they may issue requests, or even destroy the client: its
+    // thread then fails the other pending requests and ends once the
+    // callback returns.
+    // When the connection is lost, pending requests fail and the next
+    // request opens a new connection.
+    // A request refused by a server over its limits fails with
+    // SocketOverloadedError.
+    
+    class SocketAsyncClient
+    {
+    public:
+        // Called on the connection thread, with error set if the request failed
+        using ReplyCallback = std::function<void(std::exception_ptr error, std::vector<std::string> && reply)>;
+        
+        explicit SocketAsyncClient(const std::string & path);
+        
+        // Pending requests fail with an error
+        ~SocketAsyncClient();
+        
+        SocketAsyncClient(const SocketAsyncClient &) = delete;
+        SocketAsyncClient & operator=(const SocketAsyncClient &) = delete;
+        
+        //methods
+        
+        // Throw if the server can't be reached, and then the request is not
+        // issued. Otherwise every failure is reported by the future, or the
+        // callback, which is called exactly once.
+        std::future<std::vector<std::string>> asyncRequest(const std::vector<std::string> & payload);
+        void asyncRequest(const std::vector<std::string> & payload, ReplyCallback callback);
+        
+    private:
+        struct Connection;
+        
+        std::shared_ptr<Connection> connect();
+        
+        // Body of the connection thread, which keeps the connection alive
+        // when the client is destroyed from a callback
+        static void run(std::shared_ptr<Connection> connection);
+        
+        //attributs
+        std::string m_path;
+        
+        //serializes the connection changes, never held by the connection threads
+        std::mutex m_mutex;
+        
+        //the last one is in use, the others are lost and their threads ending
+        std::vector<std::shared_ptr<Connection>> m_connections;
+    };
+    
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_async_client_test (bool verbose);
+//  @end
+
+#endif
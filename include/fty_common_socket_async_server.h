@@ -0,0 +1,108 @@
+/*  =========================================================================
+    fty_common_socket_async_server - Asynchronous handlers, replying from any thread
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_ASYNC_SERVER_H_INCLUDED
+#define FTY_COMMON_SOCKET_ASYNC_SERVER_H_INCLUDED
+
+#include "fty_common_sync_server.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace fty
+{
+    /**
+     * \brief Reply of a request handled by a SocketAsyncServer.
+     *
+     * Copies refer to the same request, which is completed once: by
+     * reply() or fail(), from any thread. Dropping the last copy without
+     * completing fails the request, so a client is never left waiting.
+     */
+    class SocketCompletion
+    {
+    public:
+        // Called once with the outcome of the request, on the thread
+        // completing it
+        using Callback = std::function<void(bool success, Payload && reply)>;
+        
+        explicit SocketCompletion(Callback callback);
+        
+        // Send reply to the client. An empty reply is not sent.
+        // Return false if the request was already completed.
+        bool reply(Payload reply) const;
+        
+        // Close the connection, like a SyncServer throwing
+        bool fail() const;
+        
+        bool isCompleted() const;
+    
+    private:
+        struct State;
+        
+        //attributs
+        std::shared_ptr<State> m_state;
+    };
+    
+    /**
+     * \brief Handler of SocketBasicServer replying out of band.
+     *
+     * handleRequest is called on the thread of the event loop, which serves
+     * the other clients as soon as it returns: it must not block. The
+     * reply is written when the completion is fulfilled, from any thread,
+     * so a handler waiting on other agents keeps as many requests in flight
+     * as it needs. The replies of a connection are sent in the order of its
+     * requests.
+     */
+    class SocketAsyncServer
+    {
+    public:
+        virtual ~SocketAsyncServer() = default;
+        
+        // request is only valid during the call
+        virtual void handleRequest(const std::string & sender, const Payload & request, SocketCompletion completion) = 0;
+    };
+    
+    /**
+     * \brief SyncServer seen as a SocketAsyncServer, replying before
+     *        handleRequest returns.
+     */
+    class SocketSyncServerAdapter : public SocketAsyncServer
+    {
+    public:
+        explicit SocketSyncServerAdapter(SyncServer & server);
+        
+        void handleRequest(const std::string & sender, const Payload & request, SocketCompletion completion) override;
+    
+    private:
+        //attributs
+        SyncServer & m_server;
+    };
+
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_async_server_test (bool verbose);
+//  @end
+
+#endif
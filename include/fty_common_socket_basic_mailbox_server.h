@@ -24,12 +24,153 @@
 
 #include "fty_common_sync_server.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
 
 namespace fty
 {
+    /**
+     * \brief Event engine used to wait for activity on the sockets.
+     * 
+     * EPOLL scales with the number of ready sockets and has no limit on the
+     * descriptor values. SELECT is the portable fallback, limited to
+     * descriptors lower than FD_SETSIZE. IO_URING submits the changes of
+     * the watched sockets and the wait in a single system call; it needs a
+     * build with io_uring support and a kernel allowing it, else run()
+     * throws.
+     */
+    enum class SocketEventEngine
+    {
+        SELECT,
+        EPOLL,
+        IO_URING
+    };
+    
+    class SocketArenaServer;
+    class SocketAsyncServer;
+    class SocketEncodedServer;
+    class SocketResponseCache;
+    class SocketStreamServer;
+    
+    /**
+     * \brief Tuning of SocketBasicServer, fixed at construction time.
+     */
+    struct SocketServerConfig
+    {
+        SocketEventEngine engine = SocketEventEngine::EPOLL;
+        
+        // Number of event loops. The first one runs on the thread of run(),
+        // each other one on its own thread. The loops accept on the same
+        // socket and each one owns the connections it accepted. With more
+        // than 1 loop, the handler must be thread safe.
+        size_t reactors = 1;
+        
+        // Number of threads running handleRequest, for each event loop. 0
+        // runs the handler on the thread of the loop. Otherwise the handler
+        // must be thread safe; the requests of one connection are still
+        // handled one after the other.
+        size_t workers = 0;
+        
+        // Frames of at least this size are passed to the clients in shared
+        // memory, when they accept it. Large frames from the clients are
+        // accepted the same way. 0 keeps all frames in the socket stream.
+        size_t sharedFrameSize = 0;
+        
+        // Frames of at least this size are compressed for the clients which
+        // accept it, and compressed frames are accepted from them. 0, or a
+        // build without LZ4, keeps all frames as they are.
+        size_t compressionThreshold = 0;
+        
+        // Limits protecting the server from its clients, 0 for no limit.
+        // A request refused because of a limit gets a reply made of a single
+        // reserved frame, which the clients raise as SocketOverloadedError.
+        //
+        // Connections beyond maxConnections get this reply to their first
+        // request and are closed; beyond twice the limit they are closed
+        // without reply.
+        size_t maxConnections = 0;
+        
+        // Requests handled or waiting for a worker, and streams, across the
+        // event loops. The requests beyond the limit get the overload reply
+        // without being handled. Only used with workers or streams.
+        size_t maxInflightRequests = 0;
+        
+        // Size of the largest request read from a connection. A larger one
+        // closes the connection, before it is buffered.
+        size_t maxRequestSize = 0;
+        
+        // Close the connections on which no byte moved for idleTimeout, and
+        // the ones whose request is not whole readTimeout after it started.
+        // 0 for no timeout. The connections are checked every quarter of the
+        // shortest timeout, a request in a handler is never timed out.
+        std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(0);
+        std::chrono::milliseconds readTimeout = std::chrono::milliseconds(0);
+        
+        // Handler of the requests of SocketSyncClient::streamRequest, none
+        // by default. Each stream holds a thread until it is over: each
+        // event loop runs up to maxStreams of them at once, and the streams
+        // beyond get the overload reply. A stream sends its reply in chunks
+        // of about streamChunkSize bytes. idleTimeout applies to each chunk;
+        // the connection is not watched during the stream.
+        SocketStreamServer * streamServer = nullptr;
+        size_t maxStreams = 4;
+        size_t streamChunkSize = 64 * 1024;
+        
+        // Replies of the SyncServer kept for the request types opted in,
+        // none by default, see fty_common_socket_response_cache.h. It can be
+        // shared by several servers.
+        SocketResponseCache * responseCache = nullptr;
+        
+        // Collect the counters and latencies returned by getMetrics().
+        bool metrics = false;
+        
+        // When not empty, a request made of this single frame is answered
+        // by the server with its metrics, as pairs of name and value frames.
+        std::string metricsRequest;
+    };
+    
+    /**
+     * \brief Distribution of durations, in buckets of powers of 2 microseconds.
+     * 
+     * buckets[0] counts durations below 1us, buckets[i] the ones in
+     * [2^(i-1), 2^i[ us, and the last bucket everything above.
+     */
+    struct SocketLatencyHistogram
+    {
+        std::vector<uint64_t> buckets;
+        uint64_t count = 0;
+        uint64_t totalNs = 0;
+        
+        // Upper bound in microseconds of the bucket holding the quantile (e.g. 0.99)
+        uint64_t percentile(double quantile) const;
+    };
+    
+    /**
+     * \brief Snapshot of the activity of a SocketBasicServer since its creation.
+     */
+    struct SocketServerMetrics
+    {
+        uint64_t connectionsAccepted = 0;
+        uint64_t connectionsClosed = 0;
+        uint64_t requests = 0;
+        uint64_t failedRequests = 0;
+        uint64_t overloadedRequests = 0;
+        uint64_t timedOutConnections = 0;
+        uint64_t bytesReceived = 0;
+        uint64_t bytesSent = 0;
+        
+        SocketLatencyHistogram receiveTime;     // reading the socket when readable
+        SocketLatencyHistogram queueTime;       // waiting for a worker
+        SocketLatencyHistogram handlerTime;     // in handleRequest
+        SocketLatencyHistogram sendTime;        // writing the reply
+    };
+    
+    class SocketMetrics;
    
     /**
      * \brief Handler for basic mailbox server using object
@@ -45,22 +186,105 @@ namespace fty
     public:
         explicit SocketBasicServer( fty::SyncServer & server,
                                     const std::string & path,
-                                    size_t maxClient = 30);
+                                    size_t maxClient = 30,
+                                    const SocketServerConfig & config = SocketServerConfig());
+        
+        // Serve the requests with a handler building its replies in the
+        // arena of the thread, see fty_common_socket_arena.h
+        explicit SocketBasicServer( fty::SocketArenaServer & server,
+                                    const std::string & path,
+                                    size_t maxClient = 30,
+                                    const SocketServerConfig & config = SocketServerConfig());
+        
+        // Serve the requests with a handler replying later, from any thread,
+        // see fty_common_socket_async_server.h. The handler is called on the
+        // event loops, the workers are not used.
+        explicit SocketBasicServer( fty::SocketAsyncServer & server,
+                                    const std::string & path,
+                                    size_t maxClient = 30,
+                                    const SocketServerConfig & config = SocketServerConfig());
+        
+        // Serve the requests with a handler replying with messages encoded
+        // beforehand, see fty_common_socket_encoded_message.h
+        explicit SocketBasicServer( fty::SocketEncodedServer & server,
+                                    const std::string & path,
+                                    size_t maxClient = 30,
+                                    const SocketServerConfig & config = SocketServerConfig());
         
         ~SocketBasicServer();
         
         void run();
+        
+        // Make run() return as soon as the event loops see it, closing the
+        // connections. The requests being handled are finished first.
+        // Can be called from any thread, no effect when not running.
         void requestStop();
+        
+        // Stop accepting connections and close the idle ones, then return
+        // from run() once the requests received are replied. Whatever is
+        // left at the deadline is stopped like requestStop() does. New
+        // clients wait in the backlog of the socket, served by the next
+        // run() if any.
+        void requestDrain(std::chrono::milliseconds timeout);
+        
         bool isRunning();
         
+        // Senders are identified by their user name, resolved once per
+        // connection and cached for the whole process. Forget the cached
+        // names, e.g. after a change in the user database.
+        static void invalidateSenderCache();
+        
+        // Empty when metrics are not enabled in the configuration.
+        // Can be called from any thread.
+        SocketServerMetrics getMetrics() const;
+        
     private:
+        // One of the handlers is set
+        SocketBasicServer(  fty::SyncServer * server,
+                            fty::SocketArenaServer * arenaServer,
+                            fty::SocketAsyncServer * asyncServer,
+                            fty::SocketEncodedServer * encodedServer,
+                            const std::string & path,
+                            size_t maxClient,
+                            const SocketServerConfig & config);
+        
+        enum class ServerState
+        {
+            STOPPED,
+            RUNNING,
+            DRAINING,
+            STOPPING
+        };
+        
+        // Event loop, run by each reactor
+        class EventLoop;
+        void runLoop();
+        
+        bool stopRequested() const { return m_state.load(std::memory_order_relaxed) == ServerState::STOPPING; }
+        
         //attributs
-        fty::SyncServer & m_server;
+        fty::SyncServer * m_server;
+        fty::SocketArenaServer * m_arenaServer;
+        fty::SocketAsyncServer * m_asyncServer;
+        fty::SocketEncodedServer * m_encodedServer;
         std::string m_path;
         size_t m_maxClient;
+        SocketServerConfig m_config;
         int m_serverSocket;
         
-        bool m_stopRequested = false;
+        //control of the event loops, signaled until run() returns
+        std::atomic<ServerState> m_state;
+        int m_stopEvent;
+        int m_drainEvent;
+        
+        //steady clock, in its own unit
+        std::atomic<int64_t> m_drainDeadline;
+        
+        //load, shared by the event loops
+        std::atomic<size_t> m_connections;
+        std::atomic<size_t> m_inflightRequests;
+        
+        std::unique_ptr<SocketMetrics> m_metrics;
     };
     
 } //namespace fty
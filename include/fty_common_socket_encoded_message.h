@@ -0,0 +1,97 @@
+/*  =========================================================================
+    fty_common_socket_encoded_message - Replies encoded once, sent many times
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_ENCODED_MESSAGE_H_INCLUDED
+#define FTY_COMMON_SOCKET_ENCODED_MESSAGE_H_INCLUDED
+
+#include "fty_common_sync_server.h"
+#include "fty_common_socket_frame.h"
+
+#include <memory>
+#include <string>
+
+namespace fty
+{
+    /**
+     * \brief Message held in the bytes written on the socket, in both
+     *        framings.
+     *
+     * Encoded at construction, then immutable: copies share the bytes, and
+     * can be sent from any thread without encoding nor copying them again.
+     * Frames are inline, neither shared nor compressed.
+     */
+    class SocketEncodedMessage
+    {
+    public:
+        // No message: not sent as a reply
+        SocketEncodedMessage() = default;
+        
+        // An empty payload is no message either
+        explicit SocketEncodedMessage(const Payload & payload);
+        
+        bool empty() const { return !m_data; }
+        size_t frames() const;
+        
+        // Bytes of the message in framing, the V2 header carrying the
+        // request id excluded
+        const std::string & encoded(SocketFraming framing) const;
+        
+        // Bytes held, in both framings
+        size_t size() const;
+    
+    private:
+        struct Data
+        {
+            size_t frames;
+            std::string v1;
+            std::string v2;
+        };
+        
+        //attributs
+        std::shared_ptr<const Data> m_data;
+    };
+    
+    /**
+     * \brief Handler of SocketBasicServer replying with encoded messages,
+     *        typically built once for data which rarely changes.
+     *
+     * Called like a SyncServer, on the event loop or on the workers. The
+     * request frames view the buffer the request was received in, they
+     * are only valid during the call.
+     */
+    class SocketEncodedServer
+    {
+    public:
+        virtual ~SocketEncodedServer() = default;
+        
+        // An empty reply is not sent
+        virtual SocketEncodedMessage handleRequest(const std::string & sender, const SocketPayload & request) = 0;
+    };
+
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_encoded_message_test (bool verbose);
+//  @end
+
+#endif
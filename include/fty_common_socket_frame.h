@@ -0,0 +1,122 @@
+/*  =========================================================================
+    fty_common_socket_frame - Binary safe frame sharing the buffer it was received in
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_FRAME_H_INCLUDED
+#define FTY_COMMON_SOCKET_FRAME_H_INCLUDED
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fty
+{
+    /**
+     * \brief Read-only, binary safe frame.
+     * 
+     * A frame is a view on bytes owned by a shared buffer. The frames of a
+     * received message all point into the buffer the message was read in,
+     * so they are never copied and can hold any byte, NUL included.
+     * Copying a frame only shares the buffer.
+     */
+    class SocketFrame
+    {
+    public:
+        SocketFrame() = default;
+        
+        // Copy the data in a buffer owned by the frame
+        explicit SocketFrame(const std::string & data);
+        
+        // Take the ownership of the string, without copying it
+        explicit SocketFrame(std::string && data);
+        
+        // View size bytes at data, kept alive by owner
+        SocketFrame(std::shared_ptr<const void> owner, const char * data, size_t size);
+        
+        const char * data() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        
+        // Copy of the frame content
+        std::string str() const { return std::string(m_data, m_size); }
+        
+        bool operator==(const SocketFrame & other) const;
+        bool operator!=(const SocketFrame & other) const { return !(*this == other); }
+        
+    private:
+        //attributs
+        std::shared_ptr<const void> m_owner;
+        const char * m_data = nullptr;
+        size_t m_size = 0;
+    };
+    
+    using SocketPayload = std::vector<SocketFrame>;
+    
+    /**
+     * \brief Wire format of the messages of a connection.
+     * 
+     * V1 sends fixed 32 bits lengths in host byte order, and a NUL after
+     * each frame. V2 starts the connection with a magic and version, then
+     * sends each message with a flags byte, an optional request id, and
+     * variable length integers for the count and sizes of the frames,
+     * without NUL. SocketBasicServer serves both on the same socket.
+     */
+    enum class SocketFraming
+    {
+        V1,
+        V2
+    };
+    
+    /**
+     * \brief Raised by the clients when the server refuses a request because
+     *        one of its limits is reached. The request was not handled and
+     *        can be retried later.
+     */
+    class SocketOverloadedError : public std::runtime_error
+    {
+    public:
+        explicit SocketOverloadedError(const std::string & what)
+        :   std::runtime_error(what)
+        {}
+    };
+    
+    /**
+     * \brief Raised by the clients when a request is not answered before its
+     *        deadline. The request may or may not have been handled.
+     */
+    class SocketTimeoutError : public std::runtime_error
+    {
+    public:
+        explicit SocketTimeoutError(const std::string & what)
+        :   std::runtime_error(what)
+        {}
+    };
+    
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_frame_test (bool verbose);
+//  @end
+
+#endif
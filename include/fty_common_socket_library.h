@@ -99,11 +99,32 @@ typedef struct _fty_common_socket_sync_client_t fty_common_socket_sync_client_t;
 #define FTY_COMMON_SOCKET_SYNC_CLIENT_T_DEFINED
 typedef struct _fty_common_socket_basic_mailbox_server_t fty_common_socket_basic_mailbox_server_t;
 #define FTY_COMMON_SOCKET_BASIC_MAILBOX_SERVER_T_DEFINED
+typedef struct _fty_common_socket_frame_t fty_common_socket_frame_t;
+#define FTY_COMMON_SOCKET_FRAME_T_DEFINED
+typedef struct _fty_common_socket_async_client_t fty_common_socket_async_client_t;
+#define FTY_COMMON_SOCKET_ASYNC_CLIENT_T_DEFINED
+typedef struct _fty_common_socket_stream_t fty_common_socket_stream_t;
+#define FTY_COMMON_SOCKET_STREAM_T_DEFINED
+typedef struct _fty_common_socket_arena_t fty_common_socket_arena_t;
+#define FTY_COMMON_SOCKET_ARENA_T_DEFINED
+typedef struct _fty_common_socket_async_server_t fty_common_socket_async_server_t;
+#define FTY_COMMON_SOCKET_ASYNC_SERVER_T_DEFINED
+typedef struct _fty_common_socket_response_cache_t fty_common_socket_response_cache_t;
+#define FTY_COMMON_SOCKET_RESPONSE_CACHE_T_DEFINED
+typedef struct _fty_common_socket_encoded_message_t fty_common_socket_encoded_message_t;
+#define FTY_COMMON_SOCKET_ENCODED_MESSAGE_T_DEFINED
 
 
 //  Public classes, each with its own header file
 #include "fty_common_socket_sync_client.h"
 #include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_encoded_message.h"
+#include "fty_common_socket_response_cache.h"
+#include "fty_common_socket_async_server.h"
+#include "fty_common_socket_arena.h"
+#include "fty_common_socket_stream.h"
+#include "fty_common_socket_async_client.h"
+#include "fty_common_socket_frame.h"
 
 #ifdef FTY_COMMON_SOCKET_BUILD_DRAFT_API
 
@@ -0,0 +1,148 @@
+/*  =========================================================================
+    fty_common_socket_response_cache - Cache of the replies to idempotent requests
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_RESPONSE_CACHE_H_INCLUDED
+#define FTY_COMMON_SOCKET_RESPONSE_CACHE_H_INCLUDED
+
+#include "fty_common_sync_server.h"
+#include "fty_common_socket_encoded_message.h"
+#include "fty_common_socket_frame.h"
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fty
+{
+    /**
+     * \brief Replies of a SyncServer kept for the requests which are
+     *        answered the same way until the data behind them changes.
+     *
+     * Nothing is cached until a request type is opted in with
+     * cacheRequests(): the type is the first frame of the request, and the
+     * whole request is the key, with the sender if the reply depends on
+     * who asks. The replies are kept as SocketEncodedMessage, so a hit is
+     * written without calling the handler nor encoding anything, in the
+     * framing of the client.
+     *
+     * Entries live until their time to live is over, until invalidated, or
+     * until the least recently used ones make room for new ones within
+     * maxBytes. A reply computed while its request is invalidated is not
+     * kept.
+     *
+     * Given to SocketBasicServer through SocketServerConfig::responseCache.
+     * This class is thread safe.
+     */
+    class SocketResponseCache
+    {
+    public:
+        explicit SocketResponseCache(size_t maxBytes = 4 * 1024 * 1024);
+        
+        SocketResponseCache(const SocketResponseCache &) = delete;
+        SocketResponseCache & operator=(const SocketResponseCache &) = delete;
+        
+        // Cache for ttl the replies to the requests starting with the frame
+        // type, for each sender if perSender. A ttl of 0 stops caching them.
+        void cacheRequests(const std::string & type, std::chrono::milliseconds ttl, bool perSender = false);
+        
+        // Forget the replies to the requests starting with the frame type
+        void invalidateType(const std::string & type);
+        
+        // Forget the replies to this request, for all the senders
+        void invalidate(const Payload & request);
+        
+        void clear();
+        
+        size_t entries() const;
+        
+        // Bytes held by the entries, keys included
+        size_t bytes() const;
+        
+        uint64_t hits() const;
+        uint64_t misses() const;
+    
+    private:
+        friend class SocketBasicServer;
+        
+        struct Rule
+        {
+            std::chrono::milliseconds ttl;
+            bool perSender;
+        };
+        
+        struct Entry
+        {
+            SocketEncodedMessage reply;
+            std::chrono::steady_clock::time_point expiry;
+            
+            //position in the use order, most recent first
+            std::list<const std::string *>::iterator use;
+        };
+        
+        using Entries = std::unordered_map<std::string, Entry>;
+        
+        // Return false if the request is not cached. Otherwise reply is the
+        // one kept, or empty: generation is then to be given to store() with
+        // the reply.
+        bool find(const std::string & sender, const SocketPayload & request,
+                  SocketEncodedMessage & reply, uint64_t & generation);
+        
+        // Keep the reply of a request found missing, and return it encoded.
+        SocketEncodedMessage store(const std::string & sender, const SocketPayload & request,
+                                   const Payload & reply, uint64_t generation);
+        
+        // Key of a request, in a buffer of the thread. Null if not cached.
+        const std::string * makeKey(const std::string & sender, const SocketPayload & request, Rule & rule);
+        
+        void erase(Entries::iterator entry);
+        
+        template <typename Predicate>
+        void eraseIf(Predicate predicate);
+        
+        //attributs
+        size_t m_maxBytes;
+        
+        mutable std::mutex m_mutex;
+        std::map<std::string, Rule> m_rules;
+        Entries m_entries;
+        std::list<const std::string *> m_uses;     //keys of the entries
+        size_t m_bytes = 0;
+        uint64_t m_hits = 0;
+        uint64_t m_misses = 0;
+        
+        //changed by each invalidation, replies computed before are not kept
+        uint64_t m_generation = 0;
+    };
+
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_response_cache_test (bool verbose);
+//  @end
+
+#endif
@@ -0,0 +1,131 @@
+/*  =========================================================================
+    fty_common_socket_stream - Streamed requests and replies, read and written chunk by chunk
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_STREAM_H_INCLUDED
+#define FTY_COMMON_SOCKET_STREAM_H_INCLUDED
+
+#include "fty_common_socket_frame.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace fty
+{
+    class SocketFrameReader;
+    class SocketFrameWriter;
+    
+    /**
+     * \brief Frames of a streamed request, read as the handler asks for them.
+     *
+     * The client sends the request in chunks, messages of a few frames, and
+     * ends it with an empty message. Only the chunk being read is in memory,
+     * the client is held back by the socket until it is consumed.
+     */
+    class SocketStreamReader
+    {
+    public:
+        // Read the chunks with reader. A chunk not received within
+        // idleTimeout raises SocketTimeoutError, 0 waits forever.
+        explicit SocketStreamReader(SocketFrameReader & reader,
+                                    std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(0));
+        
+        // Next frame of the request, blocking until the client sent it.
+        // Return false once the request is over.
+        bool next(SocketFrame & frame);
+        
+        // Read and drop the rest of the request
+        void skip();
+    
+    private:
+        //attributs
+        SocketFrameReader & m_reader;
+        std::chrono::milliseconds m_idleTimeout;
+        SocketPayload m_chunk;
+        size_t m_next = 0;
+        bool m_ended = false;
+    };
+    
+    /**
+     * \brief Reply to a streamed request, sent frame by frame.
+     *
+     * Frames are gathered in chunks of about chunkSize bytes. Sending a
+     * chunk blocks while the client has not read the previous one, so a
+     * handler producing faster than the client consumes is slowed down
+     * instead of buffering.
+     */
+    class SocketStreamWriter
+    {
+    public:
+        // A client not reading for idleTimeout raises SocketTimeoutError,
+        // 0 waits forever.
+        SocketStreamWriter(SocketFrameWriter & writer, size_t chunkSize,
+                           std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(0));
+        
+        void send(const SocketFrame & frame);
+        void send(const std::string & frame);
+        
+        // Send the frames gathered so far, and wait until the client took them
+        void flush();
+        
+        // Flush, then end the reply
+        void finish();
+        
+        // Total of the bytes written on the connection
+        uint64_t bytesSent() const { return m_bytesSent; }
+    
+    private:
+        //attributs
+        SocketFrameWriter & m_writer;
+        size_t m_chunkSize;
+        std::chrono::milliseconds m_idleTimeout;
+        SocketPayload m_chunk;
+        size_t m_chunkBytes = 0;
+        uint64_t m_bytesSent = 0;
+    };
+    
+    /**
+     * \brief Handler of the streamed requests of a SocketBasicServer.
+     *
+     * \see SocketServerConfig::streamServer
+     */
+    class SocketStreamServer
+    {
+    public:
+        virtual ~SocketStreamServer() = default;
+        
+        // Read the frames of the request from request, send the frames of
+        // the reply to reply. Called on the stream threads of the server,
+        // see SocketServerConfig::maxStreams, so it must be thread safe.
+        // The frames of the request left unread are dropped; throwing
+        // closes the connection.
+        virtual void handleStream(const std::string & sender, SocketStreamReader & request, SocketStreamWriter & reply) = 0;
+    };
+
+} //namespace fty
+
+//  @interface
+//  Self test of this class
+void
+    fty_common_socket_stream_test (bool verbose);
+//  @end
+
+#endif
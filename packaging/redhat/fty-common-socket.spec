@@ -52,6 +52,7 @@ BuildRequires:  log4cplus-devel
 BuildRequires:  fty-common-logging-devel
 BuildRequires:  fty-common-devel
 BuildRequires:  openssl-devel
+BuildRequires:  lz4-devel
 BuildRoot:      %{_tmppath}/%{name}-%{version}-build
 
 %description
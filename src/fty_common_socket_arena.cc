@@ -0,0 +1,296 @@
+/*  =========================================================================
+    fty_common_socket_arena - Arena allocator for the buffers of a request
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_arena - Arena allocator for the buffers of a request
+@discuss
+    SocketBasicServer rewinds the arena of its threads after each request.
+    The encoding of the messages takes its scratch buffers from it, and a
+    SocketArenaServer builds its replies in it, so serving a request needs
+    no allocation from the global heap once the arena is warm.
+@end
+*/
+
+#include "fty_common_socket_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace fty
+{
+    SocketArena::SocketArena(size_t blockSize)
+    :   m_blockSize(blockSize)
+    {
+    }
+    
+    void * SocketArena::allocate(size_t size, size_t alignment)
+    {
+        //continue in the current block, else in the next ones
+        while(m_block < m_blocks.size())
+        {
+            Block & block = m_blocks[m_block];
+            
+            uintptr_t start = reinterpret_cast<uintptr_t>(block.data.get());
+            size_t offset = ((start + m_offset + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1)) - start;
+            
+            if(offset + size <= block.size)
+            {
+                m_offset = offset + size;
+                return block.data.get() + offset;
+            }
+            
+            if(m_block + 1 == m_blocks.size())
+            {
+                break;
+            }
+            
+            m_block++;
+            m_offset = 0;
+        }
+        
+        //a new block, of its own for a large allocation
+        size_t blockSize = std::max(m_blockSize, size + alignment);
+        
+        Block block;
+        block.data.reset(new char[blockSize]);
+        block.size = blockSize;
+        m_blocks.push_back(std::move(block));
+        
+        m_block = m_blocks.size() - 1;
+        m_offset = 0;
+        
+        return allocate(size, alignment);
+    }
+    
+    void SocketArena::rewind(const Mark & mark)
+    {
+        //large blocks after the mark are not kept for next requests
+        for(size_t index = m_blocks.size(); index > mark.block + 1; index--)
+        {
+            if(m_blocks[index - 1].size > m_blockSize)
+            {
+                m_blocks.erase(m_blocks.begin() + (index - 1));
+            }
+        }
+        
+        m_block = mark.block;
+        m_offset = mark.offset;
+    }
+    
+    size_t SocketArena::capacity() const
+    {
+        size_t capacity = 0;
+        
+        for(const Block & block : m_blocks)
+        {
+            capacity += block.size;
+        }
+        
+        return capacity;
+    }
+    
+    SocketArena & SocketArena::threadArena()
+    {
+        static thread_local SocketArena t_arena;
+        
+        return t_arena;
+    }
+
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_sync_client.h"
+#include "fty_common_socket_test_server.h"
+#include <cassert>
+#include <stdio.h>
+#include <atomic>
+
+namespace
+{
+    // Echo server building its replies in the arena, fail on a frame "fail".
+    // Record the bytes held by the arena of the thread when a request comes.
+    class ArenaEchoServer : public fty::SocketArenaServer
+    {
+    public:
+        void handleRequest(const std::string & /*sender*/, const fty::SocketPayload & request, fty::SocketArenaPayload & reply) override
+        {
+            arenaCapacity = fty::SocketArena::threadArena().capacity();
+            inThreadArena = (reply.get_allocator().arena() == &fty::SocketArena::threadArena());
+
+            for(const fty::SocketFrame & frame : request)
+            {
+                if(frame.str() == "fail")
+                {
+                    throw std::runtime_error("Request failed");
+                }
+
+                reply.emplace_back(frame.data(), frame.size());
+            }
+        }
+
+        std::atomic<size_t> arenaCapacity{0};
+        std::atomic<bool> inThreadArena{false};
+    };
+}
+
+void
+fty_common_socket_arena_test (bool verbose)
+{
+    printf (" * fty_common_socket_arena: ");
+
+    //  @selftest
+    //  Allocations are aligned, and reuse the blocks once rewound
+    {
+        fty::SocketArena arena(1024);
+
+        void * first = arena.allocate(3, 1);
+        void * aligned = arena.allocate(8, 8);
+        assert(reinterpret_cast<uintptr_t>(aligned) % 8 == 0);
+        assert(static_cast<char *>(aligned) >= static_cast<char *>(first) + 3);
+        assert(arena.capacity() == 1024);
+
+        //past the end of the block continues in a new one
+        arena.allocate(1020, 1);
+        assert(arena.capacity() == 2048);
+
+        arena.reset();
+        assert(arena.allocate(3, 1) == first);
+
+        //the blocks are kept
+        arena.allocate(1020, 1);
+        arena.allocate(1000, 1);
+        assert(arena.capacity() == 2048);
+    }
+
+    //  Large allocations get a block of their own, released when rewound
+    {
+        fty::SocketArena arena(1024);
+        arena.allocate(10, 1);
+
+        {
+            fty::SocketArena::Scope scope(arena);
+            arena.allocate(100 * 1024, 1);
+            assert(arena.capacity() > 100 * 1024);
+        }
+
+        assert(arena.capacity() == 1024);
+    }
+
+    //  Scopes nest, each one releasing what was allocated in it
+    {
+        fty::SocketArena arena(1024);
+        void * outer = nullptr;
+        void * inner = nullptr;
+
+        {
+            fty::SocketArena::Scope outerScope(arena);
+            outer = arena.allocate(16, 1);
+
+            {
+                fty::SocketArena::Scope innerScope(arena);
+                inner = arena.allocate(16, 1);
+            }
+
+            assert(arena.allocate(16, 1) == inner);
+        }
+
+        assert(arena.allocate(16, 1) == outer);
+    }
+
+    //  Payloads whose vector and frames come from the arena
+    {
+        fty::SocketArena arena;
+
+        {
+            fty::SocketArena::Scope scope(arena);
+
+            fty::SocketArenaPayload reply{fty::SocketArenaAllocator<fty::SocketArenaString>(arena)};
+            reply.emplace_back("first frame, too long to be stored in the string");
+            reply.emplace_back(std::string(1000, 'x').c_str());
+
+            assert(reply.size() == 2);
+            assert(reply[1].size() == 1000);
+            assert(reply[0].get_allocator().arena() == &arena);
+            assert(reply[1].get_allocator() == reply.get_allocator().outer_allocator());
+        }
+
+        assert(arena.capacity() == 16 * 1024);
+        assert(&fty::SocketArena::threadArena() == &fty::SocketArena::threadArena());
+    }
+
+    //  Arena handler, on the loop and on workers, in both framings
+    for(size_t workers : {0, 2})
+    {
+        for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+        {
+            ArenaEchoServer server;
+
+            fty::SocketServerConfig config;
+            config.workers = workers;
+
+            fty::SocketBasicServer agent(  server,
+                                           "test.socket",
+                                           30,
+                                           config);
+
+            fty::SocketTestServer serverThread(agent);
+
+            fty::SocketClientConfig clientConfig;
+            clientConfig.framing = framing;
+
+            fty::SocketSyncClient syncClient("test.socket", clientConfig);
+
+            fty::Payload binaryPayload = {std::string("a\0b", 3), "", "frame"};
+            assert(syncClient.syncRequestWithReply(binaryPayload) == binaryPayload);
+            assert(server.inThreadArena);
+
+            //a large reply gets a block of its own, released after the request
+            fty::Payload largePayload = {std::string(256 * 1024, 'x'), "end"};
+            assert(syncClient.syncRequestWithReply(largePayload) == largePayload);
+
+            for(int request = 0; request < 10; request++)
+            {
+                fty::Payload expectedPayload = {"request", std::to_string(request)};
+                assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+                assert(server.arenaCapacity < 256 * 1024);
+            }
+
+            //a failing handler closes the connection, the next request uses a new one
+            try
+            {
+                syncClient.syncRequestWithReply({"fail"});
+                assert(false);
+            }
+            catch(std::exception &)
+            {
+            }
+
+            assert(syncClient.syncRequestWithReply({"after"}) == fty::Payload({"after"}));
+        }
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,529 @@
+/*  =========================================================================
+    fty_common_socket_async_client - Asynchronous client pipelining requests over one unix socket
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_async_client - Asynchronous client pipelining requests over one unix socket
+@discuss
+    The requests are written as soon as they are issued, so N requests cost
+    about one round trip instead of N. Replies are returned through futures
+    or callbacks.
+@end
+*/
+
+#include "fty_common_socket_async_client.h"
+#include "fty_common_socket_helpers.h"
+
+#include <deque>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace fty
+{
+    // State shared by the client and the thread of a connection
+    struct SocketAsyncClient::Connection
+    {
+        ~Connection()
+        {
+            if(socket != -1)
+            {
+                close(socket);
+            }
+            
+            if(wakeup != -1)
+            {
+                close(wakeup);
+            }
+        }
+        
+        int socket = -1;
+        
+        //eventfd waking up the thread for new requests, or the end
+        int wakeup = -1;
+        std::thread thread;
+        
+        std::mutex mutex;
+        
+        //requests not written yet
+        std::deque<Payload> outgoing;
+        
+        //requests waiting for their reply, in the order they were queued
+        std::deque<ReplyCallback> pending;
+        
+        //no more requests are queued: the connection is lost, or the client destroyed
+        bool closed = false;
+        bool destroyed = false;
+        
+        //the thread is done with the callbacks and may be joined
+        bool finished = false;
+    };
+    
+    static void signalWakeup(int wakeup)
+    {
+        uint64_t value = 1;
+        
+        if(write(wakeup, &value, sizeof(value)) != sizeof(value))
+        {
+            //already signaled
+        }
+    }
+    
+    static void clearWakeup(int wakeup)
+    {
+        uint64_t value;
+        
+        if(read(wakeup, &value, sizeof(value)) != sizeof(value))
+        {
+            //not signaled
+        }
+    }
+    
+    SocketAsyncClient::SocketAsyncClient(const std::string & path)
+    :   m_path(path)
+    {
+    }
+    
+    SocketAsyncClient::~SocketAsyncClient()
+    {
+        for(std::shared_ptr<Connection> & connection : m_connections)
+        {
+            {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                connection->closed = true;
+                connection->destroyed = true;
+            }
+            
+            signalWakeup(connection->wakeup);
+            
+            //destroyed from a callback: the thread ends once it returns
+            if(connection->thread.get_id() == std::this_thread::get_id())
+            {
+                connection->thread.detach();
+            }
+            else
+            {
+                connection->thread.join();
+            }
+        }
+    }
+    
+    std::future<std::vector<std::string>> SocketAsyncClient::asyncRequest(const std::vector<std::string> & payload)
+    {
+        std::shared_ptr<std::promise<std::vector<std::string>>> promise = std::make_shared<std::promise<std::vector<std::string>>>();
+        
+        asyncRequest(payload, [promise](std::exception_ptr error, std::vector<std::string> && reply)
+        {
+            if(error)
+            {
+                promise->set_exception(error);
+            }
+            else
+            {
+                promise->set_value(std::move(reply));
+            }
+        });
+        
+        return promise->get_future();
+    }
+    
+    void SocketAsyncClient::asyncRequest(const std::vector<std::string> & payload, ReplyCallback callback)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        for(;;)
+        {
+            std::shared_ptr<Connection> connection = m_connections.empty() ? connect() : m_connections.back();
+            
+            {
+                std::lock_guard<std::mutex> connectionLock(connection->mutex);
+                
+                if(!connection->closed)
+                {
+                    //the thread writes it, and reports its failures
+                    connection->outgoing.push_back(payload);
+                    connection->pending.push_back(std::move(callback));
+                    signalWakeup(connection->wakeup);
+                    return;
+                }
+            }
+            
+            //lost: open a new one
+            connect();
+        }
+    }
+    
+    std::shared_ptr<SocketAsyncClient::Connection> SocketAsyncClient::connect()
+    {
+        //the threads of the lost connections which are done with their callbacks only have to return
+        for(auto it = m_connections.begin(); it != m_connections.end();)
+        {
+            bool finished;
+            
+            {
+                std::lock_guard<std::mutex> lock((*it)->mutex);
+                finished = (*it)->finished;
+            }
+            
+            if(finished)
+            {
+                (*it)->thread.join();
+                it = m_connections.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+        connection->socket = connectToServer(m_path);
+        connection->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        
+        if(connection->wakeup == -1)
+        {
+            throw std::runtime_error(std::string("Event error: ") + strerror(errno));
+        }
+        
+        connection->thread = std::thread(&SocketAsyncClient::run, connection);
+        m_connections.push_back(connection);
+        
+        return connection;
+    }
+    
+    void SocketAsyncClient::run(std::shared_ptr<Connection> connection)
+    {
+        SocketFrameReader reader(connection->socket);
+        SocketFrameWriter writer(connection->socket);
+        
+        std::deque<Payload> outgoing;
+        std::exception_ptr error;
+        
+        //give the reply to the callback of its request, with no lock held
+        auto deliver = [&connection, &error](Payload && reply)
+        {
+            ReplyCallback callback;
+            
+            {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                
+                if(connection->destroyed)
+                {
+                    return false;
+                }
+                
+                if(connection->pending.empty())
+                {
+                    error = std::make_exception_ptr(std::runtime_error("Unexpected reply from the server"));
+                    return false;
+                }
+                
+                callback = std::move(connection->pending.front());
+                connection->pending.pop_front();
+            }
+            
+            //only this request was refused, the connection goes on
+            if(isOverloadedReply(reply))
+            {
+                callback(std::make_exception_ptr(SocketOverloadedError("Server overloaded")), std::vector<std::string>());
+            }
+            else
+            {
+                callback(nullptr, std::move(reply));
+            }
+            
+            return true;
+        };
+        
+        while(!error)
+        {
+            try
+            {
+                //cleared before taking the requests, so none queued after is missed
+                clearWakeup(connection->wakeup);
+                
+                {
+                    std::lock_guard<std::mutex> lock(connection->mutex);
+                    
+                    if(connection->destroyed)
+                    {
+                        break;
+                    }
+                    
+                    outgoing.swap(connection->outgoing);
+                }
+                
+                for(const Payload & payload : outgoing)
+                {
+                    writer.sendFrames(payload);
+                }
+                
+                outgoing.clear();
+                
+                struct pollfd fds[2];
+                fds[0].fd = connection->socket;
+                fds[0].events = POLLIN | (writer.hasPending() ? POLLOUT : 0);
+                fds[0].revents = 0;
+                fds[1].fd = connection->wakeup;
+                fds[1].events = POLLIN;
+                fds[1].revents = 0;
+                
+                if(poll(fds, 2, -1) == -1)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    
+                    throw std::runtime_error(std::string("Poll error: ") + strerror(errno));
+                }
+                
+                if(fds[0].revents & POLLOUT)
+                {
+                    writer.flush();
+                }
+                
+                if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    while(!error && reader.receive())
+                    {
+                        if(!deliver(reader.recvFrames()))
+                        {
+                            break;
+                        }
+                    }
+                }
+            }
+            catch(std::exception &)
+            {
+                error = std::current_exception();
+            }
+        }
+        
+        std::deque<ReplyCallback> failed;
+        
+        {
+            std::lock_guard<std::mutex> lock(connection->mutex);
+            connection->closed = true;
+            failed.swap(connection->pending);
+            
+            if(connection->destroyed)
+            {
+                error = std::make_exception_ptr(std::runtime_error("Client destroyed"));
+            }
+        }
+        
+        //this thread is done with the connection: fail what was waiting for it
+        for(ReplyCallback & request : failed)
+        {
+            request(error, std::vector<std::string>());
+        }
+        
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        connection->finished = true;
+    }
+    
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_unit_tests.h"
+#include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_test_server.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <stdio.h>
+
+void
+fty_common_socket_async_client_test (bool verbose)
+{
+    printf (" * fty_common_socket_async_client: ");
+
+    //  @selftest
+    //  Pipelined requests get their own reply, in order
+    {
+        fty::EchoServer server;
+        fty::SocketBasicServer agent(server, "test.socket");
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketAsyncClient asyncClient("test.socket");
+
+        std::vector<std::future<std::vector<std::string>>> replies;
+
+        for(int index = 0; index < 50; index++)
+        {
+            replies.push_back(asyncClient.asyncRequest({"request", std::to_string(index)}));
+        }
+
+        for(int index = 0; index < 50; index++)
+        {
+            assert(replies[index].get() == std::vector<std::string>({"request", std::to_string(index)}));
+        }
+
+        //  Callbacks are called from the receiving thread
+        std::promise<std::vector<std::string>> callbackReply;
+
+        asyncClient.asyncRequest({"callback"}, [&](std::exception_ptr error, std::vector<std::string> && reply)
+        {
+            assert(!error);
+            callbackReply.set_value(reply);
+        });
+
+        assert(callbackReply.get_future().get() == std::vector<std::string>({"callback"}));
+    }
+
+    //  Callbacks may issue requests while another thread fills the connection
+    {
+        fty::EchoServer server;
+        fty::SocketBasicServer agent(server, "test.socket");
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketAsyncClient asyncClient("test.socket");
+
+        const int count = 100;
+        std::atomic<int> again{0};
+        std::promise<void> done;
+
+        std::thread sender([&]()
+        {
+            for(int index = 0; index < count; index++)
+            {
+                asyncClient.asyncRequest({"request", std::string(256 * 1024, 'x')}, [&](std::exception_ptr error, std::vector<std::string> &&)
+                {
+                    assert(!error);
+
+                    asyncClient.asyncRequest({"again"}, [&](std::exception_ptr againError, std::vector<std::string> && reply)
+                    {
+                        assert(!againError);
+                        assert(reply == std::vector<std::string>({"again"}));
+
+                        if(++again == count)
+                        {
+                            done.set_value();
+                        }
+                    });
+                });
+            }
+        });
+
+        assert(done.get_future().wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+        sender.join();
+    }
+
+    //  A request lost with its connection fails once, through its callback, and the next one reconnects
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.maxRequestSize = 64 * 1024;
+
+        fty::SocketBasicServer agent(server, "test.socket", 30, config);
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketAsyncClient asyncClient("test.socket");
+
+        std::atomic<int> failures{0};
+        std::promise<void> failed;
+
+        asyncClient.asyncRequest({std::string(4 * 1024 * 1024, 'x')}, [&](std::exception_ptr error, std::vector<std::string> &&)
+        {
+            assert(error);
+
+            if(++failures == 1)
+            {
+                failed.set_value();
+            }
+        });
+
+        failed.get_future().wait();
+
+        assert(asyncClient.asyncRequest({"after"}).get() == std::vector<std::string>({"after"}));
+        assert(failures == 1);
+    }
+
+    //  The client may be destroyed from a callback, which fails the other pending requests
+    {
+        fty::EchoServer server;
+        fty::SocketBasicServer agent(server, "test.socket");
+        fty::SocketTestServer serverThread(agent);
+
+        std::unique_ptr<fty::SocketAsyncClient> asyncClient(new fty::SocketAsyncClient("test.socket"));
+
+        std::promise<void> issued;
+        std::shared_future<void> issuedFuture = issued.get_future().share();
+        std::promise<void> destroyed;
+
+        asyncClient->asyncRequest({"first"}, [&, issuedFuture](std::exception_ptr error, std::vector<std::string> &&)
+        {
+            assert(!error);
+            issuedFuture.wait();
+
+            asyncClient.reset();
+            destroyed.set_value();
+        });
+
+        std::future<std::vector<std::string>> second = asyncClient->asyncRequest({"second"});
+        issued.set_value();
+
+        destroyed.get_future().wait();
+
+        try
+        {
+            second.get();
+            assert(false);
+        }
+        catch(std::runtime_error &)
+        {
+        }
+    }
+
+    //  Pending requests fail when the client is destroyed, without a server reply
+    {
+        fty::EchoServer server;
+        fty::SocketBasicServer agent(server, "test.socket");
+
+        std::future<std::vector<std::string>> reply;
+
+        {
+            fty::SocketAsyncClient asyncClient("test.socket");
+            reply = asyncClient.asyncRequest({"never", "served"});
+        }
+
+        try
+        {
+            reply.get();
+            assert(false);
+        }
+        catch(std::exception &)
+        {
+        }
+    }
+    //  @end
+
+    printf ("OK\n");
+}
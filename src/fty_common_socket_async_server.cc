@@ -0,0 +1,558 @@
+/*  =========================================================================
+    fty_common_socket_async_server - Asynchronous handlers, replying from any thread
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_async_server - Asynchronous handlers, replying from any thread
+@discuss
+    A SocketAsyncServer given to SocketBasicServer receives each request
+    with a SocketCompletion. The event loop goes on with the other clients
+    while the request is in flight, and is woken up to write the reply once
+    the completion is fulfilled. SocketSyncServerAdapter serves a SyncServer
+    through the same interface.
+@end
+*/
+
+#include "fty_common_socket_async_server.h"
+
+#include <atomic>
+
+namespace fty
+{
+    struct SocketCompletion::State
+    {
+        explicit State(Callback callback)
+        :   callback(std::move(callback))
+        {}
+        
+        //the last copy is gone without a reply
+        ~State()
+        {
+            if(!completed.exchange(true))
+            {
+                try
+                {
+                    callback(false, Payload());
+                }
+                catch(...)
+                {
+                }
+            }
+        }
+        
+        Callback callback;
+        std::atomic<bool> completed{false};
+    };
+    
+    SocketCompletion::SocketCompletion(Callback callback)
+    :   m_state(std::make_shared<State>(std::move(callback)))
+    {
+    }
+    
+    bool SocketCompletion::reply(Payload reply) const
+    {
+        if(m_state->completed.exchange(true))
+        {
+            return false;
+        }
+        
+        m_state->callback(true, std::move(reply));
+        return true;
+    }
+    
+    bool SocketCompletion::fail() const
+    {
+        if(m_state->completed.exchange(true))
+        {
+            return false;
+        }
+        
+        m_state->callback(false, Payload());
+        return true;
+    }
+    
+    bool SocketCompletion::isCompleted() const
+    {
+        return m_state->completed;
+    }
+    
+    SocketSyncServerAdapter::SocketSyncServerAdapter(SyncServer & server)
+    :   m_server(server)
+    {
+    }
+    
+    void SocketSyncServerAdapter::handleRequest(const std::string & sender, const Payload & request, SocketCompletion completion)
+    {
+        Payload reply;
+        
+        try
+        {
+            reply = m_server.handleRequest(sender, request);
+        }
+        catch(...)
+        {
+            completion.fail();
+            return;
+        }
+        
+        completion.reply(std::move(reply));
+    }
+
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_unit_tests.h"
+#include "fty_common_socket_async_client.h"
+#include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_helpers.h"
+#include "fty_common_socket_stream.h"
+#include "fty_common_socket_sync_client.h"
+#include "fty_common_socket_test_server.h"
+#include <cassert>
+#include <stdexcept>
+#include <stdio.h>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    // Outcome of the requests of a test
+    struct Outcomes
+    {
+        int calls = 0;
+        bool success = false;
+        fty::Payload reply;
+
+        fty::SocketCompletion completion()
+        {
+            return fty::SocketCompletion([this](bool requestSuccess, fty::Payload && requestReply)
+            {
+                calls++;
+                success = requestSuccess;
+                reply = std::move(requestReply);
+            });
+        }
+    };
+
+    class FailingServer : public fty::SyncServer
+    {
+    public:
+        fty::Payload handleRequest(const fty::Sender & /*sender*/, const fty::Payload & /*payload*/) override
+        {
+            throw std::runtime_error("Request failed");
+        }
+    };
+
+    // Keep the requests in flight until replyReversed(). Fail a request
+    // "fail", drop the completion of a request "drop".
+    class DeferredEchoServer : public fty::SocketAsyncServer
+    {
+    public:
+        void handleRequest(const std::string & /*sender*/, const fty::Payload & request, fty::SocketCompletion completion) override
+        {
+            if(!request.empty() && (request[0] == "fail"))
+            {
+                completion.fail();
+                return;
+            }
+
+            if(!request.empty() && (request[0] == "drop"))
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.emplace_back(request, completion);
+            m_condition.notify_all();
+        }
+
+        size_t pendingCount()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_pending.size();
+        }
+
+        void waitPending(size_t count)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this, count]() { return m_pending.size() >= count; });
+        }
+
+        // Wait for count requests in flight, and reply to them from the
+        // calling thread, the last one first
+        void replyReversed(size_t count)
+        {
+            std::vector<std::pair<fty::Payload, fty::SocketCompletion>> requests;
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this, count]() { return m_pending.size() >= count; });
+                requests.swap(m_pending);
+            }
+
+            for(auto request = requests.rbegin(); request != requests.rend(); request++)
+            {
+                request->second.reply(request->first);
+            }
+        }
+
+    private:
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::vector<std::pair<fty::Payload, fty::SocketCompletion>> m_pending;
+    };
+
+    // Read the whole request, and reply with nothing
+    class DrainingStreamServer : public fty::SocketStreamServer
+    {
+    public:
+        void handleStream(const std::string & /*sender*/, fty::SocketStreamReader & request, fty::SocketStreamWriter & /*reply*/) override
+        {
+            fty::SocketFrame frame;
+
+            while(request.next(frame))
+            {
+            }
+        }
+    };
+}
+
+void
+fty_common_socket_async_server_test (bool verbose)
+{
+    printf (" * fty_common_socket_async_server: ");
+
+    //  @selftest
+    //  A request is completed once, by any of the copies of its completion
+    {
+        Outcomes outcomes;
+
+        {
+            fty::SocketCompletion completion = outcomes.completion();
+            fty::SocketCompletion copy = completion;
+
+            assert(!completion.isCompleted());
+            assert(copy.reply({"done"}));
+            assert(completion.isCompleted());
+
+            assert(!completion.reply({"again"}));
+            assert(!completion.fail());
+        }
+
+        assert(outcomes.calls == 1);
+        assert(outcomes.success);
+        assert(outcomes.reply == fty::Payload({"done"}));
+    }
+
+    //  A completion dropped without a reply fails its request
+    {
+        Outcomes outcomes;
+
+        {
+            fty::SocketCompletion completion = outcomes.completion();
+        }
+
+        assert(outcomes.calls == 1);
+        assert(!outcomes.success);
+    }
+
+    //  Completed from another thread
+    {
+        Outcomes outcomes;
+        fty::SocketCompletion completion = outcomes.completion();
+
+        std::thread completer([completion]()
+        {
+            completion.reply({"from", "thread"});
+        });
+
+        completer.join();
+
+        assert(outcomes.calls == 1);
+        assert(outcomes.reply == fty::Payload({"from", "thread"}));
+    }
+
+    //  The adapter replies with the SyncServer, and fails when it throws
+    {
+        fty::EchoServer echoServer;
+        fty::SocketSyncServerAdapter echo(echoServer);
+
+        Outcomes outcomes;
+        echo.handleRequest("sender", {"echo", "me"}, outcomes.completion());
+
+        assert(outcomes.calls == 1);
+        assert(outcomes.success);
+        assert(outcomes.reply == fty::Payload({"echo", "me"}));
+
+        FailingServer failingServer;
+        fty::SocketSyncServerAdapter failing(failingServer);
+
+        Outcomes failed;
+        failing.handleRequest("sender", {"fail"}, failed.completion());
+
+        assert(failed.calls == 1);
+        assert(!failed.success);
+    }
+
+    //  Asynchronous handler: the requests stay in flight on the loop, replied in order whatever the completion order
+    {
+        DeferredEchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        {
+            fty::SocketAsyncClient asyncClient("test.socket");
+            std::vector<std::future<fty::Payload>> replies;
+
+            for(int request = 0; request < 1000; request++)
+            {
+                replies.push_back(asyncClient.asyncRequest({"request", std::to_string(request)}));
+            }
+
+            server.replyReversed(1000);
+
+            for(int request = 0; request < 1000; request++)
+            {
+                assert(replies[request].get() == fty::Payload({"request", std::to_string(request)}));
+            }
+        }
+
+        //a failed or abandoned request closes its connection
+        {
+            fty::SocketSyncClient syncClient( "test.socket", 1);
+
+            for(const char * request : {"fail", "drop"})
+            {
+                try
+                {
+                    syncClient.syncRequestWithReply({request});
+                    assert(false);
+                }
+                catch(std::exception &)
+                {
+                }
+            }
+
+            std::thread replier([&server]() { server.replyReversed(1); });
+            assert(syncClient.syncRequestWithReply({"after"}) == fty::Payload({"after"}));
+            replier.join();
+        }
+    }
+
+    //  Requests in flight in the asynchronous handler count for the in-flight limit
+    {
+        DeferredEchoServer server;
+
+        fty::SocketServerConfig config;
+        config.maxInflightRequests = 10;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketAsyncClient asyncClient("test.socket");
+        std::vector<std::future<fty::Payload>> replies;
+
+        for(int request = 0; request < 10; request++)
+        {
+            replies.push_back(asyncClient.asyncRequest({std::to_string(request)}));
+        }
+
+        server.waitPending(10);
+
+        //refused on another connection
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+
+        try
+        {
+            syncClient.syncRequestWithReply({"refused"});
+            assert(false);
+        }
+        catch(fty::SocketOverloadedError &)
+        {
+        }
+
+        server.replyReversed(10);
+
+        for(int request = 0; request < 10; request++)
+        {
+            assert(replies[request].get() == fty::Payload({std::to_string(request)}));
+        }
+
+        //back under the limit
+        std::thread nextReplier([&server]() { server.replyReversed(1); });
+        assert(syncClient.syncRequestWithReply({"next"}) == fty::Payload({"next"}));
+        nextReplier.join();
+    }
+
+    //  A client which doesn't wait for its replies is not read beyond a bound of requests in flight
+    {
+        DeferredEchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketAsyncClient asyncClient("test.socket");
+        std::vector<std::future<fty::Payload>> replies;
+
+        for(int request = 0; request < 3000; request++)
+        {
+            replies.push_back(asyncClient.asyncRequest({std::to_string(request)}));
+        }
+
+        //the bound of the server
+        const size_t maxAsyncReplies = 1024;
+
+        server.waitPending(maxAsyncReplies);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(server.pendingCount() == maxAsyncReplies);
+
+        //each batch of replies lets the next requests in
+        server.replyReversed(maxAsyncReplies);
+        server.replyReversed(maxAsyncReplies);
+        server.replyReversed(3000 - 2 * maxAsyncReplies);
+
+        for(int request = 0; request < 3000; request++)
+        {
+            assert(replies[request].get() == fty::Payload({std::to_string(request)}));
+        }
+    }
+
+    //  A stream request waits for the replies of the requests before it
+    {
+        DeferredEchoServer server;
+        DrainingStreamServer streamServer;
+
+        fty::SocketServerConfig config;
+        config.streamServer = &streamServer;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        int socket = fty::connectToServer("test.socket");
+        fty::sendFrames(socket, fty::Payload({"first"}));
+        fty::sendFrames(socket, fty::Payload({fty::streamFrame}));
+
+        server.waitPending(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        server.replyReversed(1);
+
+        fty::SocketFrameReader reader(socket);
+        assert(reader.recvFrames() == fty::Payload({"first"}));
+        assert(reader.recvFrames() == fty::Payload({fty::streamAcceptedFrame}));
+
+        //an empty request, and its empty reply
+        fty::sendFrames(socket, fty::Payload());
+        assert(reader.recvFrames().empty());
+
+        //back to the asynchronous requests
+        fty::sendFrames(socket, fty::Payload({"after"}));
+        server.replyReversed(1);
+        assert(reader.recvFrames() == fty::Payload({"after"}));
+
+        close(socket);
+    }
+
+    //  Drain: the requests still in flight at the deadline are dropped, and the next run serves again
+    {
+        DeferredEchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketAsyncClient asyncClient("test.socket");
+        std::future<fty::Payload> dropped = asyncClient.asyncRequest({"never"});
+        server.waitPending(1);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        agent.requestDrain(std::chrono::milliseconds(100));
+
+        serverThread.join();
+
+        assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+
+        try
+        {
+            dropped.get();
+            assert(false);
+        }
+        catch(std::exception &)
+        {
+        }
+
+        //not running: no effect on the next run
+        agent.requestStop();
+        agent.requestDrain(std::chrono::milliseconds(0));
+
+        fty::SocketTestServer secondRun(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket");
+        std::thread replier([&server]() { server.replyReversed(2); });
+        assert(syncClient.syncRequestWithReply({"again"}) == fty::Payload({"again"}));
+        replier.join();
+    }
+
+    //  Synchronous handler through the adapter, in both framings
+    for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+    {
+        fty::EchoServer echoServer;
+        fty::SocketSyncServerAdapter server(echoServer);
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketClientConfig clientConfig;
+        clientConfig.framing = framing;
+
+        fty::SocketSyncClient syncClient("test.socket", clientConfig);
+
+        for(int request = 0; request < 100; request++)
+        {
+            fty::Payload expectedPayload = {"request", std::to_string(request)};
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -26,34 +26,437 @@
 @end
 */
 #include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_arena.h"
+#include "fty_common_socket_async_server.h"
+#include "fty_common_socket_encoded_message.h"
+#include "fty_common_socket_response_cache.h"
+#include "fty_common_socket_stream.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <pwd.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 
+#include "fty_common_socket_credentials.h"
 #include "fty_common_socket_helpers.h"
+#include "fty_common_socket_metrics.h"
+#include "fty_common_socket_poller.h"
+#include "fty_common_socket_worker_pool.h"
 
 //  Structure of our class
 namespace fty
 {
+    // Wake up the loops watching an eventfd, until it is cleared
+    static void signalEvent(int event)
+    {
+        uint64_t value = 1;
+        
+        if(write(event, &value, sizeof(value)) != sizeof(value))
+        {
+            //error
+        }
+    }
+    
+    static void clearEvent(int event)
+    {
+        uint64_t value;
+        
+        if(read(event, &value, sizeof(value)) != sizeof(value))
+        {
+            //not signaled
+        }
+    }
+    
+    // Reply of a request in flight in a SocketAsyncServer.
+    // Filled by its completion, under the mutex of AsyncCompletions.
+    struct AsyncReply
+    {
+        uint64_t requestId = 0;
+        std::chrono::steady_clock::time_point start;
+        
+        //refused over the in-flight limit, not handled
+        bool overloaded = false;
+        
+        bool done = false;
+        bool success = false;
+        Payload reply;
+    };
+    
+    // Requests of an event loop completed by the asynchronous handler
+    struct AsyncCompletions
+    {
+        std::mutex mutex;
+        
+        //connections with a completed reply, to be sent by the loop
+        std::vector<int> sockets;
+        
+        //wakes up the loop when completed by another thread, -1 once the loop is over
+        int notify = -1;
+        std::thread::id loopThread;
+        
+        //requests in flight, forgotten when the loop is over
+        std::atomic<size_t> * inflight = nullptr;
+        size_t outstanding = 0;
+    };
+    
+    // State of an accepted connection
+    struct ClientConnection
+    {
+        ClientConnection(int socket, const std::string & user)
+        :   reader(socket), writer(socket), sender(user)
+        {}
+        
+        SocketFrameReader reader;
+        SocketFrameWriter writer;
+        std::string sender;
+        
+        //request being handled, viewing the receive buffer. Cleared once
+        //handled, so the buffer and the strings of the copy are reused.
+        SocketPayload request;
+        Payload textRequest;
+        
+        //requests given to the asynchronous handler, replied in this order
+        std::deque<std::shared_ptr<AsyncReply>> asyncReplies;
+        
+        //accepted beyond the connection limit: refuse the first request and close
+        bool overloaded = false;
+        
+        //a worker owns the connection until it replied
+        bool dispatched = false;
+        
+        //not watched until some asynchronous replies are sent, see dispatchBuffered
+        bool paused = false;
+        
+        //for the timeouts: last time bytes moved, and start of the request being received
+        std::chrono::steady_clock::time_point lastActivity;
+        std::chrono::steady_clock::time_point requestStart;
+        bool receiving = false;
+    };
+    
+    // Frames above this size are not kept in the strings reused by the next requests
+    static constexpr size_t maxReusedFrameSize = 64 * 1024;
+    
+    // Replies of a batch held back before they are written together
+    static constexpr size_t maxBatchBytes = 64 * 1024;
+    
+    // Requests of a connection given to the asynchronous handler and not
+    // replied yet, beyond which the connection is not read anymore
+    static constexpr size_t maxAsyncReplies = 1024;
+    
+    static bool isFrame(const SocketFrame & frame, const std::string & value)
+    {
+        return (frame.size() == value.size()) && (memcmp(frame.data(), value.data(), value.size()) == 0);
+    }
+    
+    // Copy the request in the strings given to a SyncServer, reusing those of the previous request
+    static const Payload & textRequest(ClientConnection & connection)
+    {
+        Payload & text = connection.textRequest;
+        text.resize(connection.request.size());
+        
+        for(size_t index = 0; index < text.size(); index++)
+        {
+            text[index].assign(connection.request[index].data(), connection.request[index].size());
+        }
+        
+        return text;
+    }
+    
+    // Once handled, the receive buffer goes back to the reader and large strings to the heap
+    static void releaseRequest(ClientConnection & connection)
+    {
+        connection.request.clear();
+        
+        for(std::string & frame : connection.textRequest)
+        {
+            if(frame.capacity() > maxReusedFrameSize)
+            {
+                std::string().swap(frame);
+            }
+        }
+    }
+    
+    // Send the reply if it's not empty, without blocking
+    template <typename Reply>
+    static void sendReply(ClientConnection & connection, const Reply & reply, uint64_t requestId,
+                          SocketMetrics * metrics, std::chrono::steady_clock::time_point start)
+    {
+        if(reply.empty())
+        {
+            return;
+        }
+        
+        size_t sent = connection.writer.sendFrames(reply, requestId);
+        
+        if(metrics)
+        {
+            metrics->record(SocketTimer::SEND, std::chrono::steady_clock::now() - start);
+            metrics->add(SocketCounter::BYTES_SENT, sent);
+        }
+    }
+    
+    // Reply to the capabilities request of a client, and use the ones both accept
+    static Payload negotiateCapabilities(ClientConnection & connection, const Payload & request, const SocketServerConfig & config)
+    {
+        Payload reply = {capabilitiesFrame};
+        
+        auto requested = [&request](const std::string & capability)
+        {
+            return std::find(request.begin() + 1, request.end(), capability) != request.end();
+        };
+        
+        if((config.sharedFrameSize > 0) && requested(sharedFramesCapability))
+        {
+            reply.push_back(sharedFramesCapability);
+            connection.writer.setSharedFrameSize(config.sharedFrameSize);
+            connection.reader.setSharedFrames(true);
+        }
+        
+        if((config.compressionThreshold > 0) && isCompressionAvailable() && requested(compressionCapability))
+        {
+            reply.push_back(compressionCapability);
+            connection.writer.setCompressionThreshold(config.compressionThreshold);
+            connection.reader.setCompression(true);
+        }
+        
+        return reply;
+    }
+    
+    // Accept a streamed request and run its handler, blocking on the connection until both ends are over
+    static void serveStream(ClientConnection & connection, const SocketServerConfig & config, SocketMetrics * metrics)
+    {
+        typedef std::chrono::steady_clock Clock;
+        
+        SocketFrameReader & reader = connection.reader;
+        SocketFrameWriter & writer = connection.writer;
+        
+        uint64_t received = reader.bytesReceived();
+        size_t accepted = 0;
+        Clock::time_point start;
+        
+        if(metrics)
+        {
+            metrics->add(SocketCounter::REQUESTS);
+            start = Clock::now();
+        }
+        
+        SocketStreamReader request(reader, config.idleTimeout);
+        SocketStreamWriter reply(writer, config.streamChunkSize, config.idleTimeout);
+        
+        try
+        {
+            writer.setFraming(reader.framing());
+            accepted = writer.sendFrames({streamAcceptedFrame}, reader.requestId());
+            
+            config.streamServer->handleStream(connection.sender, request, reply);
+            
+            //the client sends its whole request before reading the end of the reply
+            request.skip();
+            reply.finish();
+        }
+        catch(...)
+        {
+            if(metrics)
+            {
+                metrics->add(SocketCounter::FAILED_REQUESTS);
+            }
+            
+            throw;
+        }
+        
+        //back to requests read by the loop
+        reader.setDeadline(noDeadline);
+        
+        if(metrics)
+        {
+            metrics->record(SocketTimer::HANDLER, Clock::now() - start);
+            metrics->add(SocketCounter::BYTES_RECEIVED, reader.bytesReceived() - received);
+            metrics->add(SocketCounter::BYTES_SENT, accepted + reply.bytesSent());
+        }
+    }
+
+    // Event loop run by each reactor of a SocketBasicServer, with the
+    // connections it accepted. Not thread safe, except for the completions
+    // posted by the workers, the streams and the asynchronous handler.
+    class SocketBasicServer::EventLoop
+    {
+    public:
+        explicit EventLoop(SocketBasicServer & owner);
+        
+        // Wait for the handlers in progress, then close the connections
+        ~EventLoop();
+        
+        EventLoop(const EventLoop &) = delete;
+        EventLoop & operator=(const EventLoop &) = delete;
+        
+        // Return once the server is stopped, or drained
+        void run();
+        
+    private:
+        typedef std::chrono::steady_clock Clock;
+        
+        void acceptConnection();
+        void closeConnection(int socket);
+        
+        // Serve a client socket which is readable, or writable with replies pending
+        void serveConnection(int socket);
+        
+        // Resume the connections whose request was handled by a worker or a stream
+        void resumeCompleted();
+        
+        // Read without blocking, return true when a whole request is buffered
+        bool receiveRequest(ClientConnection & connection);
+        
+        // Call the handler on connection.request and send its reply without blocking, throw in case of failure
+        void executeRequest(ClientConnection & connection, uint64_t requestId);
+        
+        bool isStreamRequest(const ClientConnection & connection) const;
+        
+        // True when a request must get the overload reply instead of a worker or a stream
+        bool inflightLimitReached() const;
+        
+        // Execute connection.request, then the requests received with it in the same buffer, writing
+        // their replies together. A stream request is left in connection.request for the loop.
+        void executeBatch(ClientConnection & connection);
+        
+        // Refuse the request just received without handling it
+        void sendOverloaded(ClientConnection & connection, uint64_t requestId);
+        
+        // Give the request to the asynchronous handler, its reply is sent once completed by sendAsyncReplies
+        void executeAsync(int socket, ClientConnection & connection);
+        
+        // Send the replies completed by the asynchronous handler, each connection in the order of its requests
+        void sendAsyncReplies();
+        
+        // Send the asynchronous replies of the connection done so far, throw in case of failure
+        void sendDoneReplies(ClientConnection & connection);
+        
+        // The connection is not watched until the worker sent the reply, to keep requests ordered.
+        // The loop doesn't touch the connection until the worker is done with it.
+        void dispatchToWorker(int socket, ClientConnection & connection);
+        
+        // The stream thread owns the connection until both ends of the stream are over.
+        // Return false, after the overload reply, when the stream threads are all busy.
+        bool dispatchStream(int socket, ClientConnection & connection);
+        
+        // Handle the buffered requests as long as the socket takes the replies, on the loop or by a worker.
+        // Return true if the connection is now owned by a worker or a stream thread, or paused: with too
+        // many asynchronous replies outstanding, or a stream request waiting for them all.
+        // Requests beyond the in-flight limit are refused on the spot.
+        bool dispatchBuffered(int socket, ClientConnection & connection);
+        
+        // Close the connections which went past a timeout
+        void closeTimedOut();
+        
+        // Once draining: stop accepting, and close the connections without request in progress.
+        // Return true when the loop is over, all replied or at the deadline.
+        bool drainConnections();
+        
+        //attributs
+        SocketBasicServer & m_owner;
+        const SocketServerConfig & m_config;
+        
+        //null when metrics are disabled, in which case the clock is never read
+        SocketMetrics * m_metrics;
+        
+        std::unique_ptr<SocketPoller> m_poller;
+        
+        //wake up the loop when a worker completed a request
+        int m_wakeup;
+        
+        //client connections, with their receive buffer and sender
+        std::map<int, ClientConnection> m_clients;
+        
+        //connections handed to workers, with the status of their reply
+        std::mutex m_completedMutex;
+        std::vector<std::pair<int, bool>> m_completedRequests;
+        std::unique_ptr<SocketWorkerPool> m_workers;
+        
+        //threads of the streams, created with the first one, and the connections they own
+        std::unique_ptr<SocketWorkerPool> m_streamPool;
+        std::set<int> m_streams;
+        
+        //replies of the asynchronous handler, completed from any thread
+        std::shared_ptr<AsyncCompletions> m_completions;
+        
+        //swapped with the sockets of m_completions, keeping their capacity
+        std::vector<int> m_completedSockets;
+        
+        //the connections are checked for timeouts periodically, with the clock read once per wake up
+        std::chrono::milliseconds m_idleTimeout;
+        std::chrono::milliseconds m_readTimeout;
+        std::chrono::milliseconds m_checkPeriod;
+        bool m_timeouts;
+        
+        Clock::time_point m_now;
+        Clock::time_point m_nextCheck;
+        
+        bool m_draining;
+    };
 
     SocketBasicServer::SocketBasicServer(   fty::SyncServer & server,
                                             const std::string & path,
-                                            size_t maxClient)
-     : m_server(server), m_path(path), m_maxClient(maxClient)
+                                            size_t maxClient,
+                                            const SocketServerConfig & config)
+     : SocketBasicServer(&server, nullptr, nullptr, nullptr, path, maxClient, config)
+    {
+    }
+    
+    SocketBasicServer::SocketBasicServer(   fty::SocketArenaServer & server,
+                                            const std::string & path,
+                                            size_t maxClient,
+                                            const SocketServerConfig & config)
+     : SocketBasicServer(nullptr, &server, nullptr, nullptr, path, maxClient, config)
+    {
+    }
+    
+    SocketBasicServer::SocketBasicServer(   fty::SocketAsyncServer & server,
+                                            const std::string & path,
+                                            size_t maxClient,
+                                            const SocketServerConfig & config)
+     : SocketBasicServer(nullptr, nullptr, &server, nullptr, path, maxClient, config)
+    {
+    }
+    
+    SocketBasicServer::SocketBasicServer(   fty::SocketEncodedServer & server,
+                                            const std::string & path,
+                                            size_t maxClient,
+                                            const SocketServerConfig & config)
+     : SocketBasicServer(nullptr, nullptr, nullptr, &server, path, maxClient, config)
+    {
+    }
+    
+    SocketBasicServer::SocketBasicServer(   fty::SyncServer * server,
+                                            fty::SocketArenaServer * arenaServer,
+                                            fty::SocketAsyncServer * asyncServer,
+                                            fty::SocketEncodedServer * encodedServer,
+                                            const std::string & path,
+                                            size_t maxClient,
+                                            const SocketServerConfig & config)
+     : m_server(server), m_arenaServer(arenaServer), m_asyncServer(asyncServer), m_encodedServer(encodedServer), m_path(path), m_maxClient(maxClient), m_config(config),
+       m_state(ServerState::STOPPED), m_drainDeadline(0), m_connections(0), m_inflightRequests(0)
     {        
         m_serverSocket = -1;
-        m_pipe[0] = -1;
-        m_pipe[1] = -1;
+        m_stopEvent = -1;
+        m_drainEvent = -1;
         
         struct sockaddr_un name;
         int ret;
@@ -107,9 +510,24 @@ namespace fty
             throw std::runtime_error("Impossible to listen on the Unix socket "+m_path+": " + std::string(strerror(errno)));
         }
         
-        if (pipe(m_pipe) < 0)
+        //several event loops may accept: the ones which lose the race must not block
+        if(fcntl(m_serverSocket, F_SETFL, fcntl(m_serverSocket, F_GETFL) | O_NONBLOCK) == -1)
+        {
+            throw std::runtime_error("Impossible to configure the Unix socket "+m_path+": " + std::string(strerror(errno)));
+        }
+        
+        //the control events are watched by every event loop, and cleared by run()
+        m_stopEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_drainEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        
+        if ((m_stopEvent == -1) || (m_drainEvent == -1))
+        {
+            throw std::runtime_error("Impossible to create the events: " + std::string(strerror(errno)));
+        }
+        
+        if(m_config.metrics)
         {
-            throw std::runtime_error("Impossible to create the pipe: " + std::string(strerror(errno)));
+            m_metrics.reset(new SocketMetrics());
         }
          
     }
@@ -118,8 +536,8 @@ namespace fty
     {
 
         close(m_serverSocket);
-        close(m_pipe[0]);
-        close(m_pipe[1]);
+        close(m_stopEvent);
+        close(m_drainEvent);
 
         /* Unlink the socket. */
         unlink(m_path.c_str());
@@ -127,260 +545,2124 @@ namespace fty
     
     void SocketBasicServer::run()
     {
-        if(m_running)
+        ServerState stopped = ServerState::STOPPED;
+        
+        if(!m_state.compare_exchange_strong(stopped, ServerState::RUNNING))
         {
             throw std::runtime_error("Already running");
         }
         
-        m_running = true;
+        //forget the events of a previous run, the state tells if a stop is requested
+        clearEvent(m_stopEvent);
+        clearEvent(m_drainEvent);
         
-        // Clear the reference set of socket
-        fd_set socketsSet;
-        FD_ZERO(&socketsSet);
-
-        // Add the server socket
-        FD_SET(m_serverSocket, &socketsSet);
-        int lastSocket = m_serverSocket;
+        //the first loop runs on this thread, the others on their own
+        size_t reactors = std::max<size_t>(1, m_config.reactors);
+        std::vector<std::exception_ptr> errors(reactors);
+        std::vector<std::thread> threads;
+        
+        auto runReactor = [this, &errors](size_t index)
+        {
+            try
+            {
+                runLoop();
+            }
+            catch(...)
+            {
+                errors[index] = std::current_exception();
+                
+                //don't leave the other loops running
+                requestStop();
+            }
+        };
         
-        //Add the pipe
-        FD_SET(m_pipe[0], &socketsSet);
-        if (m_pipe[0] > lastSocket)
+        try
         {
-            // Keep track of the maximum
-            lastSocket = m_pipe[0];
+            for(size_t index = 1; index < reactors; index++)
+            {
+                threads.emplace_back(runReactor, index);
+            }
         }
-
-        //infini loop for handling connection
-        for (;;)
+        catch(...)
         {
-            fd_set tmpSockets = socketsSet;
-
-            // Detect activity on the sockets
-            if (select(lastSocket+1, &tmpSockets, NULL, NULL, NULL) == -1)
-            {
-              if(m_stopRequested)
-              {
-                break;
-              }
-              else
-              {
-                //error case
-                continue;
-              }
+            errors[0] = std::current_exception();
+            requestStop();
+        }
+        
+        if(!errors[0])
+        {
+            runReactor(0);
+        }
+        
+        for(std::thread & thread : threads)
+        {
+            thread.join();
+        }
+        
+        m_state = ServerState::STOPPED;
+        
+        for(const std::exception_ptr & error : errors)
+        {
+            if(error)
+            {
+                std::rethrow_exception(error);
             }
+        }
+    }
+    
+    void SocketBasicServer::runLoop()
+    {
+        EventLoop loop(*this);
+        loop.run();
+    }
+    
+    SocketBasicServer::EventLoop::EventLoop(SocketBasicServer & owner)
+    :   m_owner(owner), m_config(owner.m_config), m_metrics(owner.m_metrics.get()), m_wakeup(-1),
+        m_timeouts(false), m_draining(false)
+    {
+        try
+        {
+            m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
             
-            if(m_stopRequested)
+            if (m_wakeup == -1)
             {
-               break;
+                throw std::runtime_error("Impossible to create the event: " + std::string(strerror(errno)));
             }
-
-            // Run through the existing connections looking for data to be read
-            for (int socket = 0; socket <= lastSocket; socket++)
+            
+            if(m_config.workers > 0)
             {
-
-                if (!FD_ISSET(socket, &tmpSockets))
-                {
-                    // Nothing change on the socket
-                    continue;
-                }
-
-                if (socket == m_serverSocket)
-                {
-                    // A client is asking a new connection
-                    socklen_t addrlen;
-                    struct sockaddr_storage clientaddr;
-                    int newSocket;
-
-                    // Handle a new connection
-                    addrlen = sizeof(clientaddr);
-                    memset(&clientaddr, 0, sizeof(clientaddr));
-
-                    newSocket = accept(m_serverSocket, (struct sockaddr *)&clientaddr, &addrlen);
-
-                    if (newSocket != -1)
-                    {
-                        //save the socket
-                        FD_SET(newSocket, &socketsSet);
-
-                        if (newSocket > lastSocket)
-                        {
-                        // Keep track of the maximum
-                            lastSocket = newSocket;
-                        }
-
-                    }
-                    else
-                    {
-                        //PRINT_DEBUG("Server accept() error");
-                    }
-                }
-                else if(socket == m_pipe[0])
-                {   char c;
-                
-                    if (read(m_pipe[0], &c, 1) != 1)
-                    {
-                        //error
-                    }
-                }
-                else
-                {
-                    try
-                    {
-                        // We received request
-
-                        //get credential info
-                        struct ucred cred;
-                        int lenCredStruct = sizeof(struct ucred);
-
-                        if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, (socklen_t*)(&lenCredStruct)) == -1)
-                        {
-                            throw std::runtime_error("Impossible to get sender: " + std::string(strerror(errno)));                            
-                        }
-                        
-                        struct passwd *pws;
-                        pws = getpwuid(cred.uid);
-                        
-                        std::string sender(pws->pw_name);
-
-                        //printf("=== New connection from %s with PID %i, with UID %i and GID %i\n",pws->pw_name,cred.pid, cred.uid, cred.gid);
-                        
-                        //Get frames
-                        std::vector<std::string> payload = recvFrames(socket);                        
-                        
-                        //Execute the request
-                        Payload results = m_server.handleRequest(sender, payload);
-
-                        //send the result if it's not empty
-                        if(!results.empty())
-                        {
-                            sendFrames(socket, results);
-                        }
-                        
-                        //check if we need to leave
-                        if(m_stopRequested)
-                        {
-                            break;
-                        }
-
-                    }
-                    catch(...)
-                    {
-                        if(m_stopRequested)
-                        {
-                            break;
-                        }
-                        
-                        //close the connection in case of error
-                        close(socket);
-
-                        // Remove from reference set
-                        FD_CLR(socket, &socketsSet);
-
-                        if (socket == lastSocket)
-                        {
-                            lastSocket--;
-                        }
-                    }
-                    
-                }
+                m_workers.reset(new SocketWorkerPool(m_config.workers));
             }
+            
+            m_poller = SocketPoller::create(m_config.engine);
+            
+            // Add the server socket and the pipes
+            m_poller->addShared(m_owner.m_serverSocket);
+            m_poller->add(m_owner.m_stopEvent);
+            m_poller->add(m_owner.m_drainEvent);
+            m_poller->add(m_wakeup);
         }
-
-        //End of the handler.Close the sockets except the server one.
-        for (int socket = lastSocket; socket >= 0; socket--)
+        catch(...)
         {
-          fd_set tmpSockets = socketsSet;
-
-          if (!FD_ISSET(socket, &tmpSockets))
-          {
-            // This socket is not in the set
-            continue;
-          }
-
-          //Don't close the server socket or pipe
-          if((socket != m_serverSocket) && (socket != m_pipe[0]))
-          {
-            close(socket);
-
-            // Remove from reference set
-            FD_CLR(socket, &socketsSet);
-
-            if (socket == lastSocket)
+            m_workers.reset();
+            
+            if(m_wakeup != -1)
             {
-              lastSocket--;
+                close(m_wakeup);
             }
-          }
-
+            
+            throw;
+        }
+        
+        m_completions = std::make_shared<AsyncCompletions>();
+        m_completions->notify = m_wakeup;
+        m_completions->loopThread = std::this_thread::get_id();
+        m_completions->inflight = &m_owner.m_inflightRequests;
+        
+        const std::chrono::milliseconds noTimeout(0);
+        m_idleTimeout = std::max(m_config.idleTimeout, noTimeout);
+        m_readTimeout = std::max(m_config.readTimeout, noTimeout);
+        m_timeouts = (m_idleTimeout > noTimeout) || (m_readTimeout > noTimeout);
+        
+        m_checkPeriod = std::max(m_idleTimeout, m_readTimeout);
+        
+        if((m_idleTimeout > noTimeout) && (m_readTimeout > noTimeout))
+        {
+            m_checkPeriod = std::min(m_idleTimeout, m_readTimeout);
         }
         
-         m_running = false;
-         m_stopRequested = false;
+        m_checkPeriod = std::max(m_checkPeriod / 4, std::chrono::milliseconds(1));
     }
     
-    void SocketBasicServer::requestStop()
+    SocketBasicServer::EventLoop::~EventLoop()
     {
-        if(m_running)
+        //wait for the handlers in progress before closing their connections
+        m_workers.reset();
+        
+        //the asynchronous requests still in flight complete without effect
+        {
+            std::lock_guard<std::mutex> lock(m_completions->mutex);
+            m_completions->notify = -1;
+            m_owner.m_inflightRequests -= m_completions->outstanding;
+            m_completions->outstanding = 0;
+        }
+        
+        //streams blocked on their client are woken up by the shutdown
+        for(int socket : m_streams)
         {
-            m_stopRequested = true;
+            shutdown(socket, SHUT_RDWR);
+        }
+        
+        m_streamPool.reset();
 
-            if(write(m_pipe[1], "s", 1) != -1 )
+        //End of the handler. Close the sockets except the server one.
+        for (const std::pair<const int, ClientConnection> & connection : m_clients)
+        {
+            close(connection.first);
+            
+            if(m_metrics)
             {
-               //error 
+                m_metrics->add(SocketCounter::CONNECTIONS_CLOSED);
             }
         }
-             
+        
+        m_owner.m_connections -= m_clients.size();
+        
+        close(m_wakeup);
     }
     
-    bool SocketBasicServer::isRunning()
+    void SocketBasicServer::EventLoop::run()
     {
-        return m_running;
-    }
-    
-} //namespace fty
-
-//  --------------------------------------------------------------------------
-//  Self test of this class
-
-
-#define SELFTEST_DIR_RO "src/selftest-ro"
+        //infini loop for handling connection
+        while(!m_owner.stopRequested())
+        {
+            int timeout = m_timeouts ? static_cast<int>(m_checkPeriod.count()) : -1;
+            
+            if(m_owner.m_state == ServerState::DRAINING)
+            {
+                if(drainConnections())
+                {
+                    break;
+                }
+                
+                //wake up at the deadline at the latest
+                Clock::duration left = Clock::time_point(Clock::duration(m_owner.m_drainDeadline)) - Clock::now();
+                int leftMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(left).count()) + 1;
+                
+                timeout = (timeout == -1) ? leftMs : std::min(timeout, leftMs);
+            }
+            
+            // Detect activity on the sockets
+            const std::vector<int> & readySockets = m_poller->wait(timeout);
+            
+            if(m_timeouts)
+            {
+                m_now = Clock::now();
+            }
+            
+            // Run through the sockets with data to be read
+            for (int socket : readySockets)
+            {
+                if(m_owner.stopRequested())
+                {
+                    break;
+                }
+                
+                if (socket == m_owner.m_serverSocket)
+                {
+                    acceptConnection();
+                }
+                else if((socket == m_owner.m_stopEvent) || (socket == m_owner.m_drainEvent))
+                {
+                    //seen by the loop through the state, left signaled for the other loops.
+                    //Signaled while running, it's a late one from the previous run.
+                    if(m_owner.m_state == ServerState::RUNNING)
+                    {
+                        clearEvent(socket);
+                    }
+                }
+                else if(socket == m_wakeup)
+                {
+                    resumeCompleted();
+                }
+                else
+                {
+                    serveConnection(socket);
+                }
+            }
+            
+            //replies completed on another thread, or during the handlers just called
+            sendAsyncReplies();
+            
+            //after the ready sockets, which may be among the closed ones
+            if(m_timeouts && (m_now >= m_nextCheck))
+            {
+                closeTimedOut();
+                m_nextCheck = m_now + m_checkPeriod;
+            }
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::acceptConnection()
+    {
+        // A client is asking a new connection
+        socklen_t addrlen;
+        struct sockaddr_storage clientaddr;
+        int newSocket;
+
+        // Handle a new connection
+        addrlen = sizeof(clientaddr);
+        memset(&clientaddr, 0, sizeof(clientaddr));
+
+        newSocket = accept(m_owner.m_serverSocket, (struct sockaddr *)&clientaddr, &addrlen);
+
+        if (newSocket == -1)
+        {
+            //PRINT_DEBUG("Server accept() error");
+            return;
+        }
+        
+        size_t live = m_owner.m_connections++;
+        
+        try
+        {
+            if((m_config.maxConnections > 0) && (live >= 2 * m_config.maxConnections))
+            {
+                throw std::runtime_error("Too many connections");
+            }
+            
+            //identify the client once for all its requests
+            std::string sender = getPeerUserName(newSocket);
+            
+            //save the socket
+            m_poller->add(newSocket);
+            ClientConnection & connection = m_clients.emplace(newSocket, ClientConnection(newSocket, sender)).first->second;
+            
+            connection.reader.setMaxBufferSize(m_config.maxRequestSize);
+            connection.reader.detectFraming();
+            connection.lastActivity = m_now;
+            connection.overloaded = (m_config.maxConnections > 0) && (live >= m_config.maxConnections);
+            
+            if(m_metrics)
+            {
+                m_metrics->add(SocketCounter::CONNECTIONS_ACCEPTED);
+            }
+        }
+        catch(...)
+        {
+            //unknown sender, too many connections, or the engine can't watch it (e.g. out of select range)
+            close(newSocket);
+            m_owner.m_connections--;
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::closeConnection(int socket)
+    {
+        m_poller->remove(socket);
+        m_clients.erase(socket);
+        close(socket);
+        m_owner.m_connections--;
+        
+        if(m_metrics)
+        {
+            m_metrics->add(SocketCounter::CONNECTIONS_CLOSED);
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::serveConnection(int socket)
+    {
+        try
+        {
+            ClientConnection & connection = m_clients.at(socket);
+            SocketFrameReader & reader = connection.reader;
+            SocketFrameWriter & writer = connection.writer;
+            
+            connection.lastActivity = m_now;
+            
+            if(writer.hasPending())
+            {
+                //the socket was watched for writability: resume the replies
+                size_t sent = writer.flush();
+                
+                if(m_metrics)
+                {
+                    m_metrics->add(SocketCounter::BYTES_SENT, sent);
+                }
+                
+                if(writer.hasPending())
+                {
+                    return;
+                }
+                
+                m_poller->watchWrite(socket, false);
+            }
+            else if(!receiveRequest(connection))
+            {
+                //the rest of the request will come with next events
+                return;
+            }
+            
+            if(connection.overloaded && reader.hasMessage())
+            {
+                //best effort: the reply fits in the socket buffer of a new connection
+                reader.recvFrames();
+                sendOverloaded(connection, connection.reader.requestId());
+                closeConnection(socket);
+                return;
+            }
+            
+            if(dispatchBuffered(socket, connection))
+            {
+                m_poller->remove(socket);
+            }
+            else if(writer.hasPending())
+            {
+                //stop reading until the client takes its replies
+                m_poller->watchWrite(socket, true);
+            }
+        }
+        catch(BufferLimitError &)
+        {
+            //drop the client rather than buffering its request
+            if(m_metrics)
+            {
+                m_metrics->add(SocketCounter::OVERLOADED_REQUESTS);
+            }
+            
+            closeConnection(socket);
+        }
+        catch(...)
+        {
+            //the connections are closed once the loop is over
+            if(m_owner.stopRequested())
+            {
+                return;
+            }
+            
+            //close the connection in case of error
+            closeConnection(socket);
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::resumeCompleted()
+    {
+        clearEvent(m_wakeup);
+        
+        std::vector<std::pair<int, bool>> completed;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_completedMutex);
+            completed.swap(m_completedRequests);
+        }
+        
+        for(const std::pair<int, bool> & request : completed)
+        {
+            int client = request.first;
+            
+            //its stream thread is free again
+            m_streams.erase(client);
+            
+            try
+            {
+                if(!request.second)
+                {
+                    throw std::runtime_error("Request failed");
+                }
+                
+                ClientConnection & connection = m_clients.at(client);
+                connection.dispatched = false;
+                connection.lastActivity = m_now;
+                
+                //replies completed meanwhile were left for now
+                if(!connection.asyncReplies.empty())
+                {
+                    sendDoneReplies(connection);
+                }
+                
+                //the client may have sent the next request already
+                if(!dispatchBuffered(client, connection))
+                {
+                    m_poller->add(client);
+                    
+                    if(connection.writer.hasPending())
+                    {
+                        m_poller->watchWrite(client, true);
+                    }
+                }
+            }
+            catch(...)
+            {
+                closeConnection(client);
+            }
+        }
+    }
+    
+    bool SocketBasicServer::EventLoop::receiveRequest(ClientConnection & connection)
+    {
+        SocketFrameReader & reader = connection.reader;
+        bool complete;
+        
+        if(!m_metrics)
+        {
+            complete = reader.receive();
+        }
+        else
+        {
+            uint64_t received = reader.bytesReceived();
+            Clock::time_point start = Clock::now();
+            
+            complete = reader.receive();
+            
+            m_metrics->record(SocketTimer::RECEIVE, Clock::now() - start);
+            m_metrics->add(SocketCounter::BYTES_RECEIVED, reader.bytesReceived() - received);
+        }
+        
+        if(m_timeouts)
+        {
+            bool receiving = !complete && reader.hasBufferedBytes();
+            
+            if(receiving && !connection.receiving)
+            {
+                connection.requestStart = m_now;
+            }
+            
+            connection.receiving = receiving;
+        }
+        
+        return complete;
+    }
+    
+    void SocketBasicServer::EventLoop::executeRequest(ClientConnection & connection, uint64_t requestId)
+    {
+        //reply in the framing the client chose
+        connection.writer.setFraming(connection.reader.framing());
+        
+        const SocketPayload & request = connection.request;
+        Clock::time_point start;
+        
+        if(m_metrics)
+        {
+            m_metrics->add(SocketCounter::REQUESTS);
+            start = Clock::now();
+        }
+        
+        //the reply of a SocketArenaServer lives in the arena until it is written or queued
+        SocketArena & arena = SocketArena::threadArena();
+        SocketArena::Scope scope(arena);
+        
+        Payload results;
+        SocketArenaPayload arenaResults{SocketArenaAllocator<SocketArenaString>(arena)};
+        
+        //reply of a SocketEncodedServer, or kept by the response cache
+        SocketEncodedMessage encodedResults;
+        SocketResponseCache * cache = m_owner.m_server ? m_config.responseCache : nullptr;
+        uint64_t generation = 0;
+        
+        try
+        {
+            if(!m_config.metricsRequest.empty() && (request.size() == 1) && isFrame(request[0], m_config.metricsRequest))
+            {
+                results = SocketMetrics::toFrames(m_owner.getMetrics());
+            }
+            else if(!request.empty() && isFrame(request[0], capabilitiesFrame))
+            {
+                results = negotiateCapabilities(connection, textRequest(connection), m_config);
+            }
+            else if(m_owner.m_arenaServer)
+            {
+                m_owner.m_arenaServer->handleRequest(connection.sender, request, arenaResults);
+            }
+            else if(m_owner.m_encodedServer)
+            {
+                encodedResults = m_owner.m_encodedServer->handleRequest(connection.sender, request);
+            }
+            else
+            {
+                //a hit is written as it was kept, without calling the handler
+                bool cacheable = cache && cache->find(connection.sender, request, encodedResults, generation);
+                
+                if(encodedResults.empty())
+                {
+                    results = m_owner.m_server->handleRequest(connection.sender, textRequest(connection));
+                    
+                    if(cacheable && !results.empty())
+                    {
+                        encodedResults = cache->store(connection.sender, request, results, generation);
+                    }
+                }
+            }
+        }
+        catch(...)
+        {
+            if(m_metrics)
+            {
+                m_metrics->add(SocketCounter::FAILED_REQUESTS);
+                m_metrics->record(SocketTimer::HANDLER, Clock::now() - start);
+            }
+            
+            throw;
+        }
+        
+        if(m_metrics)
+        {
+            Clock::time_point end = Clock::now();
+            m_metrics->record(SocketTimer::HANDLER, end - start);
+            start = end;
+        }
+        
+        //send the result if it's not empty
+        if(!encodedResults.empty())
+        {
+            sendReply(connection, encodedResults, requestId, m_metrics, start);
+        }
+        else if(!arenaResults.empty())
+        {
+            sendReply(connection, arenaResults, requestId, m_metrics, start);
+        }
+        else
+        {
+            sendReply(connection, results, requestId, m_metrics, start);
+        }
+        
+        releaseRequest(connection);
+    }
+    
+    bool SocketBasicServer::EventLoop::isStreamRequest(const ClientConnection & connection) const
+    {
+        return m_config.streamServer && (connection.request.size() == 1) && isFrame(connection.request[0], streamFrame);
+    }
+    
+    void SocketBasicServer::EventLoop::executeBatch(ClientConnection & connection)
+    {
+        SocketFrameReader & reader = connection.reader;
+        SocketFrameWriter & writer = connection.writer;
+        
+        bool batch = reader.hasMessage();
+        
+        if(batch)
+        {
+            writer.cork();
+        }
+        
+        size_t sent = 0;
+        
+        try
+        {
+            executeRequest(connection, reader.requestId());
+            
+            while(batch && !m_owner.stopRequested() && (writer.pendingBytes() < maxBatchBytes) && reader.hasMessage())
+            {
+                reader.recvFrames(connection.request);
+                
+                if(isStreamRequest(connection))
+                {
+                    break;
+                }
+                
+                executeRequest(connection, reader.requestId());
+            }
+            
+            sent = writer.uncork();
+        }
+        catch(...)
+        {
+            //the replies already made still go to the client
+            writer.uncork();
+            throw;
+        }
+        
+        if(m_metrics && batch)
+        {
+            m_metrics->add(SocketCounter::BYTES_SENT, sent);
+        }
+    }
+    
+    bool SocketBasicServer::EventLoop::inflightLimitReached() const
+    {
+        return (m_config.maxInflightRequests > 0) && (m_owner.m_inflightRequests >= m_config.maxInflightRequests);
+    }
+    
+    void SocketBasicServer::EventLoop::sendOverloaded(ClientConnection & connection, uint64_t requestId)
+    {
+        connection.writer.setFraming(connection.reader.framing());
+        size_t sent = connection.writer.sendFrames({overloadedFrame}, requestId);
+        
+        if(m_metrics)
+        {
+            m_metrics->add(SocketCounter::OVERLOADED_REQUESTS);
+            m_metrics->add(SocketCounter::BYTES_SENT, sent);
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::executeAsync(int socket, ClientConnection & connection)
+    {
+        std::shared_ptr<AsyncReply> pending = std::make_shared<AsyncReply>();
+        pending->requestId = connection.reader.requestId();
+        connection.asyncReplies.push_back(pending);
+        
+        const SocketPayload & request = connection.request;
+        bool inflight = false;
+        
+        if(inflightLimitReached())
+        {
+            //refused in the order of the replies in flight
+            pending->overloaded = true;
+        }
+        else
+        {
+            if(m_metrics)
+            {
+                m_metrics->add(SocketCounter::REQUESTS);
+                pending->start = Clock::now();
+            }
+            
+            if(!m_config.metricsRequest.empty() && (request.size() == 1) && isFrame(request[0], m_config.metricsRequest))
+            {
+                pending->reply = SocketMetrics::toFrames(m_owner.getMetrics());
+            }
+            else if(!request.empty() && isFrame(request[0], capabilitiesFrame))
+            {
+                pending->reply = negotiateCapabilities(connection, textRequest(connection), m_config);
+            }
+            else
+            {
+                inflight = true;
+            }
+        }
+        
+        std::shared_ptr<AsyncCompletions> completions = m_completions;
+        
+        if(!inflight)
+        {
+            std::lock_guard<std::mutex> lock(completions->mutex);
+            pending->done = true;
+            pending->success = true;
+            completions->sockets.push_back(socket);
+            
+            releaseRequest(connection);
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(completions->mutex);
+            completions->outstanding++;
+            m_owner.m_inflightRequests++;
+        }
+        
+        SocketCompletion completion([completions, pending, socket](bool success, Payload && reply)
+        {
+            std::lock_guard<std::mutex> lock(completions->mutex);
+            
+            if(completions->notify == -1)
+            {
+                return;
+            }
+            
+            completions->outstanding--;
+            (*completions->inflight)--;
+            
+            pending->done = true;
+            pending->success = success;
+            pending->reply = std::move(reply);
+            
+            completions->sockets.push_back(socket);
+            
+            //completed during a handler, the loop looks for it right after
+            if((completions->sockets.size() == 1) && (std::this_thread::get_id() != completions->loopThread))
+            {
+                signalEvent(completions->notify);
+            }
+        });
+        
+        try
+        {
+            m_owner.m_asyncServer->handleRequest(connection.sender, textRequest(connection), completion);
+        }
+        catch(...)
+        {
+            completion.fail();
+        }
+        
+        releaseRequest(connection);
+    }
+    
+    void SocketBasicServer::EventLoop::sendAsyncReplies()
+    {
+        m_completedSockets.clear();
+        
+        {
+            std::lock_guard<std::mutex> lock(m_completions->mutex);
+            
+            if(m_completions->sockets.empty())
+            {
+                return;
+            }
+            
+            m_completedSockets.swap(m_completions->sockets);
+        }
+        
+        for(int socket : m_completedSockets)
+        {
+            auto found = m_clients.find(socket);
+            
+            //closed meanwhile, or owned by a stream
+            if((found == m_clients.end()) || found->second.dispatched)
+            {
+                continue;
+            }
+            
+            ClientConnection & connection = found->second;
+            
+            try
+            {
+                sendDoneReplies(connection);
+                
+                //read again, or dispatch the stream which waited for the replies
+                if(connection.paused)
+                {
+                    connection.paused = false;
+                    
+                    if(dispatchBuffered(socket, connection))
+                    {
+                        continue;
+                    }
+                    
+                    m_poller->add(socket);
+                }
+                
+                if(connection.writer.hasPending())
+                {
+                    m_poller->watchWrite(socket, true);
+                }
+            }
+            catch(...)
+            {
+                closeConnection(socket);
+            }
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::sendDoneReplies(ClientConnection & connection)
+    {
+        //the replies completed together are written together
+        connection.writer.cork();
+        
+        while(!connection.asyncReplies.empty())
+        {
+            std::shared_ptr<AsyncReply> pending = connection.asyncReplies.front();
+            
+            {
+                std::lock_guard<std::mutex> lock(m_completions->mutex);
+                
+                if(!pending->done)
+                {
+                    break;
+                }
+            }
+            
+            connection.asyncReplies.pop_front();
+            connection.lastActivity = m_now;
+            
+            if(pending->overloaded)
+            {
+                sendOverloaded(connection, pending->requestId);
+                continue;
+            }
+            
+            Clock::time_point start;
+            
+            if(m_metrics)
+            {
+                start = Clock::now();
+                m_metrics->record(SocketTimer::HANDLER, start - pending->start);
+            }
+            
+            if(!pending->success)
+            {
+                if(m_metrics)
+                {
+                    m_metrics->add(SocketCounter::FAILED_REQUESTS);
+                }
+                
+                throw std::runtime_error("Request failed");
+            }
+            
+            connection.writer.setFraming(connection.reader.framing());
+            sendReply(connection, pending->reply, pending->requestId, m_metrics, start);
+        }
+        
+        size_t sent = connection.writer.uncork();
+        
+        if(m_metrics)
+        {
+            m_metrics->add(SocketCounter::BYTES_SENT, sent);
+        }
+    }
+    
+    void SocketBasicServer::EventLoop::dispatchToWorker(int socket, ClientConnection & connection)
+    {
+        Clock::time_point posted = m_metrics ? Clock::now() : Clock::time_point();
+        ClientConnection * client = &connection;
+        
+        connection.dispatched = true;
+        
+        m_owner.m_inflightRequests++;
+        
+        m_workers->post([this, socket, client, posted]()
+        {
+            bool success = true;
+            
+            if(m_metrics)
+            {
+                m_metrics->record(SocketTimer::QUEUE, Clock::now() - posted);
+            }
+            
+            try
+            {
+                executeBatch(*client);
+            }
+            catch(...)
+            {
+                success = false;
+            }
+            
+            m_owner.m_inflightRequests--;
+            
+            {
+                std::lock_guard<std::mutex> lock(m_completedMutex);
+                m_completedRequests.push_back(std::make_pair(socket, success));
+            }
+            
+            signalEvent(m_wakeup);
+        });
+    }
+    
+    bool SocketBasicServer::EventLoop::dispatchStream(int socket, ClientConnection & connection)
+    {
+        size_t maxStreams = std::max<size_t>(1, m_config.maxStreams);
+        
+        //a stream is posted only to a free thread, it never waits in the queue
+        if((m_streams.size() >= maxStreams) || inflightLimitReached())
+        {
+            sendOverloaded(connection, connection.reader.requestId());
+            return false;
+        }
+        
+        if(!m_streamPool)
+        {
+            m_streamPool.reset(new SocketWorkerPool(maxStreams));
+        }
+        
+        ClientConnection * client = &connection;
+        
+        connection.dispatched = true;
+        m_streams.insert(socket);
+        
+        m_owner.m_inflightRequests++;
+        
+        m_streamPool->post([this, socket, client]()
+        {
+            bool success = true;
+            
+            try
+            {
+                serveStream(*client, m_config, m_metrics);
+            }
+            catch(...)
+            {
+                success = false;
+            }
+            
+            m_owner.m_inflightRequests--;
+            
+            {
+                std::lock_guard<std::mutex> lock(m_completedMutex);
+                m_completedRequests.push_back(std::make_pair(socket, success));
+            }
+            
+            signalEvent(m_wakeup);
+        });
+        
+        return true;
+    }
+    
+    bool SocketBasicServer::EventLoop::dispatchBuffered(int socket, ClientConnection & connection)
+    {
+        //a request may be left by a batch
+        while(!m_owner.stopRequested() && !connection.writer.hasPending() && (!connection.request.empty() || connection.reader.hasMessage()))
+        {
+            if(connection.request.empty())
+            {
+                connection.reader.recvFrames(connection.request);
+            }
+            
+            //the replies of the requests before go first, and a client which
+            //doesn't wait for them is not read until some are sent
+            if(!connection.asyncReplies.empty() && (isStreamRequest(connection) || (connection.asyncReplies.size() >= maxAsyncReplies)))
+            {
+                connection.paused = true;
+                return true;
+            }
+            
+            if(isStreamRequest(connection))
+            {
+                connection.request.clear();
+                
+                if(dispatchStream(socket, connection))
+                {
+                    return true;
+                }
+                
+                continue;
+            }
+            
+            if(m_owner.m_asyncServer)
+            {
+                executeAsync(socket, connection);
+                continue;
+            }
+            
+            if(!m_workers)
+            {
+                executeBatch(connection);
+                continue;
+            }
+            
+            if(inflightLimitReached())
+            {
+                connection.request.clear();
+                sendOverloaded(connection, connection.reader.requestId());
+                continue;
+            }
+            
+            dispatchToWorker(socket, connection);
+            return true;
+        }
+        
+        return false;
+    }
+    
+    void SocketBasicServer::EventLoop::closeTimedOut()
+    {
+        const std::chrono::milliseconds noTimeout(0);
+        std::vector<int> expired;
+        
+        for(std::pair<const int, ClientConnection> & entry : m_clients)
+        {
+            ClientConnection & connection = entry.second;
+            
+            //a client waiting for a reply in flight is not idle
+            if(connection.dispatched || !connection.asyncReplies.empty())
+            {
+                continue;
+            }
+            
+            if((m_idleTimeout > noTimeout) && (m_now - connection.lastActivity >= m_idleTimeout))
+            {
+                expired.push_back(entry.first);
+            }
+            else if((m_readTimeout > noTimeout) && !connection.writer.hasPending() && connection.reader.hasBufferedBytes())
+            {
+                //the start of a request may have come along with the previous one
+                if(!connection.receiving)
+                {
+                    connection.receiving = true;
+                    connection.requestStart = m_now;
+                }
+                else if(m_now - connection.requestStart >= m_readTimeout)
+                {
+                    expired.push_back(entry.first);
+                }
+            }
+        }
+        
+        for(int socket : expired)
+        {
+            closeConnection(socket);
+            
+            if(m_metrics)
+            {
+                m_metrics->add(SocketCounter::TIMED_OUT_CONNECTIONS);
+            }
+        }
+    }
+    
+    bool SocketBasicServer::EventLoop::drainConnections()
+    {
+        if(!m_draining)
+        {
+            m_poller->remove(m_owner.m_serverSocket);
+            m_poller->remove(m_owner.m_drainEvent);
+            m_draining = true;
+        }
+        
+        std::vector<int> idle;
+        
+        for(const std::pair<const int, ClientConnection> & entry : m_clients)
+        {
+            const ClientConnection & connection = entry.second;
+            
+            if(!connection.dispatched && connection.asyncReplies.empty() && !connection.writer.hasPending()
+               && !connection.reader.hasBufferedBytes())
+            {
+                idle.push_back(entry.first);
+            }
+        }
+        
+        for(int socket : idle)
+        {
+            closeConnection(socket);
+        }
+        
+        return m_clients.empty() || (Clock::now() >= Clock::time_point(Clock::duration(m_owner.m_drainDeadline)));
+    }
+    
+    void SocketBasicServer::requestStop()
+    {
+        ServerState state = m_state;
+        
+        while(((state == ServerState::RUNNING) || (state == ServerState::DRAINING))
+              && !m_state.compare_exchange_weak(state, ServerState::STOPPING))
+        {
+        }
+        
+        if((state == ServerState::RUNNING) || (state == ServerState::DRAINING))
+        {
+            signalEvent(m_stopEvent);
+        }
+    }
+    
+    void SocketBasicServer::requestDrain(std::chrono::milliseconds timeout)
+    {
+        //a drain in progress takes the new deadline
+        m_drainDeadline = (std::chrono::steady_clock::now() + timeout).time_since_epoch().count();
+        
+        ServerState running = ServerState::RUNNING;
+        
+        if(m_state.compare_exchange_strong(running, ServerState::DRAINING))
+        {
+            signalEvent(m_drainEvent);
+        }
+    }
+    
+    bool SocketBasicServer::isRunning()
+    {
+        return m_state != ServerState::STOPPED;
+    }
+    
+    void SocketBasicServer::invalidateSenderCache()
+    {
+        SocketCredentialCache::instance().invalidate();
+    }
+    
+    SocketServerMetrics SocketBasicServer::getMetrics() const
+    {
+        if(!m_metrics)
+        {
+            return SocketServerMetrics();
+        }
+        
+        return m_metrics->snapshot();
+    }
+    
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+
+#define SELFTEST_DIR_RO "src/selftest-ro"
 #define SELFTEST_DIR_RW "src/selftest-rw"
 
 
-#include "fty_common_unit_tests.h"
-#include "fty_common_socket_sync_client.h"
-#include <thread>
-#include <cassert>
+#include "fty_common_unit_tests.h"
+#include "fty_common_socket_sync_client.h"
+#include "fty_common_socket_test_server.h"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <sys/resource.h>
+#include <pwd.h>
+
+namespace
+{
+    // Echo server taking its time for the requests starting with "slow"
+    class SlowEchoServer : public fty::SyncServer
+    {
+    public:
+        fty::Payload handleRequest(const fty::Sender & /*sender*/, const fty::Payload & payload) override
+        {
+            if(!payload.empty() && (payload[0] == "slow"))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            }
+
+            return payload;
+        }
+    };
+
+    // Reply with the name of the sender
+    class WhoAmIServer : public fty::SyncServer
+    {
+    public:
+        fty::Payload handleRequest(const fty::Sender & sender, const fty::Payload & /*payload*/) override
+        {
+            return {sender};
+        }
+    };
+}
+
+void
+fty_common_socket_basic_mailbox_server_test (bool verbose)
+{
+    printf (" * fty_common_socket_basic_mailbox_server: ");
+    
+    //io_uring may be missing from the build, or refused by the kernel
+    std::vector<fty::SocketEventEngine> engines = {fty::SocketEventEngine::EPOLL, fty::SocketEventEngine::SELECT};
+    
+    try
+    {
+        fty::SocketPoller::create(fty::SocketEventEngine::IO_URING);
+        engines.push_back(fty::SocketEventEngine::IO_URING);
+    }
+    catch(...)
+    {
+        if(verbose)
+        {
+            printf("io_uring not available ");
+        }
+    }
+    
+    //normal case, with each event engine
+    for(fty::SocketEventEngine engine : engines)
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.engine = engine;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+
+        fty::SocketTestServer serverThread(agent);
+
+        //create a client
+        {
+            fty::SocketSyncClient syncClient( "test.socket");
+
+            fty::Payload expectedPayload = {"This", "is", "a", "test"};
+
+            fty::Payload receivedPayload = syncClient.syncRequestWithReply(expectedPayload);
+
+            assert(expectedPayload == receivedPayload);
+        }
+
+        serverThread.stop();
+        
+    }
+    
+    //sender is the user of the client process, resolved once per connection
+    {
+        WhoAmIServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        struct passwd * pws = getpwuid(getuid());
+        assert(pws != NULL);
+        fty::Payload expectedPayload = {pws->pw_name};
+
+        {
+            fty::SocketSyncClient syncClient( "test.socket", 1);
+
+            assert(syncClient.syncRequestWithReply({"who"}) == expectedPayload);
+            fty::SocketBasicServer::invalidateSenderCache();
+            assert(syncClient.syncRequestWithReply({"who"}) == expectedPayload);
+        }
+    }
+
+    //large frames are received across several reads
+    {
+        fty::EchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        {
+            fty::SocketSyncClient syncClient( "test.socket", 1);
+
+            fty::Payload expectedPayload = {"large", std::string(4 * 1024 * 1024, 'x'), "end"};
+
+            for(int request = 0; request < 3; request++)
+            {
+                assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+            }
+        }
+    }
+
+    //binary frames, NUL bytes included, go through unchanged
+    {
+        fty::EchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        {
+            fty::SocketSyncClient syncClient( "test.socket");
+
+            std::string blob(256 * 1024, '\0');
+            for(size_t index = 0; index < blob.size(); index++)
+            {
+                blob[index] = static_cast<char>(index);
+            }
+
+            fty::SocketPayload expectedPayload = {fty::SocketFrame(std::string("bin\0ary", 7)), fty::SocketFrame(blob)};
+
+            fty::SocketPayload receivedPayload;
+            syncClient.syncRequestWithReply(expectedPayload, receivedPayload);
+
+            assert(expectedPayload == receivedPayload);
+            assert(receivedPayload[1].size() == blob.size());
+        }
+    }
+
+    //epoll engine serves descriptors beyond FD_SETSIZE
+    struct rlimit limit;
+    if((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_max >= 2 * FD_SETSIZE))
+    {
+        struct rlimit previousLimit = limit;
+        limit.rlim_cur = 2 * FD_SETSIZE;
+        setrlimit(RLIMIT_NOFILE, &limit);
+
+        std::vector<int> fillers;
+        while(fillers.empty() || fillers.back() < FD_SETSIZE)
+        {
+            fillers.push_back(dup(0));
+        }
+
+        fty::EchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        {
+            fty::SocketSyncClient syncClient( "test.socket");
+
+            fty::Payload expectedPayload = {"This", "is", "a", "test"};
+
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+
+        serverThread.stop();
+
+        for(int filler : fillers)
+        {
+            close(filler);
+        }
+
+        setrlimit(RLIMIT_NOFILE, &previousLimit);
+    }
+
+    //worker pool: a slow handler does not stall the other clients
+    {
+        SlowEchoServer server;
+
+        fty::SocketServerConfig config;
+        config.workers = 2;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient slowClient( "test.socket", 1);
+        fty::Payload slowPayload = {"slow", "request"};
+
+        std::atomic<bool> slowDone(false);
+
+        std::thread slowThread([&]()
+        {
+            assert(slowClient.syncRequestWithReply(slowPayload) == slowPayload);
+            slowDone = true;
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        //replies come back in order on a reused connection
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+
+        for(int request = 0; request < 20; request++)
+        {
+            fty::Payload expectedPayload = {"fast", std::to_string(request)};
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+
+        assert(!slowDone);
+
+        slowThread.join();
+    }
+
+    //drain: the request in progress is replied, the idle connections are closed, then run() returns
+    {
+        SlowEchoServer server;
+
+        fty::SocketServerConfig config;
+        config.workers = 2;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient idleClient( "test.socket", 1);
+        assert(idleClient.syncRequestWithReply({"idle"}) == fty::Payload({"idle"}));
+
+        fty::SocketSyncClient slowClient( "test.socket", 1);
+        fty::Payload slowPayload = {"slow", "request"};
+
+        std::thread slowThread([&]()
+        {
+            assert(slowClient.syncRequestWithReply(slowPayload) == slowPayload);
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        agent.requestDrain(std::chrono::seconds(10));
+
+        serverThread.join();
+        slowThread.join();
+
+        assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+        assert(!agent.isRunning());
+    }
+
+    //large frames are passed in shared memory once negotiated
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.sharedFrameSize = 64 * 1024;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1, 64 * 1024);
+
+        fty::Payload expectedPayload = {"small", std::string(4 * 1024 * 1024, 'x'), "end"};
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+
+        //binary frames, the reply views the mapping
+        std::string binary(1024 * 1024, '\0');
+
+        for(size_t index = 0; index < binary.size(); index++)
+        {
+            binary[index] = static_cast<char>(index % 251);
+        }
+
+        fty::SocketPayload request = {fty::SocketFrame(binary), fty::SocketFrame(std::string("inline"))};
+        fty::SocketPayload reply;
+        syncClient.syncRequestWithReply(request, reply);
+        assert(reply == request);
+
+        //the large frames did not go through the socket
+        assert(agent.getMetrics().bytesReceived < 64 * 1024);
+    }
+
+    //shared frames are not used with a server which doesn't accept them
+    {
+        fty::EchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 0, 1024);
+
+        fty::Payload expectedPayload = {std::string(100 * 1024, 'x')};
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+    }
+
+    //several event loops, each with its share of the connections
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.reactors = 4;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 8);
+        std::vector<std::thread> clients;
+
+        for(int client = 0; client < 8; client++)
+        {
+            clients.emplace_back([&syncClient, client]()
+            {
+                for(int request = 0; request < 50; request++)
+                {
+                    fty::Payload expectedPayload = {std::to_string(client), std::to_string(request)};
+                    assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+                }
+            });
+        }
+
+        for(std::thread & client : clients)
+        {
+            client.join();
+        }
+
+        assert(agent.getMetrics().requests == 400);
+
+        serverThread.stop();
+
+        assert(!agent.isRunning());
+
+        //the server can run again
+        fty::SocketTestServer secondRun(agent);
+
+        fty::SocketSyncClient secondClient( "test.socket");
+        fty::Payload expectedPayload = {"again"};
+        assert(secondClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+    }
+
+    //a client stalled in the middle of a request does not block the others
+    for(fty::SocketEventEngine engine : engines)
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.engine = engine;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        //send the number of frames and the size of the first one only
+        int stalledSocket = fty::connectToServer("test.socket");
+        uint32_t header[2] = {1, 5};
+        assert(write(stalledSocket, header, sizeof(header)) == sizeof(header));
 
-void
-fty_common_socket_basic_mailbox_server_test (bool verbose)
-{
-    printf (" * fty_common_socket_basic_mailbox_server: ");
-    
-    //normal case
+        fty::SocketSyncClient syncClient( "test.socket");
+        fty::Payload expectedPayload = {"not", "blocked"};
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+
+        //the request is completed later
+        assert(write(stalledSocket, "late", 5) == 5);
+        assert(fty::recvFrames(stalledSocket) == fty::Payload({"late"}));
+
+        close(stalledSocket);
+    }
+
+    //a client which doesn't read its replies does not block the others
+    for(fty::SocketEventEngine engine : engines)
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.engine = engine;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        int greedySocket = fty::connectToServer("test.socket");
+        fty::Payload largePayload = {std::string(64 * 1024, 'x')};
+        const int requests = 64;
+
+        //blocks once the socket buffers are full on both sides
+        std::thread greedyThread([&]()
+        {
+            for(int request = 0; request < requests; request++)
+            {
+                fty::sendFrames(greedySocket, largePayload);
+            }
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        fty::SocketSyncClient syncClient( "test.socket");
+        fty::Payload expectedPayload = {"not", "blocked"};
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+
+        //all the replies are delivered, in order
+        fty::SocketFrameReader reader(greedySocket);
+
+        for(int request = 0; request < requests; request++)
+        {
+            assert(reader.recvFrames() == largePayload);
+        }
+
+        greedyThread.join();
+        close(greedySocket);
+    }
+
+    //connections beyond the limit are refused with the overload reply
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.maxConnections = 1;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        int idleSocket = fty::connectToServer("test.socket");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        fty::SocketSyncClient syncClient( "test.socket");
+        fty::Payload expectedPayload = {"over", "limit"};
+
+        try
+        {
+            syncClient.syncRequestWithReply(expectedPayload);
+            assert(false);
+        }
+        catch(fty::SocketOverloadedError &)
+        {
+        }
+
+        //the connection is given back once the first one left
+        close(idleSocket);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        assert(agent.getMetrics().overloadedRequests == 1);
+    }
+
+    //requests beyond the in-flight limit are refused without waiting for a worker
+    {
+        SlowEchoServer server;
+
+        fty::SocketServerConfig config;
+        config.workers = 1;
+        config.maxInflightRequests = 1;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient slowClient( "test.socket");
+        fty::Payload slowPayload = {"slow", "request"};
+
+        std::thread slowThread([&]()
+        {
+            assert(slowClient.syncRequestWithReply(slowPayload) == slowPayload);
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        //the refused connection stays usable
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+        fty::Payload expectedPayload = {"fast", "request"};
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        try
+        {
+            syncClient.syncRequestWithReply(expectedPayload);
+            assert(false);
+        }
+        catch(fty::SocketOverloadedError &)
+        {
+        }
+
+        assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(250));
+
+        slowThread.join();
+
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+    }
+
+    //a request larger than the limit closes its connection before being buffered
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.maxRequestSize = 64 * 1024;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket");
+
+        try
+        {
+            syncClient.syncRequestWithReply({std::string(4 * 1024 * 1024, 'x')});
+            assert(false);
+        }
+        catch(std::runtime_error &)
+        {
+        }
+
+        fty::Payload expectedPayload = {"within", "limit"};
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+
+        //a count of frames which can't fit is rejected before reading them
+        int countSocket = fty::connectToServer("test.socket");
+        uint32_t numberOfFrame = 0xFFFFFFFF;
+        assert(write(countSocket, &numberOfFrame, sizeof(numberOfFrame)) == sizeof(numberOfFrame));
+
+        try
+        {
+            fty::recvFrames(countSocket);
+            assert(false);
+        }
+        catch(fty::ConnectionClosedError &)
+        {
+        }
+
+        close(countSocket);
+
+        serverThread.stop();
+
+        fty::SocketServerMetrics metrics = agent.getMetrics();
+        assert(metrics.overloadedRequests == 2);
+        assert(metrics.connectionsClosed == 3);
+        assert(metrics.bytesReceived < 64 * 1024);
+    }
+
+    //shared frames are refused unless negotiated, and count in the request size when they are
     {
         fty::EchoServer server;
 
+        fty::SocketServerConfig config;
+        config.maxRequestSize = 64 * 1024;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        int sharedSocket = fty::connectToServer("test.socket");
+        fty::sendFrames(sharedSocket, fty::Payload({std::string(4096, 's')}), 1024);
+
+        try
+        {
+            fty::recvFrames(sharedSocket);
+            assert(false);
+        }
+        catch(fty::ConnectionClosedError &)
+        {
+        }
+
+        close(sharedSocket);
+        serverThread.stop();
+
+        config.sharedFrameSize = 1024;
+
+        fty::SocketBasicServer sharingAgent(  server,
+                                              "test.socket",
+                                              30,
+                                              config);
+
+        fty::SocketTestServer sharingThread(sharingAgent);
+
+        fty::SocketClientConfig clientConfig;
+        clientConfig.sharedFrameSize = 1024;
+
+        fty::SocketSyncClient syncClient( "test.socket", clientConfig);
+
+        fty::Payload expectedPayload = {std::string(32 * 1024, 's')};
+        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+
+        try
+        {
+            syncClient.syncRequestWithReply({std::string(32 * 1024, 'x'), std::string(32 * 1024, 'x')});
+            assert(false);
+        }
+        catch(std::runtime_error &)
+        {
+        }
+
+        sharingThread.stop();
+        assert(sharingAgent.getMetrics().overloadedRequests == 1);
+    }
+
+    //a request which is not answered in time fails without waiting for the server
+    {
+        SlowEchoServer server;
+
         fty::SocketBasicServer agent(  server,
                                        "test.socket");
 
+        fty::SocketTestServer serverThread(agent);
 
-        std::thread serverThread(&fty::SocketBasicServer::run, &agent);
+        fty::SocketSyncClient syncClient( "test.socket", 1);
 
-        //create a client
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        try
         {
-            fty::SocketSyncClient syncClient( "test.socket");
+            syncClient.syncRequestWithReply({"slow", "request"}, std::chrono::milliseconds(100));
+            assert(false);
+        }
+        catch(fty::SocketTimeoutError &)
+        {
+        }
 
-            fty::Payload expectedPayload = {"This", "is", "a", "test"};
+        assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(400));
 
-            fty::Payload receivedPayload = syncClient.syncRequestWithReply(expectedPayload);
+        //the late reply is not taken for the reply of the next request
+        fty::Payload expectedPayload = {"in", "time"};
+        assert(syncClient.syncRequestWithReply(expectedPayload, std::chrono::seconds(5)) == expectedPayload);
+    }
 
-            assert(expectedPayload == receivedPayload);
+    //idle connections and requests stalled for too long are closed
+    for(fty::SocketEventEngine engine : engines)
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.engine = engine;
+        config.idleTimeout = std::chrono::milliseconds(300);
+        config.readTimeout = std::chrono::milliseconds(50);
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        int idleSocket = fty::connectToServer("test.socket");
+        int stalledSocket = fty::connectToServer("test.socket");
+        uint32_t header[2] = {1, 5};
+        assert(write(stalledSocket, header, sizeof(header)) == sizeof(header));
+
+        //a client sending requests regularly is kept
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+        fty::Payload expectedPayload = {"still", "here"};
+
+        for(int request = 0; request < 10; request++)
+        {
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+
+        try
+        {
+            fty::recvFrames(stalledSocket);
+            assert(false);
+        }
+        catch(fty::ConnectionClosedError &)
+        {
         }
 
-        agent.requestStop();
+        try
+        {
+            fty::recvFrames(idleSocket);
+            assert(false);
+        }
+        catch(fty::ConnectionClosedError &)
+        {
+        }
 
-        serverThread.join();
-        
+        assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+
+        close(stalledSocket);
+        close(idleSocket);
+
+        serverThread.stop();
+
+        fty::SocketServerMetrics metrics = agent.getMetrics();
+        assert(metrics.timedOutConnections == 2);
+        assert(metrics.requests == 10);
+    }
+
+    //clients using both framings on the same server, replied in their own framing
+    for(size_t workers : {0, 2})
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.workers = workers;
+        config.sharedFrameSize = 64 * 1024;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketClientConfig compactConfig;
+        compactConfig.framing = fty::SocketFraming::V2;
+
+        fty::SocketClientConfig pooledConfig = compactConfig;
+        pooledConfig.maxConnections = 1;
+
+        fty::SocketClientConfig sharedConfig = pooledConfig;
+        sharedConfig.sharedFrameSize = 64 * 1024;
+
+        fty::SocketSyncClient v1Client( "test.socket", 1);
+        fty::SocketSyncClient v2Client( "test.socket", compactConfig);
+        fty::SocketSyncClient pooledClient( "test.socket", pooledConfig);
+        fty::SocketSyncClient sharedClient( "test.socket", sharedConfig);
+
+        //an empty reply is not sent
+        std::vector<fty::Payload> payloads = {
+            {""},
+            {"a", "", "b"},
+            {std::string(127, 'x'), std::string(128, 'y'), std::string(70000, 'z')},
+            {"large", std::string(4 * 1024 * 1024, 'x')}
+        };
+
+        for(const fty::Payload & payload : payloads)
+        {
+            assert(v1Client.syncRequestWithReply(payload) == payload);
+            assert(v2Client.syncRequestWithReply(payload) == payload);
+            assert(pooledClient.syncRequestWithReply(payload) == payload);
+            assert(sharedClient.syncRequestWithReply(payload) == payload);
+        }
+
+        std::string binary("\0bin\0ary\0", 9);
+        fty::SocketPayload request = {fty::SocketFrame(binary), fty::SocketFrame(std::string())};
+        fty::SocketPayload reply;
+        pooledClient.syncRequestWithReply(request, reply);
+        assert(reply == request);
+
+        //small messages are shorter in V2
+        fty::Payload smallPayload = {"a", "b", "c"};
+
+        uint64_t received = agent.getMetrics().bytesReceived;
+        assert(v1Client.syncRequestWithReply(smallPayload) == smallPayload);
+        uint64_t v1Size = agent.getMetrics().bytesReceived - received;
+
+        received = agent.getMetrics().bytesReceived;
+        assert(pooledClient.syncRequestWithReply(smallPayload) == smallPayload);
+        uint64_t v2Size = agent.getMetrics().bytesReceived - received;
+
+        assert(v2Size < v1Size / 2);
+
+        //the reply carries the id of its request
+        int socket = fty::connectToServer("test.socket");
+        assert(write(socket, fty::framingPreamble.data(), fty::framingPreamble.size()) == 4);
+
+        fty::MessageFormat format;
+        format.framing = fty::SocketFraming::V2;
+        format.requestId = 1000000;
+        fty::sendFrames(socket, smallPayload, format);
+
+        fty::SocketFrameReader reader(socket);
+        reader.setFraming(fty::SocketFraming::V2);
+        assert(reader.recvFrames() == smallPayload);
+        assert(reader.requestId() == 1000000);
+
+        close(socket);
+    }
+
+    //large frames compressed both ways, small ones sent as is
+    if(fty::isCompressionAvailable())
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.sharedFrameSize = 1024 * 1024;
+        config.compressionThreshold = 1024;
+        config.metrics = true;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        std::string document;
+
+        while(document.size() < 64 * 1024)
+        {
+            document += "{\"name\": \"ups-" + std::to_string(document.size()) + "\", \"status\": \"online\"},";
+        }
+
+        fty::Payload largePayload = {"small", document, std::string(1023, 'x'), std::string(1024, 'y')};
+        fty::Payload smallPayload = {"a", std::string(1000, 'x')};
+
+        for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+        {
+            fty::SocketClientConfig clientConfig;
+            clientConfig.maxConnections = 1;
+            clientConfig.framing = framing;
+
+            fty::SocketSyncClient plainClient( "test.socket", clientConfig);
+
+            clientConfig.compressionThreshold = 1024;
+            fty::SocketSyncClient compressedClient( "test.socket", clientConfig);
+
+            clientConfig.sharedFrameSize = 32 * 1024;
+            fty::SocketSyncClient sharedClient( "test.socket", clientConfig);
+
+            uint64_t received = agent.getMetrics().bytesReceived;
+            assert(plainClient.syncRequestWithReply(largePayload) == largePayload);
+            uint64_t plainSize = agent.getMetrics().bytesReceived - received;
+
+            received = agent.getMetrics().bytesReceived;
+            assert(compressedClient.syncRequestWithReply(largePayload) == largePayload);
+            uint64_t compressedSize = agent.getMetrics().bytesReceived - received;
+
+            assert(plainSize > document.size());
+            assert(compressedSize < plainSize / 4);
+
+            //binary safe, and the reply frames view their decompressed buffer
+            fty::SocketPayload binaryPayload = {fty::SocketFrame(std::string(4096, '\0')), fty::SocketFrame(document)};
+            fty::SocketPayload binaryReply;
+            compressedClient.syncRequestWithReply(binaryPayload, binaryReply);
+            assert(binaryReply.size() == 2);
+            assert(binaryReply[0].str() == std::string(4096, '\0'));
+            assert(binaryReply[1].str() == document);
+
+            //below the threshold, nothing changes
+            received = agent.getMetrics().bytesReceived;
+            assert(plainClient.syncRequestWithReply(smallPayload) == smallPayload);
+            plainSize = agent.getMetrics().bytesReceived - received;
+
+            received = agent.getMetrics().bytesReceived;
+            assert(compressedClient.syncRequestWithReply(smallPayload) == smallPayload);
+            assert(agent.getMetrics().bytesReceived - received == plainSize);
+
+            //shared frames take precedence over compression
+            assert(sharedClient.syncRequestWithReply(largePayload) == largePayload);
+        }
+    }
+
+    //metrics, through the API and the reserved request
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.metrics = true;
+        config.metricsRequest = "__metrics__";
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+
+        for(int request = 0; request < 10; request++)
+        {
+            fty::Payload expectedPayload = {"metrics", std::to_string(request)};
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+
+        fty::Payload reply = syncClient.syncRequestWithReply({"__metrics__"});
+        assert((reply.size() % 2) == 0);
+
+        std::map<std::string, std::string> values;
+
+        for(size_t index = 0; index < reply.size(); index += 2)
+        {
+            values[reply[index]] = reply[index + 1];
+        }
+
+        //the reserved request is counted before being answered
+        assert(values.at("connections_accepted") == "1");
+        assert(values.at("requests") == "11");
+        assert(values.at("failed_requests") == "0");
+        assert(values.at("handler_count") == "10");
+
+        fty::SocketServerMetrics metrics = agent.getMetrics();
+        assert(metrics.requests == 11);
+        assert(metrics.bytesReceived > 0);
+        assert(metrics.receiveTime.count == 11);
+        assert(metrics.queueTime.count == 0);
+
+        serverThread.stop();
+
+        metrics = agent.getMetrics();
+        assert(metrics.connectionsClosed == 1);
+        assert(metrics.bytesSent > 0);
+        assert(metrics.sendTime.count == 11);
+    }
+
+    //metrics are empty when disabled
+    {
+        fty::EchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        assert(agent.getMetrics().requests == 0);
+        assert(agent.getMetrics().handlerTime.count == 0);
+    }
+
+    //overhead of the metrics
+    for(bool enabled : {false, true})
+    {
+        fty::EchoServer server;
+
+        fty::SocketServerConfig config;
+        config.metrics = enabled;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+        fty::Payload expectedPayload = {"overhead", "of", "the", "metrics"};
+
+        const int requests = 2000;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for(int request = 0; request < requests; request++)
+        {
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+
+        if(verbose)
+        {
+            printf("\n   %d requests with metrics %s: %lld us",
+                    requests, enabled ? "enabled" : "disabled",
+                    static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+        }
+    }
+
+    if(verbose)
+    {
+        printf("\n   ");
     }
     
     //check destroy
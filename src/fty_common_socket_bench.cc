@@ -0,0 +1,934 @@
+/*  =========================================================================
+    fty_common_socket_bench - Benchmarks of the unix socket transport
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_bench - Benchmarks of the unix socket transport
+@discuss
+    Results are written on stdout as a JSON document, so they can be
+    compared between releases.
+
+    framing: cost of sendFrames for typical multi-frames payloads, against
+             the previous encoder writing every field separately, and size
+             of the messages in framing V1 and V2. The number of write
+             system calls is counted by interposing them.
+
+    echo: round trips through SocketBasicServer and fty::EchoServer, with
+          p50/p99/p999 latencies and requests per second. It covers the
+          payload shapes (frame count, frame size, text or binary frames),
+          the number of concurrent clients, pooled connections against one
+          connection per request, the number of server event loops, the
+          event engines, large frames inline or in shared memory, and the
+          framing V1 or V2.
+
+    export: a large dataset sent by the server as one reply or as a
+            streamed reply, with the throughput and the growth of the peak
+            memory of the process, which holds both ends.
+@end
+*/
+
+#include "fty_common_socket_classes.h"
+#include "fty_common_unit_tests.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Count the write system calls of each thread: the benchmark interposes the
+// libc wrappers used by the encoders, for the library and for itself.
+static thread_local long long s_writeSyscalls = 0;
+
+extern "C" ssize_t write (int fd, const void *buffer, size_t count)
+{
+    s_writeSyscalls++;
+    return syscall (SYS_write, fd, buffer, count);
+}
+
+extern "C" ssize_t sendmsg (int socket, const struct msghdr *message, int flags)
+{
+    s_writeSyscalls++;
+    return syscall (SYS_sendmsg, socket, message, flags);
+}
+
+// Count the heap allocations of the whole process, client and server.
+// Not inlined, else the compiler sees new expressions paired with free().
+static std::atomic<long long> s_allocations(0);
+
+__attribute__ ((noinline)) void * operator new (size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void * pointer = malloc(size);
+
+    if (!pointer)
+        throw std::bad_alloc ();
+
+    return pointer;
+}
+
+__attribute__ ((noinline)) void operator delete (void * pointer) noexcept
+{
+    free(pointer);
+}
+
+__attribute__ ((noinline)) void operator delete (void * pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Latencies in nanoseconds, sorted
+    struct Latencies
+    {
+        std::vector<double> values;
+
+        void add(Clock::duration duration)
+        {
+            values.push_back(std::chrono::duration<double, std::nano>(duration).count());
+        }
+
+        void merge(const Latencies & other)
+        {
+            values.insert(values.end(), other.values.begin(), other.values.end());
+        }
+
+        double percentile(double rank)
+        {
+            if(values.empty())
+            {
+                return 0;
+            }
+
+            std::sort(values.begin(), values.end());
+            size_t index = std::min(values.size() - 1, (size_t) (rank * values.size()));
+            return values[index];
+        }
+    };
+
+    // Encoder used before sendFrames was vectored: 1 + 2 x N writes
+    void legacySendFrames(int socket, const fty::Payload & payload)
+    {
+        uint32_t numberOfFrame = payload.size();
+
+        if(write(socket, &numberOfFrame, sizeof(uint32_t)) != sizeof(uint32_t))
+        {
+            throw std::runtime_error("Error while writing number of frame");
+        }
+
+        for(const std::string & frame : payload)
+        {
+            uint32_t frameSize = frame.length() + 1;
+
+            if((write(socket, &frameSize, sizeof(uint32_t)) != sizeof(uint32_t))
+                || (write(socket, frame.data(), frameSize) != (ssize_t) frameSize))
+            {
+                throw std::runtime_error("Error while writing frame");
+            }
+        }
+    }
+
+    std::string framingResult(const std::string & encoder, size_t frames, size_t frameSize, size_t iterations,
+                              fty::SocketFraming framing, std::function<void(int, const fty::Payload &)> send)
+    {
+        int sockets[2];
+
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+        {
+            throw std::runtime_error("Impossible to create socket pair");
+        }
+
+        fty::Payload payload(frames, std::string(frameSize, 'x'));
+
+        uint64_t bytes = 0;
+
+        std::thread reader([&]()
+        {
+            fty::SocketFrameReader frameReader(sockets[1]);
+            frameReader.setFraming(framing);
+
+            for(size_t index = 0; index < iterations; index++)
+            {
+                frameReader.recvFrames();
+            }
+
+            bytes = frameReader.bytesReceived();
+        });
+
+        Latencies latencies;
+        long long syscallsBefore = s_writeSyscalls;
+
+        for(size_t index = 0; index < iterations; index++)
+        {
+            Clock::time_point start = Clock::now();
+            send(sockets[0], payload);
+            latencies.add(Clock::now() - start);
+        }
+
+        long long syscallsAfter = s_writeSyscalls;
+
+        reader.join();
+        close(sockets[0]);
+        close(sockets[1]);
+
+        std::ostringstream result;
+        result << "{\"test\": \"framing\", \"encoder\": \"" << encoder << "\""
+               << ", \"frames\": " << frames << ", \"frame_size\": " << frameSize
+               << ", \"iterations\": " << iterations
+               << ", \"syscalls_per_message\": " << (double) (syscallsAfter - syscallsBefore) / iterations
+               << ", \"bytes_per_message\": " << (double) bytes / iterations
+               << ", \"p50_ns\": " << latencies.percentile(0.50)
+               << ", \"p99_ns\": " << latencies.percentile(0.99) << "}";
+
+        return result.str();
+    }
+
+    std::vector<std::string> framingBench(size_t iterations)
+    {
+        std::vector<std::string> results;
+
+        for(size_t frames : {4, 6, 8, 10})
+        {
+            results.push_back(framingResult("legacy", frames, 32, iterations, fty::SocketFraming::V1, legacySendFrames));
+            results.push_back(framingResult("sendFrames", frames, 32, iterations, fty::SocketFraming::V1,
+                [](int socket, const fty::Payload & payload) { fty::sendFrames(socket, payload); }));
+
+            fty::MessageFormat format;
+            format.framing = fty::SocketFraming::V2;
+            format.requestId = 1;
+
+            results.push_back(framingResult("sendFrames_v2", frames, 32, iterations, fty::SocketFraming::V2,
+                [&format](int socket, const fty::Payload & payload) { fty::sendFrames(socket, payload, format); }));
+        }
+
+        return results;
+    }
+
+    const char * benchSocketPath = "bench.socket";
+
+    // Payload whose frames contain every byte value, including NUL
+    fty::SocketPayload binaryPayload(size_t frames, size_t frameSize)
+    {
+        std::string frame(frameSize, '\0');
+
+        for(size_t index = 0; index < frameSize; index++)
+        {
+            frame[index] = static_cast<char>(index % 256);
+        }
+
+        return fty::SocketPayload(frames, fty::SocketFrame(frame));
+    }
+
+    // Text frame looking like the JSON documents exchanged by the agents
+    std::string documentFrame(size_t frameSize)
+    {
+        std::ostringstream document;
+
+        for(size_t index = 0; document.tellp() < static_cast<std::streamoff>(frameSize); index++)
+        {
+            document << "{\"name\": \"ups-" << index << "\", \"status\": \"" << ((index % 7) ? "online" : "onbattery")
+                     << "\", \"load\": " << (index * 37) % 100 << ", \"realpower\": " << (index * 7919) % 4000 << "},";
+        }
+
+        return document.str().substr(0, frameSize);
+    }
+
+    const char * engineName(fty::SocketEventEngine engine)
+    {
+        switch(engine)
+        {
+            case fty::SocketEventEngine::SELECT:
+                return "select";
+            case fty::SocketEventEngine::EPOLL:
+                return "epoll";
+            case fty::SocketEventEngine::IO_URING:
+                return "io_uring";
+        }
+
+        return "unknown";
+    }
+
+    const char * framingName(fty::SocketFraming framing)
+    {
+        return (framing == fty::SocketFraming::V2) ? "v2" : "v1";
+    }
+
+    // Interface of the echo server
+    enum class EchoHandler
+    {
+        SYNC,       // SyncServer, on the loop
+        ARENA,      // SocketArenaServer, on the loop
+        ADAPTER,    // SyncServer through SocketSyncServerAdapter
+        DEFERRED,   // SocketAsyncServer replying from another thread, like a proxy
+        ENCODED     // SocketEncodedServer replying the text request, encoded once
+    };
+    
+    const char * handlerName(EchoHandler handler)
+    {
+        switch(handler)
+        {
+            case EchoHandler::SYNC:
+                return "sync";
+            case EchoHandler::ARENA:
+                return "arena";
+            case EchoHandler::ADAPTER:
+                return "adapter";
+            case EchoHandler::DEFERRED:
+                return "deferred";
+            case EchoHandler::ENCODED:
+                return "encoded";
+        }
+
+        return "unknown";
+    }
+
+    // Parameters of an echo run, by default small requests on one pooled connection
+    struct EchoCase
+    {
+        size_t frames = 4;
+        size_t frameSize = 32;
+        bool binary = false;
+        size_t clients = 1;
+        bool pooled = true;
+        size_t reactors = 1;
+        fty::SocketEventEngine engine = fty::SocketEventEngine::EPOLL;
+        size_t sharedFrameSize = 0;
+        fty::SocketFraming framing = fty::SocketFraming::V1;
+        bool document = false;
+        size_t compressionThreshold = 0;
+        EchoHandler handler = EchoHandler::SYNC;
+        size_t workers = 0;
+
+        // Text requests sent per syncRequestBatch call, 1 for single requests.
+        // The latencies are those of the calls.
+        size_t batch = 1;
+
+        // Replies served from a SocketResponseCache, SyncServer only
+        bool cached = false;
+    };
+    
+    // Echo server building its replies in the arena of the thread
+    class ArenaEchoServer : public fty::SocketArenaServer
+    {
+    public:
+        void handleRequest(const std::string & /*sender*/, const fty::SocketPayload & request, fty::SocketArenaPayload & reply) override
+        {
+            for(const fty::SocketFrame & frame : request)
+            {
+                reply.emplace_back(frame.data(), frame.size());
+            }
+        }
+    };
+    
+    // Server replying with the message it was built with, as an echo of the text requests
+    class EncodedEchoServer : public fty::SocketEncodedServer
+    {
+    public:
+        explicit EncodedEchoServer(const fty::Payload & reply)
+        :   m_reply(reply)
+        {
+        }
+
+        fty::SocketEncodedMessage handleRequest(const std::string & /*sender*/, const fty::SocketPayload & /*request*/) override
+        {
+            return m_reply;
+        }
+
+    private:
+        fty::SocketEncodedMessage m_reply;
+    };
+    
+    // Echo server handing its requests to a thread of its own, which replies
+    class DeferredEchoServer : public fty::SocketAsyncServer
+    {
+    public:
+        DeferredEchoServer()
+        :   m_thread(&DeferredEchoServer::replyLoop, this)
+        {
+        }
+
+        ~DeferredEchoServer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+
+            m_condition.notify_one();
+            m_thread.join();
+        }
+
+        void handleRequest(const std::string & /*sender*/, const fty::Payload & request, fty::SocketCompletion completion) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_requests.emplace_back(request, completion);
+            }
+
+            m_condition.notify_one();
+        }
+
+    private:
+        void replyLoop()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while(!m_stop)
+            {
+                if(m_requests.empty())
+                {
+                    m_condition.wait(lock);
+                    continue;
+                }
+
+                std::deque<std::pair<fty::Payload, fty::SocketCompletion>> requests;
+                requests.swap(m_requests);
+
+                lock.unlock();
+
+                for(std::pair<fty::Payload, fty::SocketCompletion> & request : requests)
+                {
+                    request.second.reply(std::move(request.first));
+                }
+
+                requests.clear();
+                lock.lock();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::deque<std::pair<fty::Payload, fty::SocketCompletion>> m_requests;
+        bool m_stop = false;
+        std::thread m_thread;
+    };
+
+    std::string echoResult(const EchoCase & echo, size_t requests)
+    {
+        const size_t frames = echo.frames;
+        const size_t clients = echo.clients;
+        const bool binary = echo.binary;
+
+        fty::Payload textRequest(frames, echo.document ? documentFrame(echo.frameSize) : std::string(echo.frameSize, 'x'));
+        fty::SocketPayload binaryRequest = binaryPayload(frames, echo.frameSize);
+
+        fty::EchoServer server;
+        ArenaEchoServer arenaServer;
+        fty::SocketSyncServerAdapter adapterServer(server);
+        DeferredEchoServer deferredServer;
+        EncodedEchoServer encodedServer(textRequest);
+
+        fty::SocketServerConfig config;
+        config.reactors = echo.reactors;
+        config.workers = echo.workers;
+
+        fty::SocketResponseCache cache;
+        config.responseCache = echo.cached ? &cache : nullptr;
+        config.engine = echo.engine;
+        config.sharedFrameSize = echo.sharedFrameSize;
+        config.compressionThreshold = echo.compressionThreshold;
+
+        //the byte counts show the compression ratio
+        config.metrics = echo.document;
+
+        size_t maxClient = std::max<size_t>(30, clients);
+        std::unique_ptr<fty::SocketBasicServer> agent;
+
+        switch(echo.handler)
+        {
+            case EchoHandler::SYNC:
+                agent.reset(new fty::SocketBasicServer(server, benchSocketPath, maxClient, config));
+                break;
+            case EchoHandler::ARENA:
+                agent.reset(new fty::SocketBasicServer(arenaServer, benchSocketPath, maxClient, config));
+                break;
+            case EchoHandler::ADAPTER:
+                agent.reset(new fty::SocketBasicServer(adapterServer, benchSocketPath, maxClient, config));
+                break;
+            case EchoHandler::DEFERRED:
+                agent.reset(new fty::SocketBasicServer(deferredServer, benchSocketPath, maxClient, config));
+                break;
+            case EchoHandler::ENCODED:
+                agent.reset(new fty::SocketBasicServer(encodedServer, benchSocketPath, maxClient, config));
+                break;
+        }
+
+        std::thread serverThread(&fty::SocketBasicServer::run, agent.get());
+
+        //one pooled connection per client thread, or a new connection for each request
+        fty::SocketClientConfig clientConfig;
+        clientConfig.maxConnections = echo.pooled ? clients : 0;
+        clientConfig.sharedFrameSize = echo.sharedFrameSize;
+        clientConfig.framing = echo.framing;
+        clientConfig.compressionThreshold = echo.compressionThreshold;
+
+        fty::SocketSyncClient client(benchSocketPath, clientConfig);
+
+        if(!textRequest.empty())
+        {
+            cache.cacheRequests(textRequest[0], std::chrono::hours(1));
+        }
+
+        //warm up the connections and the server
+        for(size_t index = 0; index < clients; index++)
+        {
+            client.syncRequestWithReply(textRequest);
+        }
+
+        std::vector<fty::Payload> batchRequests(echo.batch, textRequest);
+
+        std::mutex latenciesMutex;
+        Latencies latencies;
+        long long clientWrites = 0;
+        std::vector<std::thread> threads;
+
+        long long allocations = s_allocations;
+        Clock::time_point start = Clock::now();
+
+        for(size_t thread = 0; thread < clients; thread++)
+        {
+            //share the requests between the clients
+            size_t count = requests / clients + ((thread < (requests % clients)) ? 1 : 0);
+
+            threads.emplace_back([&, count]()
+            {
+                Latencies local;
+                local.values.reserve(count);
+
+                long long writesBefore = s_writeSyscalls;
+
+                for(size_t index = 0; index < count; index += echo.batch)
+                {
+                    Clock::time_point requestStart = Clock::now();
+
+                    if(echo.batch > 1)
+                    {
+                        if(client.syncRequestBatch(batchRequests).size() != echo.batch)
+                        {
+                            throw std::runtime_error("Unexpected reply");
+                        }
+                    }
+                    else if(binary)
+                    {
+                        fty::SocketPayload reply;
+                        client.syncRequestWithReply(binaryRequest, reply);
+
+                        if(reply.size() != frames)
+                        {
+                            throw std::runtime_error("Unexpected reply");
+                        }
+                    }
+                    else if(client.syncRequestWithReply(textRequest).size() != frames)
+                    {
+                        throw std::runtime_error("Unexpected reply");
+                    }
+
+                    local.add(Clock::now() - requestStart);
+                }
+
+                std::lock_guard<std::mutex> lock(latenciesMutex);
+                latencies.merge(local);
+                clientWrites += s_writeSyscalls - writesBefore;
+            });
+        }
+
+        for(std::thread & thread : threads)
+        {
+            thread.join();
+        }
+
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        //with the few ones of the client threads, spread over the requests
+        allocations = s_allocations - allocations;
+
+        //the last batch of a client is whole
+        requests = (requests + echo.batch - 1) / echo.batch * echo.batch;
+
+        uint64_t bytesReceived = agent->getMetrics().bytesReceived;
+
+        agent->requestStop();
+        serverThread.join();
+
+        std::ostringstream result;
+        result << "{\"test\": \"echo\", \"payload\": \"" << (binary ? "binary" : (echo.document ? "document" : "text")) << "\""
+               << ", \"frames\": " << frames << ", \"frame_size\": " << echo.frameSize
+               << ", \"clients\": " << clients
+               << ", \"connections\": \"" << (echo.pooled ? "pooled" : "per_request") << "\""
+               << ", \"reactors\": " << echo.reactors
+               << ", \"engine\": \"" << engineName(echo.engine) << "\""
+               << ", \"shared_frame_size\": " << echo.sharedFrameSize
+               << ", \"framing\": \"" << framingName(echo.framing) << "\""
+               << ", \"compression_threshold\": " << echo.compressionThreshold
+               << ", \"handler\": \"" << handlerName(echo.handler) << "\""
+               << ", \"workers\": " << echo.workers
+               << ", \"batch\": " << echo.batch
+               << ", \"cached\": " << (echo.cached ? "true" : "false")
+               << ", \"requests\": " << requests;
+
+        if(config.metrics)
+        {
+            result << ", \"bytes_per_request\": " << bytesReceived / (requests + clients);
+        }
+
+        result << ", \"allocations_per_request\": " << static_cast<double>(allocations) / requests
+               << ", \"client_writes_per_request\": " << static_cast<double>(clientWrites) / requests
+               << ", \"requests_per_sec\": " << requests / elapsed
+               << ", \"p50_ns\": " << latencies.percentile(0.50)
+               << ", \"p99_ns\": " << latencies.percentile(0.99)
+               << ", \"p999_ns\": " << latencies.percentile(0.999) << "}";
+
+        return result.str();
+    }
+
+    std::vector<std::string> echoBench(size_t requests)
+    {
+        std::vector<std::string> results;
+
+        //payload shapes, on one pooled connection
+        for(bool binary : {false, true})
+        {
+            for(size_t frames : {1, 4, 16})
+            {
+                for(size_t frameSize : {32, 1024, 16384})
+                {
+                    EchoCase echo;
+                    echo.frames = frames;
+                    echo.frameSize = frameSize;
+                    echo.binary = binary;
+                    results.push_back(echoResult(echo, requests));
+                }
+            }
+        }
+
+        //concurrent clients, reusing their connection or not
+        for(bool pooled : {true, false})
+        {
+            for(size_t clients : {1, 4, 16})
+            {
+                EchoCase echo;
+                echo.clients = clients;
+                echo.pooled = pooled;
+                results.push_back(echoResult(echo, requests));
+            }
+        }
+
+        //server event loops, under many clients
+        for(size_t reactors : {1, 2, 4})
+        {
+            EchoCase echo;
+            echo.clients = 16;
+            echo.reactors = reactors;
+            results.push_back(echoResult(echo, requests));
+        }
+
+        //event engines, under many clients
+        for(fty::SocketEventEngine engine : {fty::SocketEventEngine::SELECT, fty::SocketEventEngine::EPOLL, fty::SocketEventEngine::IO_URING})
+        {
+            try
+            {
+                fty::SocketPoller::create(engine);
+            }
+            catch(...)
+            {
+                //not in this build, or refused by the kernel
+                continue;
+            }
+
+            EchoCase echo;
+            echo.clients = 16;
+            echo.engine = engine;
+            results.push_back(echoResult(echo, requests));
+        }
+
+        //large frames, copied through the socket or passed in shared memory
+        for(size_t sharedFrameSize : {0, 64 * 1024})
+        {
+            EchoCase echo;
+            echo.frames = 1;
+            echo.frameSize = 4 * 1024 * 1024;
+            echo.binary = true;
+            echo.sharedFrameSize = sharedFrameSize;
+            results.push_back(echoResult(echo, std::max<size_t>(1, requests / 100)));
+        }
+
+        //framings, for chatty small messages
+        for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+        {
+            for(size_t frames : {1, 8})
+            {
+                EchoCase echo;
+                echo.frames = frames;
+                echo.frameSize = 16;
+                echo.framing = framing;
+                results.push_back(echoResult(echo, requests));
+            }
+        }
+
+        //replies built on the heap or in the arena, the allocations per request tell the difference
+        for(EchoHandler handler : {EchoHandler::SYNC, EchoHandler::ARENA})
+        {
+            for(bool binary : {false, true})
+            {
+                EchoCase echo;
+                echo.binary = binary;
+                echo.handler = handler;
+                results.push_back(echoResult(echo, requests));
+            }
+        }
+
+        //asynchronous handlers, completing on the loop or from another thread
+        for(EchoHandler handler : {EchoHandler::SYNC, EchoHandler::ADAPTER, EchoHandler::DEFERRED})
+        {
+            for(size_t clients : {1, 16})
+            {
+                EchoCase echo;
+                echo.clients = clients;
+                echo.handler = handler;
+                results.push_back(echoResult(echo, requests));
+            }
+        }
+
+        //bursts of small requests, one by one or in batches, handled on the loop or by workers
+        for(size_t workers : {0, 2})
+        {
+            for(size_t batch : {1, 10, 100})
+            {
+                EchoCase echo;
+                echo.workers = workers;
+                echo.batch = batch;
+                results.push_back(echoResult(echo, requests));
+            }
+        }
+
+        //replies encoded by each request, kept by the response cache, or encoded once by the handler
+        for(size_t frameSize : {32, 1024, 16384})
+        {
+            for(int reply = 0; reply < 3; reply++)
+            {
+                EchoCase echo;
+                echo.frames = 16;
+                echo.frameSize = frameSize;
+                echo.cached = (reply == 1);
+                echo.handler = (reply == 2) ? EchoHandler::ENCODED : EchoHandler::SYNC;
+                results.push_back(echoResult(echo, requests));
+            }
+        }
+
+        //compression of documents, to find the frame size where it pays off
+        if(fty::isCompressionAvailable())
+        {
+            for(size_t frameSize : {256, 1024, 4096, 16384, 65536, 1024 * 1024})
+            {
+                for(size_t compressionThreshold : {0, 1})
+                {
+                    EchoCase echo;
+                    echo.frames = 1;
+                    echo.frameSize = frameSize;
+                    echo.document = true;
+                    echo.compressionThreshold = compressionThreshold;
+                    results.push_back(echoResult(echo, std::max<size_t>(20, requests * 1024 / std::max<size_t>(1024, frameSize))));
+                }
+            }
+        }
+
+        return results;
+    }
+
+    const size_t exportFrameSize = 64 * 1024;
+
+    // Server exporting size bytes in frames of exportFrameSize, as one reply or as a stream
+    class ExportServer : public fty::SyncServer, public fty::SocketStreamServer
+    {
+    public:
+        explicit ExportServer(size_t size)
+        :   m_size(size)
+        {
+        }
+
+        fty::Payload handleRequest(const fty::Sender & /*sender*/, const fty::Payload & /*payload*/) override
+        {
+            return fty::Payload(m_size / exportFrameSize, std::string(exportFrameSize, 'x'));
+        }
+
+        void handleStream(const std::string & /*sender*/, fty::SocketStreamReader & request, fty::SocketStreamWriter & reply) override
+        {
+            request.skip();
+
+            fty::SocketFrame frame(std::string(exportFrameSize, 'x'));
+
+            for(size_t sent = 0; sent < m_size; sent += exportFrameSize)
+            {
+                reply.send(frame);
+            }
+        }
+
+    private:
+        size_t m_size;
+    };
+
+    long peakMemoryKb()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_maxrss;
+    }
+
+    std::string exportResult(bool streamed, size_t size)
+    {
+        long peakBefore = peakMemoryKb();
+
+        ExportServer server(size);
+
+        fty::SocketServerConfig config;
+        config.streamServer = &server;
+
+        fty::SocketBasicServer agent(server, benchSocketPath, 30, config);
+
+        std::thread serverThread(&fty::SocketBasicServer::run, &agent);
+
+        fty::SocketSyncClient client(benchSocketPath);
+        size_t received = 0;
+
+        Clock::time_point start = Clock::now();
+
+        if(streamed)
+        {
+            client.streamRequest([](fty::SocketFrame &)
+            {
+                return false;
+            },
+            [&received](const fty::SocketFrame & frame)
+            {
+                received += frame.size();
+            });
+        }
+        else
+        {
+            for(const std::string & frame : client.syncRequestWithReply({"export"}))
+            {
+                received += frame.size();
+            }
+        }
+
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        agent.requestStop();
+        serverThread.join();
+
+        if(received != size)
+        {
+            throw std::runtime_error("Unexpected reply");
+        }
+
+        std::ostringstream result;
+        result << "{\"test\": \"export\", \"reply\": \"" << (streamed ? "stream" : "payload") << "\""
+               << ", \"bytes\": " << size
+               << ", \"mb_per_sec\": " << size / elapsed / (1024 * 1024)
+               << ", \"peak_memory_growth_kb\": " << peakMemoryKb() - peakBefore << "}";
+
+        return result.str();
+    }
+
+    std::vector<std::string> exportBench()
+    {
+        //the stream first, the peak memory of the process only grows
+        return {exportResult(true, 128 * 1024 * 1024), exportResult(false, 128 * 1024 * 1024)};
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    size_t iterations = 10000;
+    size_t requests = 2000;
+    std::string test;
+
+    for (int argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("fty_common_socket_bench [options] ...");
+            puts ("  --iterations / -i [n]  number of messages per measure");
+            puts ("  --requests / -r [n]    number of round trips per echo measure");
+            puts ("  --test / -t [name]     run only benchmark 'name' (framing, echo, export)");
+            return 0;
+        }
+        if ((streq (argv [argn], "--iterations")
+        ||   streq (argv [argn], "-i")) && (argn + 1 < argc))
+            iterations = std::stoul (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--requests")
+        ||   streq (argv [argn], "-r")) && (argn + 1 < argc))
+            requests = std::stoul (argv [++argn]);
+        else
+        if ((streq (argv [argn], "--test")
+        ||   streq (argv [argn], "-t")) && (argn + 1 < argc))
+            test = argv [++argn];
+        else {
+            fprintf (stderr, "Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> results;
+
+    if (test.empty () || test == "framing") {
+        std::vector<std::string> framing = framingBench (iterations);
+        results.insert (results.end (), framing.begin (), framing.end ());
+    }
+
+    if (test.empty () || test == "echo") {
+        std::vector<std::string> echo = echoBench (requests);
+        results.insert (results.end (), echo.begin (), echo.end ());
+    }
+
+    if (test.empty () || test == "export") {
+        std::vector<std::string> exported = exportBench ();
+        results.insert (results.end (), exported.begin (), exported.end ());
+    }
+
+    printf ("{\n  \"library\": \"fty-common-socket\",\n  \"version\": \"%d.%d.%d\",\n  \"results\": [\n",
+        FTY_COMMON_SOCKET_VERSION_MAJOR, FTY_COMMON_SOCKET_VERSION_MINOR, FTY_COMMON_SOCKET_VERSION_PATCH);
+
+    for (size_t index = 0; index < results.size (); index++)
+        printf ("    %s%s\n", results [index].c_str (), (index + 1 < results.size ()) ? "," : "");
+
+    printf ("  ]\n}\n");
+
+    return 0;
+}
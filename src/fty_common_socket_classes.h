@@ -37,6 +37,26 @@
 typedef struct _fty_common_socket_helpers_t fty_common_socket_helpers_t;
 #define FTY_COMMON_SOCKET_HELPERS_T_DEFINED
 #endif
+#ifndef FTY_COMMON_SOCKET_POLLER_T_DEFINED
+typedef struct _fty_common_socket_poller_t fty_common_socket_poller_t;
+#define FTY_COMMON_SOCKET_POLLER_T_DEFINED
+#endif
+#ifndef FTY_COMMON_SOCKET_WORKER_POOL_T_DEFINED
+typedef struct _fty_common_socket_worker_pool_t fty_common_socket_worker_pool_t;
+#define FTY_COMMON_SOCKET_WORKER_POOL_T_DEFINED
+#endif
+#ifndef FTY_COMMON_SOCKET_CREDENTIALS_T_DEFINED
+typedef struct _fty_common_socket_credentials_t fty_common_socket_credentials_t;
+#define FTY_COMMON_SOCKET_CREDENTIALS_T_DEFINED
+#endif
+#ifndef FTY_COMMON_SOCKET_METRICS_T_DEFINED
+typedef struct _fty_common_socket_metrics_t fty_common_socket_metrics_t;
+#define FTY_COMMON_SOCKET_METRICS_T_DEFINED
+#endif
+#ifndef FTY_COMMON_SOCKET_TEST_SERVER_T_DEFINED
+typedef struct _fty_common_socket_test_server_t fty_common_socket_test_server_t;
+#define FTY_COMMON_SOCKET_TEST_SERVER_T_DEFINED
+#endif
 
 //  Extra headers
 
@@ -80,6 +100,11 @@ safe_malloc (size_t size, const char *file, unsigned line)
 
 
 #include "fty_common_socket_helpers.h"
+#include "fty_common_socket_test_server.h"
+#include "fty_common_socket_metrics.h"
+#include "fty_common_socket_credentials.h"
+#include "fty_common_socket_worker_pool.h"
+#include "fty_common_socket_poller.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef FTY_COMMON_SOCKET_BUILD_DRAFT_API
@@ -0,0 +1,137 @@
+/*  =========================================================================
+    fty_common_socket_credentials - Cached resolution of the peer credentials
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_credentials - Cached resolution of the peer credentials
+@discuss
+    Lookups use getpwuid_r, so they are safe from any thread. Unknown uids
+    are cached as well, to not hit NSS again for each of their connections.
+@end
+*/
+
+#include "fty_common_socket_credentials.h"
+
+#include <errno.h>
+#include <pwd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <vector>
+
+namespace fty
+{
+    SocketCredentialCache & SocketCredentialCache::instance()
+    {
+        static SocketCredentialCache cache;
+        return cache;
+    }
+    
+    std::string SocketCredentialCache::getUserName(uid_t uid)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::map<uid_t, Entry>::const_iterator it = m_entries.find(uid);
+            
+            if((it != m_entries.end()) && (it->second.expiry > now))
+            {
+                if(!it->second.found)
+                {
+                    throw std::runtime_error("Unknown user id " + std::to_string(uid));
+                }
+                
+                return it->second.name;
+            }
+        }
+        
+        //resolve without holding the lock, NSS may be slow
+        long sizeMax = sysconf(_SC_GETPW_R_SIZE_MAX);
+        std::vector<char> buffer((sizeMax > 0) ? sizeMax : 16384);
+        
+        struct passwd pwd;
+        struct passwd * result = NULL;
+        int ret;
+        
+        while((ret = getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &result)) == ERANGE)
+        {
+            buffer.resize(buffer.size() * 2);
+        }
+        
+        if(ret != 0)
+        {
+            //lookup failure, not a missing entry: don't cache it
+            throw std::runtime_error("Impossible to get the user of id " + std::to_string(uid) + ": " + std::string(strerror(ret)));
+        }
+        
+        Entry entry;
+        entry.found = (result != NULL);
+        entry.name = entry.found ? std::string(pwd.pw_name) : std::string();
+        
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            entry.expiry = now + m_timeToLive;
+            m_entries[uid] = entry;
+        }
+        
+        if(!entry.found)
+        {
+            throw std::runtime_error("Unknown user id " + std::to_string(uid));
+        }
+        
+        return entry.name;
+    }
+    
+    void SocketCredentialCache::invalidate()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.clear();
+    }
+    
+    void SocketCredentialCache::invalidate(uid_t uid)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.erase(uid);
+    }
+    
+    void SocketCredentialCache::setTimeToLive(std::chrono::seconds timeToLive)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_timeToLive = timeToLive;
+    }
+    
+    std::string getPeerUserName(int socket)
+    {
+        //get credential info
+        struct ucred cred;
+        socklen_t lenCredStruct = sizeof(struct ucred);
+
+        if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &lenCredStruct) == -1)
+        {
+            throw std::runtime_error("Impossible to get sender: " + std::string(strerror(errno)));
+        }
+        
+        return SocketCredentialCache::instance().getUserName(cred.uid);
+    }
+    
+} //namespace fty
@@ -0,0 +1,70 @@
+/*  =========================================================================
+    fty_common_socket_credentials - Cached resolution of the peer credentials
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_CREDENTIALS_H_INCLUDED
+#define FTY_COMMON_SOCKET_CREDENTIALS_H_INCLUDED
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+
+namespace fty
+{
+    // Process wide cache of user names, to keep NSS lookups (files, LDAP,
+    // sssd...) off the request path. Entries expire after a time to live.
+    // This class is thread safe.
+    
+    class SocketCredentialCache
+    {
+    public:
+        static SocketCredentialCache & instance();
+        
+        // Name of the user, throw if the uid has no passwd entry
+        std::string getUserName(uid_t uid);
+        
+        void invalidate();
+        void invalidate(uid_t uid);
+        void setTimeToLive(std::chrono::seconds timeToLive);
+        
+    private:
+        SocketCredentialCache() = default;
+        
+        struct Entry
+        {
+            bool found;
+            std::string name;
+            std::chrono::steady_clock::time_point expiry;
+        };
+        
+        //attributs
+        std::mutex m_mutex;
+        std::map<uid_t, Entry> m_entries;
+        std::chrono::seconds m_timeToLive = std::chrono::seconds(60);
+    };
+    
+    // Name of the user running the process at the other end of the socket
+    std::string getPeerUserName(int socket);
+    
+} //namespace fty
+
+#endif
@@ -0,0 +1,193 @@
+/*  =========================================================================
+    fty_common_socket_encoded_message - Replies encoded once, sent many times
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_encoded_message - Replies encoded once, sent many times
+@discuss
+    A SocketEncodedServer returns SocketEncodedMessage replies, which
+    SocketBasicServer writes as they are, behind the request id of V2. The
+    response cache keeps its replies in the same form.
+@end
+*/
+
+#include "fty_common_socket_encoded_message.h"
+#include "fty_common_socket_helpers.h"
+
+namespace fty
+{
+    SocketEncodedMessage::SocketEncodedMessage(const Payload & payload)
+    {
+        if(payload.empty())
+        {
+            return;
+        }
+        
+        std::shared_ptr<Data> data = std::make_shared<Data>();
+        data->frames = payload.size();
+        data->v1 = encodeMessage(payload, SocketFraming::V1);
+        data->v2 = encodeMessage(payload, SocketFraming::V2);
+        
+        m_data = data;
+    }
+    
+    size_t SocketEncodedMessage::frames() const
+    {
+        return m_data ? m_data->frames : 0;
+    }
+    
+    const std::string & SocketEncodedMessage::encoded(SocketFraming framing) const
+    {
+        static const std::string none;
+        
+        if(!m_data)
+        {
+            return none;
+        }
+        
+        return (framing == SocketFraming::V2) ? m_data->v2 : m_data->v1;
+    }
+    
+    size_t SocketEncodedMessage::size() const
+    {
+        return m_data ? (m_data->v1.size() + m_data->v2.size()) : 0;
+    }
+
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_sync_client.h"
+#include "fty_common_socket_test_server.h"
+#include <cassert>
+#include <cstring>
+#include <stdio.h>
+
+namespace
+{
+    // Reply to "assets" with a message encoded once, nothing to the rest
+    class StaticServer : public fty::SocketEncodedServer
+    {
+    public:
+        fty::SocketEncodedMessage handleRequest(const std::string & /*sender*/, const fty::SocketPayload & request) override
+        {
+            if((request.size() == 1) && (request[0].str() == "assets"))
+            {
+                return m_assets;
+            }
+
+            return fty::SocketEncodedMessage();
+        }
+
+        const fty::Payload assets = {"asset-1", "asset-2", std::string(1000, 'x')};
+
+    private:
+        fty::SocketEncodedMessage m_assets{assets};
+    };
+}
+
+void
+fty_common_socket_encoded_message_test (bool verbose)
+{
+    printf (" * fty_common_socket_encoded_message: ");
+
+    //  @selftest
+    //  Both framings are encoded, and shared by the copies
+    {
+        fty::SocketEncodedMessage message({"a", "bc"});
+
+        assert(!message.empty());
+        assert(message.frames() == 2);
+
+        //[ 2 ] [ 2 ] "a\0" [ 3 ] "bc\0", lengths of 32 bits
+        const std::string & v1 = message.encoded(fty::SocketFraming::V1);
+        assert(v1.size() == 4 + 4 + 2 + 4 + 3);
+
+        uint32_t numberOfFrame;
+        memcpy(&numberOfFrame, v1.data(), sizeof(numberOfFrame));
+        assert(numberOfFrame == 2);
+
+        //[ 2 ] [ 1 << 2 ] "a" [ 2 << 2 ] "bc", without the flags
+        assert(message.encoded(fty::SocketFraming::V2) == std::string("\x02\x04" "a" "\x08" "bc"));
+        assert(message.size() == v1.size() + 6);
+
+        fty::SocketEncodedMessage copy = message;
+        assert(&copy.encoded(fty::SocketFraming::V1) == &v1);
+    }
+
+    //  No message, whether default or from an empty payload
+    {
+        fty::SocketEncodedMessage none;
+        fty::SocketEncodedMessage empty((fty::Payload()));
+
+        assert(none.empty() && empty.empty());
+        assert(empty.frames() == 0);
+        assert(empty.encoded(fty::SocketFraming::V2).empty());
+    }
+
+    //  Encoded replies, built once and sent to clients of both framings, on the loop and on workers
+    for(size_t workers : {0, 2})
+    {
+        StaticServer server;
+
+        fty::SocketServerConfig config;
+        config.workers = workers;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+        {
+            fty::SocketClientConfig clientConfig;
+            clientConfig.maxConnections = 1;
+            clientConfig.framing = framing;
+
+            fty::SocketSyncClient syncClient("test.socket", clientConfig);
+
+            for(int request = 0; request < 10; request++)
+            {
+                assert(syncClient.syncRequestWithReply({"assets"}) == server.assets);
+            }
+
+            std::vector<fty::Payload> replies = syncClient.syncRequestBatch(std::vector<fty::Payload>(100, {"assets"}));
+            assert(replies == std::vector<fty::Payload>(100, server.assets));
+
+            //no reply: the connection is closed by the client on its timeout
+            try
+            {
+                syncClient.syncRequestWithReply({"none"}, std::chrono::milliseconds(50));
+                assert(false);
+            }
+            catch(fty::SocketTimeoutError &)
+            {
+            }
+        }
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,227 @@
+/*  =========================================================================
+    fty_common_socket_frame - Binary safe frame sharing the buffer it was received in
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_frame - Binary safe frame sharing the buffer it was received in
+@discuss
+    SocketFrame is the frame type of the zero copy overloads of
+    SocketSyncClient::syncRequestWithReply. Received frames share the
+    receive buffer of the message instead of being copied out of it.
+@end
+*/
+
+#include "fty_common_socket_frame.h"
+
+#include <string.h>
+
+namespace fty
+{
+    SocketFrame::SocketFrame(const std::string & data)
+    :   SocketFrame(std::string(data))
+    {
+    }
+    
+    SocketFrame::SocketFrame(std::string && data)
+    {
+        std::shared_ptr<std::string> owner = std::make_shared<std::string>(std::move(data));
+        
+        m_data = owner->data();
+        m_size = owner->size();
+        m_owner = std::move(owner);
+    }
+    
+    SocketFrame::SocketFrame(std::shared_ptr<const void> owner, const char * data, size_t size)
+    :   m_owner(std::move(owner)), m_data(data), m_size(size)
+    {
+    }
+    
+    bool SocketFrame::operator==(const SocketFrame & other) const
+    {
+        return (m_size == other.m_size) && ((m_size == 0) || (memcmp(m_data, other.m_data, m_size) == 0));
+    }
+    
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_socket_helpers.h"
+
+#include <cassert>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+
+void
+fty_common_socket_frame_test (bool verbose)
+{
+    printf (" * fty_common_socket_frame: ");
+
+    //  @selftest
+    //  Frames are binary safe and share their buffer when copied
+    std::string binary("bin\0ary", 7);
+    fty::SocketFrame frame(binary);
+    assert(frame.size() == 7);
+    assert(frame.str() == binary);
+
+    fty::SocketFrame copy = frame;
+    assert(copy.data() == frame.data());
+    assert(copy == frame);
+
+    //  Views keep their owner alive
+    std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(binary.begin(), binary.end());
+    fty::SocketFrame view(buffer, buffer->data() + 3, 4);
+    buffer.reset();
+    assert(view == fty::SocketFrame(std::string("\0ary", 4)));
+    assert(view != frame);
+    assert(fty::SocketFrame().empty());
+
+    //  Received frames view the receive buffer, which is kept while they live:
+    //  both messages are read at once and share it
+    int sockets[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    fty::SocketPayload first = {frame, fty::SocketFrame(std::string("first"))};
+    fty::SocketPayload second = {fty::SocketFrame(std::string("second"))};
+    fty::sendFrames(sockets[0], first);
+    fty::sendFrames(sockets[0], second);
+
+    fty::SocketFrameReader reader(sockets[1]);
+    fty::SocketPayload firstReceived, secondReceived;
+    reader.recvFrames(firstReceived);
+    assert(reader.hasMessage());
+    reader.recvFrames(secondReceived);
+    assert(firstReceived == first);
+    assert(secondReceived == second);
+    assert(firstReceived[1].data() + firstReceived[1].size() + 1 + 2 * sizeof(uint32_t) == secondReceived[0].data());
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    //  Shared frames queued while the peer doesn't read are sent with their message
+    {
+        int pair[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+
+        //fill the socket buffers, the next messages are queued
+        fty::SocketFrameWriter writer(pair[0]);
+        fty::Payload filler = {std::string(4 * 1024 * 1024, 'x')};
+        writer.sendFrames(filler);
+        assert(writer.hasPending());
+
+        //more shared frames than a message of descriptors takes
+        writer.setSharedFrameSize(1024);
+        std::vector<fty::Payload> messages;
+
+        for(int message = 0; message < 8; message++)
+        {
+            fty::Payload payload;
+
+            for(int frame = 0; frame < 20; frame++)
+            {
+                payload.push_back(std::to_string(message) + "-" + std::to_string(frame) + std::string(2048, 'y'));
+            }
+
+            messages.push_back(payload);
+            writer.sendFrames(payload);
+        }
+
+        std::thread peer([&pair, &filler, &messages]()
+        {
+            fty::SocketFrameReader peerReader(pair[1]);
+            peerReader.setSharedFrames(true);
+            assert(peerReader.recvFrames() == filler);
+
+            for(const fty::Payload & message : messages)
+            {
+                assert(peerReader.recvFrames() == message);
+            }
+        });
+
+        writer.waitFlushed();
+        peer.join();
+
+        close(pair[0]);
+        close(pair[1]);
+    }
+
+    //  Shared frames are refused unless accepted, and count in the limit of the reader
+    {
+        int pair[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+
+        fty::SocketFrameWriter writer(pair[0]);
+        writer.setSharedFrameSize(1024);
+
+        fty::Payload small = {std::string(4096, 's')};
+        writer.sendFrames(small);
+
+        fty::SocketFrameReader refusing(pair[1]);
+        bool refused = false;
+
+        try
+        {
+            refusing.recvFrames();
+        }
+        catch(std::runtime_error &)
+        {
+            refused = true;
+        }
+
+        assert(refused);
+
+        close(pair[0]);
+        close(pair[1]);
+
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+
+        fty::SocketFrameWriter sharingWriter(pair[0]);
+        sharingWriter.setSharedFrameSize(1024);
+        sharingWriter.sendFrames(small);
+        sharingWriter.sendFrames(fty::Payload({std::string(12 * 1024, 'l'), std::string(12 * 1024, 'l')}));
+
+        fty::SocketFrameReader limited(pair[1]);
+        limited.setSharedFrames(true);
+        limited.setMaxBufferSize(16 * 1024);
+        assert(limited.recvFrames() == small);
+
+        bool overLimit = false;
+
+        try
+        {
+            limited.recvFrames();
+        }
+        catch(fty::BufferLimitError &)
+        {
+            overLimit = true;
+        }
+
+        assert(overLimit);
+
+        close(pair[0]);
+        close(pair[1]);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
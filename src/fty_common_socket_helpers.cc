@@ -27,92 +27,1581 @@
 */
 
 #include "fty_common_socket_helpers.h"
+#include "platform.h"
 
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#ifdef FTY_COMMON_SOCKET_HAVE_LZ4
+#include <lz4.h>
+#endif
+#include <algorithm>
 #include <stdexcept>
+#include <thread>
 
 #include <iostream>
 
 namespace fty
 {
 
-    Payload recvFrames(int socket)
+    //format => [ Number of frames ], [ <size of frame 1> <data> ], ... [ <size of frame N> <data> ]
+    //frames are sent with a terminating NUL, included in their size
+    
+    static const char frameTerminator = 0;
+    
+    // Size of the frame content, without its terminating NUL
+    static size_t stripTerminator(const char * data, uint32_t frameSize)
+    {
+        return ((frameSize > 0) && (data[frameSize - 1] == frameTerminator)) ? frameSize - 1 : frameSize;
+    }
+    
+    const std::string capabilitiesFrame("\0fty-common-socket-capabilities", 32);
+    const std::string sharedFramesCapability("shared-frames");
+    const std::string overloadedFrame("\0fty-common-socket-overloaded", 29);
+    const std::string compressionCapability("lz4");
+    const std::string streamFrame("\0fty-common-socket-stream", 25);
+    const std::string streamAcceptedFrame("\0fty-common-socket-stream-accepted", 34);
+    
+    bool isCompressionAvailable()
+    {
+#ifdef FTY_COMMON_SOCKET_HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    
+    //read as a V1 number of frames, the preamble would be a message of 39 millions frames
+    const std::string framingPreamble("\xF7" "FS" "\x02", 4);
+    
+    //a varint of 64 bits holds up to 10 groups of 7 bits
+    static const size_t maxVarintSize = 10;
+    
+    // Append value to out as a varint, out must have room for it
+    static size_t encodeVarint(uint64_t value, char * out)
+    {
+        size_t size = 0;
+        
+        while(value >= 0x80)
+        {
+            out[size++] = static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        
+        out[size++] = static_cast<char>(value);
+        
+        return size;
+    }
+    
+    // Decode the varint at data + offset and move offset after it.
+    // Return false if the available bytes end before the varint.
+    static bool decodeVarint(const char * data, size_t available, size_t & offset, uint64_t & value)
+    {
+        value = 0;
+        
+        for(size_t index = 0; index < maxVarintSize; index++)
+        {
+            if(offset + index >= available)
+            {
+                return false;
+            }
+            
+            uint8_t byte = static_cast<uint8_t>(data[offset + index]);
+            value |= static_cast<uint64_t>(byte & 0x7F) << (7 * index);
+            
+            if((byte & 0x80) == 0)
+            {
+                offset += index + 1;
+                return true;
+            }
+        }
+        
+        throw std::runtime_error("Read error: invalid number");
+    }
+    
+    // Decode a V2 message header at data + offset, return false if it's not whole
+    static bool decodeHeader(const char * data, size_t available, size_t & offset, uint64_t & requestId, uint32_t & numberOfFrame)
+    {
+        size_t position = offset;
+        
+        if(position >= available)
+        {
+            return false;
+        }
+        
+        uint8_t flags = static_cast<uint8_t>(data[position++]);
+        
+        if(flags & ~requestIdFlag)
+        {
+            throw std::runtime_error("Read error: unknown message flags");
+        }
+        
+        requestId = 0;
+        uint64_t count = 0;
+        
+        if(((flags & requestIdFlag) && !decodeVarint(data, available, position, requestId))
+            || !decodeVarint(data, available, position, count))
+        {
+            return false;
+        }
+        
+        if(count > UINT32_MAX)
+        {
+            throw std::runtime_error("Read error: too many frames");
+        }
+        
+        numberOfFrame = static_cast<uint32_t>(count);
+        offset = position;
+        
+        return true;
+    }
+    
+    // Size of a frame, and how its content is sent
+    struct FrameHeader
+    {
+        uint32_t length = 0;        // bytes in the stream
+        bool shared = false;
+        bool compressed = false;
+    };
+    
+    // Decode the frame size at data + offset, return false if it's not whole.
+    // Compressed and shared frames are only expected once negotiated.
+    static bool decodeFrameHeader(SocketFraming framing, bool compression, bool sharedFrames, const char * data, size_t available,
+                                  size_t & offset, FrameHeader & frame)
+    {
+        if(framing == SocketFraming::V1)
+        {
+            if(available < offset + sizeof(uint32_t))
+            {
+                return false;
+            }
+            
+            uint32_t frameSize;
+            memcpy(&frameSize, data + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+            
+            frame.shared = (frameSize & sharedFrameFlag) != 0;
+            
+            if(frame.shared && !sharedFrames)
+            {
+                throw std::runtime_error("Read error: shared frame not accepted");
+            }
+            
+            frame.compressed = !frame.shared && compression && ((frameSize & compressedFrameFlag) != 0);
+            frame.length = frame.shared ? 0 : (frame.compressed ? (frameSize & ~compressedFrameFlag) : frameSize);
+            
+            return true;
+        }
+        
+        uint64_t value = 0;
+        
+        if(!decodeVarint(data, available, offset, value))
+        {
+            return false;
+        }
+        
+        if((value >> 2) >= sharedFrameFlag)
+        {
+            throw std::runtime_error("Read error: frame too large");
+        }
+        
+        frame.shared = (value & 1) != 0;
+        frame.compressed = (value & 2) != 0;
+        frame.length = static_cast<uint32_t>(value >> 2);
+        
+        if((frame.compressed && !compression) || (frame.shared && (!sharedFrames || frame.compressed || (frame.length > 0))))
+        {
+            throw std::runtime_error("Read error: invalid frame size");
+        }
+        
+        return true;
+    }
+    
+    // Decompress a frame in a buffer of its own, of at most maxSize bytes if not 0
+    static std::shared_ptr<std::vector<char>> decompressFrame(const char * data, size_t length, size_t maxSize)
+    {
+#ifdef FTY_COMMON_SOCKET_HAVE_LZ4
+        size_t offset = 0;
+        uint64_t size = 0;
+        
+        if(!decodeVarint(data, length, offset, size) || (size >= sharedFrameFlag))
+        {
+            throw std::runtime_error("Read error: invalid compressed frame");
+        }
+        
+        if((maxSize > 0) && (size > maxSize))
+        {
+            throw BufferLimitError("Read error: frame larger than " + std::to_string(maxSize) + " bytes");
+        }
+        
+        std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(size);
+        
+        int ret = LZ4_decompress_safe(data + offset, buffer->data(), static_cast<int>(length - offset), static_cast<int>(size));
+        
+        if((ret < 0) || (static_cast<uint64_t>(ret) != size))
+        {
+            throw std::runtime_error("Read error: invalid compressed frame");
+        }
+        
+        return buffer;
+#else
+        throw std::runtime_error("Read error: compression is not available in this build");
+#endif
+    }
+    
+    bool isOverloadedReply(const Payload & reply)
+    {
+        return (reply.size() == 1) && (reply[0] == overloadedFrame);
+    }
+    
+    bool isOverloadedReply(const SocketPayload & reply)
+    {
+        return (reply.size() == 1) && (reply[0] == SocketFrame(overloadedFrame));
+    }
+    
+    //a shared frame must not change or shrink while it is mapped
+    static const int sharedFrameSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    
+    //at most one SCM_RIGHTS message of descriptors by message
+    static const size_t maxSharedFrames = 64;
+    
+    // Copy the frame in a new sealed memfd, return its descriptor
+    static int createSharedFrame(const char * data, size_t size)
+    {
+        int fd = memfd_create("fty-common-socket-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        
+        if(fd == -1)
+        {
+            throw std::runtime_error("Impossible to create shared frame: " + std::string(strerror(errno)));
+        }
+        
+        size_t written = 0;
+        
+        while(written < size)
+        {
+            ssize_t ret = write(fd, data + written, size - written);
+            
+            if(ret > 0)
+            {
+                written += ret;
+            }
+            else if((ret == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            else
+            {
+                break;
+            }
+        }
+        
+        if((written < size) || (fcntl(fd, F_ADD_SEALS, sharedFrameSeals) == -1))
+        {
+            std::string error(strerror(errno));
+            close(fd);
+            throw std::runtime_error("Impossible to write shared frame: " + error);
+        }
+        
+        return fd;
+    }
+    
+    // Map a received shared frame read only, and take its descriptor.
+    // Throw BufferLimitError if it is larger than maxSize, when not 0.
+    static std::shared_ptr<const void> mapSharedFrame(int fd, size_t maxSize, const char * & data, size_t & size)
+    {
+        struct stat status;
+        int seals = fcntl(fd, F_GET_SEALS);
+        
+        //the sender must not be able to change the frame while we read it
+        if((seals == -1) || ((seals & sharedFrameSeals) != sharedFrameSeals) || (fstat(fd, &status) == -1))
+        {
+            close(fd);
+            throw std::runtime_error("Read error: shared frame is not sealed");
+        }
+        
+        size = status.st_size;
+        
+        if(size == 0)
+        {
+            close(fd);
+            throw std::runtime_error("Read error: Empty frame");
+        }
+        
+        if((maxSize > 0) && (size > maxSize))
+        {
+            close(fd);
+            throw BufferLimitError("Read error: shared frame larger than " + std::to_string(maxSize) + " bytes");
+        }
+        
+        void * address = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        
+        if(address == MAP_FAILED)
+        {
+            throw std::runtime_error("Read error: impossible to map shared frame: " + std::string(strerror(errno)));
+        }
+        
+        data = static_cast<const char *>(address);
+        size_t length = size;
+        
+        return std::shared_ptr<const void>(address, [length](const void * mapping)
+        {
+            munmap(const_cast<void *>(mapping), length);
+        });
+    }
+    
+    // Poll timeout until the deadline, rounded up. Throw if it is passed.
+    static int remainingTime(SocketDeadline deadline)
+    {
+        if(deadline == noDeadline)
+        {
+            return -1;
+        }
+        
+        std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+        
+        if(left <= std::chrono::steady_clock::duration::zero())
+        {
+            throw SocketTimeoutError("Timeout on the socket");
+        }
+        
+        return static_cast<int>(std::min<std::chrono::milliseconds::rep>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1, INT_MAX));
+    }
+    
+    short waitSocket(int socket, short events, SocketDeadline deadline)
+    {
+        struct pollfd watched;
+        watched.fd = socket;
+        watched.events = events;
+        watched.revents = 0;
+        
+        for(;;)
+        {
+            int ret = poll(&watched, 1, remainingTime(deadline));
+            
+            if(ret > 0)
+            {
+                return watched.revents;
+            }
+            
+            if((ret == -1) && (errno != EINTR))
+            {
+                throw std::runtime_error("Error while waiting on the socket: " + std::string(strerror(errno)));
+            }
+        }
+    }
+    
+    static void closeDescriptors(std::vector<int> & descriptors)
+    {
+        for(int fd : descriptors)
+        {
+            close(fd);
+        }
+        
+        descriptors.clear();
+    }
+    
+    //the number of frames comes from the peer: reserve for a few of them only
+    static const size_t maxReservedFrames = 64;
+    
+    static std::string decodeFrame(const char * data, uint32_t frameSize)
+    {
+        return std::string(data, stripTerminator(data, frameSize));
+    }
+    
+    // Read exactly size bytes, resuming after short reads.
+    // Return false if the peer closed the connection before the first byte.
+    static bool recvAll(int socket, void * buffer, size_t size)
     {
-        //format => [ Number of frames ], [ <size of frame 1> <data> ], ... [ <size of frame N> <data> ]
+        size_t received = 0;
+        
+        while(received < size)
+        {
+            ssize_t ret = read(socket, static_cast<char *>(buffer) + received, size - received);
+            
+            if(ret > 0)
+            {
+                received += ret;
+            }
+            else if((ret == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            else if((received == 0) && ((ret == 0) || (errno == ECONNRESET)))
+            {
+                return false;
+            }
+            else
+            {
+                throw std::runtime_error("Read error: connection interrupted in the middle of a message");
+            }
+        }
+        
+        return true;
+    }
 
+    Payload recvFrames(int socket)
+    {
         //get the number of frames
         uint32_t numberOfFrame = 0;
 
-        
-        if(read(socket, &numberOfFrame, sizeof(uint32_t)) != sizeof(uint32_t))
+        if(!recvAll(socket, &numberOfFrame, sizeof(uint32_t)))
         {
-            throw std::runtime_error("Error while reading number of frame");
+            throw ConnectionClosedError("Connection closed by peer");
         }
-        
 
         //Get frames
         Payload frames;
+        frames.reserve(std::min<size_t>(numberOfFrame, maxReservedFrames));
+        
+        std::vector<char> buffer;
 
         for( uint32_t index = 0; index < numberOfFrame; index++)
         {
             //get the size of the frame
             uint32_t frameSize = 0;
             
-            
-            if(read(socket, &frameSize, sizeof(uint32_t)) != sizeof(uint32_t))
+            if(!recvAll(socket, &frameSize, sizeof(uint32_t)))
             {
                 throw std::runtime_error("Error while reading size of frame");
             }
             
-
             if(frameSize == 0)
             {
                 throw std::runtime_error("Read error: Empty frame");
             }
+            
+            if(frameSize & sharedFrameFlag)
+            {
+                throw std::runtime_error("Read error: shared frame without reader");
+            }
 
             //get the payload of the frame
-            std::vector<char> buffer;
-            buffer.reserve(frameSize+1);
-            buffer[frameSize] = 0;
+            buffer.resize(frameSize);
 
-            if(read(socket, &buffer[0], frameSize) != frameSize)
+            if(!recvAll(socket, buffer.data(), frameSize))
             {
                 throw std::runtime_error("Read error while getting payload of frame");
             }
             
-            std::string str(&buffer[0]);
-            
-            frames.push_back(str);
+            frames.push_back(decodeFrame(buffer.data(), frameSize));
         }
         
         return frames;
     }
     
-    void sendFrames(int socket, const Payload & payload)
+    void recvFrames(int socket, SocketPayload & frames)
     {
-        //Send number of frame
-        uint32_t numberOfFrame = payload.size();
-        
-        if ( write(socket, &numberOfFrame, sizeof(uint32_t)) != sizeof(uint32_t) )
+        uint32_t numberOfFrame = 0;
+
+        if(!recvAll(socket, &numberOfFrame, sizeof(uint32_t)))
         {
-            throw std::runtime_error("Error while writing number of frame");
+            throw ConnectionClosedError("Connection closed by peer");
         }
         
-        for(const std::string & frame : payload)
+        frames.clear();
+        frames.reserve(std::min<size_t>(numberOfFrame, maxReservedFrames));
+        
+        for( uint32_t index = 0; index < numberOfFrame; index++)
         {
-            uint32_t frameSize = frame.length() + 1;
+            uint32_t frameSize = 0;
+            
+            if(!recvAll(socket, &frameSize, sizeof(uint32_t)))
+            {
+                throw std::runtime_error("Error while reading size of frame");
+            }
+            
+            if(frameSize == 0)
+            {
+                throw std::runtime_error("Read error: Empty frame");
+            }
             
-            if ( write(socket, &frameSize, sizeof(uint32_t)) != sizeof(uint32_t) )
+            if(frameSize & sharedFrameFlag)
             {
-                throw std::runtime_error("Error while writing size of frame");
+                throw std::runtime_error("Read error: shared frame without reader");
             }
             
-            if ( write(socket, frame.data(), frameSize) != frameSize )
+            //read the frame in the buffer it keeps
+            std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(frameSize);
+
+            if(!recvAll(socket, buffer->data(), frameSize))
             {
-                throw std::runtime_error("Error while writing payload");
-            }    
+                throw std::runtime_error("Read error while getting payload of frame");
+            }
+            
+            frames.push_back(SocketFrame(buffer, buffer->data(), stripTerminator(buffer->data(), frameSize)));
+        }
+    }
+    
+    static const size_t minReaderBufferSize = 4096;
+    
+    // Smallest size of a frame in the stream: a V1 frame has a size and a
+    // terminator, a V2 frame may be an empty one with its length only
+    static size_t minFrameBytes(SocketFraming framing)
+    {
+        return (framing == SocketFraming::V1) ? sizeof(uint32_t) + 1 : 1;
+    }
+    
+    SocketFrameReader::SocketFrameReader(int socket)
+    :   m_socket(socket), m_buffer(std::make_shared<std::vector<char>>())
+    {
+    }
+    
+    SocketFrameReader::~SocketFrameReader()
+    {
+        closeDescriptors(m_descriptors);
+    }
+    
+    Payload SocketFrameReader::recvFrames()
+    {
+        waitMessage();
+        
+        Payload frames;
+        
+        decodeMessage([&frames](const char * data, size_t size, const std::shared_ptr<const void> &)
+        {
+            frames.push_back(std::string(data, size));
+        });
+        
+        return frames;
+    }
+    
+    void SocketFrameReader::recvFrames(SocketPayload & frames)
+    {
+        waitMessage();
+        
+        frames.clear();
+        
+        decodeMessage([&frames](const char * data, size_t size, const std::shared_ptr<const void> & owner)
+        {
+            frames.push_back(SocketFrame(owner, data, size));
+        });
+    }
+    
+    bool SocketFrameReader::hasMessage()
+    {
+        return missingBytes() == 0;
+    }
+    
+    bool SocketFrameReader::receive()
+    {
+        size_t missing = missingBytes();
+        
+        //drain the socket until it would block, or the message is whole
+        while((missing > 0) && fill(missing, false))
+        {
+            missing = missingBytes();
         }
+        
+        return missing == 0;
+    }
+    
+    void SocketFrameReader::waitMessage()
+    {
+        for(size_t missing = missingBytes(); missing > 0; missing = missingBytes())
+        {
+            fill(missing, true);
+        }
+    }
+    
+    size_t SocketFrameReader::missingBytes()
+    {
+        const char * data = m_buffer->data() + m_begin;
+        size_t available = m_end - m_begin;
+        
+        for(;;)
+        {
+            switch(m_state)
+            {
+                case ParseState::PREAMBLE:
+                    if(available < framingPreamble.size())
+                    {
+                        return framingPreamble.size() - available;
+                    }
+                    
+                    //the preamble is not part of a message
+                    if(memcmp(data, framingPreamble.data(), framingPreamble.size()) == 0)
+                    {
+                        m_framing = SocketFraming::V2;
+                        m_begin += framingPreamble.size();
+                        data += framingPreamble.size();
+                        available -= framingPreamble.size();
+                    }
+                    
+                    m_state = ParseState::HEADER;
+                    break;
+                    
+                case ParseState::HEADER:
+                    if(m_framing == SocketFraming::V2)
+                    {
+                        //varints are parsed again until they are whole
+                        uint64_t requestId;
+                        
+                        if(!decodeHeader(data, available, m_parsed, requestId, m_framesLeft))
+                        {
+                            return 1;
+                        }
+                    }
+                    else
+                    {
+                        if(available < m_parsed + sizeof(uint32_t))
+                        {
+                            return m_parsed + sizeof(uint32_t) - available;
+                        }
+                        
+                        memcpy(&m_framesLeft, data + m_parsed, sizeof(uint32_t));
+                        m_parsed += sizeof(uint32_t);
+                    }
+                    
+                    //each frame takes a few bytes at least: reject a count which can't fit
+                    if((m_maxBufferSize > 0) && (uint64_t(m_framesLeft) * minFrameBytes(m_framing) > m_maxBufferSize))
+                    {
+                        throw BufferLimitError("Read error: " + std::to_string(m_framesLeft) + " frames can't fit in "
+                                               + std::to_string(m_maxBufferSize) + " bytes");
+                    }
+                    
+                    m_state = (m_framesLeft > 0) ? ParseState::FRAME_SIZE : ParseState::COMPLETE;
+                    break;
+                    
+                case ParseState::FRAME_SIZE:
+                {
+                    FrameHeader frame;
+                    
+                    if(!decodeFrameHeader(m_framing, m_compression, m_sharedFrames, data, available, m_parsed, frame))
+                    {
+                        //a V1 size is 4 bytes, a varint comes byte after byte
+                        return (m_framing == SocketFraming::V1) ? m_parsed + sizeof(uint32_t) - available : 1;
+                    }
+                    
+                    m_frameSize = frame.length;
+                    
+                    //a shared frame has no content in the stream
+                    if(frame.shared)
+                    {
+                        m_framesLeft--;
+                        m_state = (m_framesLeft > 0) ? ParseState::FRAME_SIZE : ParseState::COMPLETE;
+                    }
+                    else
+                    {
+                        m_state = ParseState::FRAME_BODY;
+                    }
+                    break;
+                }
+                    
+                case ParseState::FRAME_BODY:
+                    if(available < m_parsed + m_frameSize)
+                    {
+                        return m_parsed + m_frameSize - available;
+                    }
+                    
+                    m_parsed += m_frameSize;
+                    m_framesLeft--;
+                    m_state = (m_framesLeft > 0) ? ParseState::FRAME_SIZE : ParseState::COMPLETE;
+                    break;
+                    
+                case ParseState::COMPLETE:
+                    return 0;
+            }
+        }
+    }
+    
+    template <typename Visitor>
+    void SocketFrameReader::decodeMessage(Visitor visit)
+    {
+        const char * data = m_buffer->data() + m_begin;
+        std::shared_ptr<const void> owner = m_buffer;
+        bool compact = (m_framing == SocketFraming::V2);
+        
+        uint32_t numberOfFrame;
+        size_t offset = 0;
+        
+        //the shared frames count in the size of the message, with the bytes of the stream
+        uint64_t messageBytes = m_parsed;
+        
+        if(compact)
+        {
+            decodeHeader(data, m_parsed, offset, m_requestId, numberOfFrame);
+        }
+        else
+        {
+            memcpy(&numberOfFrame, data, sizeof(uint32_t));
+            offset = sizeof(uint32_t);
+            m_requestId = 0;
+        }
+        
+        for(uint32_t index = 0; index < numberOfFrame; index++)
+        {
+            FrameHeader frame;
+            decodeFrameHeader(m_framing, m_compression, m_sharedFrames, data, m_parsed, offset, frame);
+            
+            uint32_t frameSize = frame.length;
+            
+            if(frame.shared)
+            {
+                //the descriptors arrive with, or before, the bytes of their message
+                if(m_descriptors.empty())
+                {
+                    throw std::runtime_error("Read error: shared frame without descriptor");
+                }
+                
+                int fd = m_descriptors.front();
+                m_descriptors.erase(m_descriptors.begin());
+                
+                size_t maxSize = 0;
+                
+                if(m_maxBufferSize > 0)
+                {
+                    if(messageBytes >= m_maxBufferSize)
+                    {
+                        close(fd);
+                        throw BufferLimitError("Read error: message larger than " + std::to_string(m_maxBufferSize) + " bytes");
+                    }
+                    
+                    maxSize = m_maxBufferSize - messageBytes;
+                }
+                
+                const char * frameData = NULL;
+                size_t size = 0;
+                std::shared_ptr<const void> mapping = mapSharedFrame(fd, maxSize, frameData, size);
+                messageBytes += size;
+                
+                visit(frameData, size, mapping);
+                continue;
+            }
+            
+            if(frame.compressed)
+            {
+                std::shared_ptr<std::vector<char>> content = decompressFrame(data + offset, frameSize, m_maxBufferSize);
+                
+                visit(content->data(), content->size(), content);
+                offset += frameSize;
+                continue;
+            }
+            
+            if(compact)
+            {
+                //frames have no terminator, and may be empty
+                visit(data + offset, frameSize, owner);
+                offset += frameSize;
+                continue;
+            }
+            
+            if(frameSize == 0)
+            {
+                throw std::runtime_error("Read error: Empty frame");
+            }
+            
+            visit(data + offset, stripTerminator(data + offset, frameSize), owner);
+            offset += frameSize;
+        }
+        
+        m_begin += offset;
+        
+        m_state = ParseState::HEADER;
+        m_parsed = 0;
+        
+        if(m_begin == m_end)
+        {
+            m_begin = m_end = 0;
+        }
+    }
+    
+    void SocketFrameReader::receiveDescriptors(struct msghdr & message)
+    {
+        for(struct cmsghdr * header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+        {
+            if((header->cmsg_level == SOL_SOCKET) && (header->cmsg_type == SCM_RIGHTS))
+            {
+                size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const unsigned char * data = CMSG_DATA(header);
+                
+                for(size_t index = 0; index < count; index++)
+                {
+                    int fd;
+                    memcpy(&fd, data + index * sizeof(int), sizeof(int));
+                    m_descriptors.push_back(fd);
+                }
+            }
+        }
+        
+        //don't let a peer pile up descriptors: a read may end a message and
+        //start the next one, each one bringing its own
+        if(!m_sharedFrames && !m_descriptors.empty())
+        {
+            closeDescriptors(m_descriptors);
+            throw std::runtime_error("Read error: shared frames not accepted");
+        }
+        
+        if((message.msg_flags & MSG_CTRUNC) || (m_descriptors.size() > 2 * maxSharedFrames))
+        {
+            closeDescriptors(m_descriptors);
+            throw std::runtime_error("Read error: too many descriptors received");
+        }
+    }
+    
+    bool SocketFrameReader::fill(size_t missing, bool blocking)
+    {
+        size_t pending = m_end - m_begin;
+        
+        if((m_maxBufferSize > 0) && (pending + missing > m_maxBufferSize))
+        {
+            throw BufferLimitError("Read error: message larger than " + std::to_string(m_maxBufferSize) + " bytes");
+        }
+        
+        //grow the buffer geometrically, within the limit
+        size_t growth = std::max(m_buffer->size() * 2, minReaderBufferSize);
+        
+        if(m_maxBufferSize > 0)
+        {
+            growth = std::min(growth, m_maxBufferSize);
+        }
+        
+        if(m_buffer.use_count() > 1)
+        {
+            //frames still view the buffer: continue in a new one
+            std::shared_ptr<std::vector<char>> buffer = std::make_shared<std::vector<char>>(
+                std::max(pending + missing, std::min(growth, minReaderBufferSize)));
+            
+            memcpy(buffer->data(), m_buffer->data() + m_begin, pending);
+            m_buffer = buffer;
+        }
+        else
+        {
+            //move the pending bytes to the front and make room for what is missing
+            if(m_begin > 0)
+            {
+                memmove(m_buffer->data(), m_buffer->data() + m_begin, pending);
+            }
+            
+            if(m_buffer->size() < pending + missing)
+            {
+                m_buffer->resize(std::max(pending + missing, growth));
+            }
+        }
+        
+        m_begin = 0;
+        m_end = pending;
+        
+        for(;;)
+        {
+            //read as much as available, not only what is missing, with the descriptors of shared frames
+            struct iovec iov;
+            iov.iov_base = m_buffer->data() + m_end;
+            iov.iov_len = m_buffer->size() - m_end;
+            
+            union
+            {
+                char buffer[CMSG_SPACE(sizeof(int) * maxSharedFrames)];
+                struct cmsghdr align;
+            } control;
+            
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control.buffer;
+            message.msg_controllen = sizeof(control.buffer);
+            
+            //with a deadline, block in poll() rather than in the read
+            bool wait = blocking && (m_deadline == noDeadline);
+            ssize_t ret = recvmsg(m_socket, &message, MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+            
+            if(ret > 0)
+            {
+                m_end += ret;
+                m_bytesReceived += ret;
+                
+                receiveDescriptors(message);
+                return true;
+            }
+            
+            if((ret == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            
+            if((ret == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            {
+                if(!blocking)
+                {
+                    return false;
+                }
+                
+                waitSocket(m_socket, POLLIN, m_deadline);
+                continue;
+            }
+            
+            if((m_end == 0) && ((ret == 0) || (errno == ECONNRESET)))
+            {
+                throw ConnectionClosedError("Connection closed by peer");
+            }
+            
+            throw std::runtime_error("Read error: connection interrupted in the middle of a message");
+        }
+    }
+    
+    int connectToServer(const std::string & path, SocketDeadline deadline)
+    {
+        struct sockaddr_un addr;
+        int ret;
+
+        /* Create local socket. */
+        int data_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (data_socket == -1)
+        {
+            throw std::runtime_error("Impossible to create the socket "+path+": " + std::string(strerror(errno)));
+        }
+
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+
+        /* Connect socket to socket address */
+
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        if((deadline != noDeadline) && (fcntl(data_socket, F_SETFL, O_NONBLOCK) == -1))
+        {
+            std::string error(strerror(errno));
+            close(data_socket);
+            throw std::runtime_error("Impossible to configure the socket "+path+": " + error);
+        }
+        
+        for(;;)
+        {
+            ret = connect (data_socket, (const struct sockaddr *) &addr, sizeof(struct sockaddr_un));
+            
+            if((ret == -1) && (deadline != noDeadline) && (errno == EAGAIN))
+            {
+                //the backlog of the server is full, and can't be polled: try again shortly
+                try
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(std::min(remainingTime(deadline), 1)));
+                }
+                catch(std::exception &)
+                {
+                    close(data_socket);
+                    throw;
+                }
+                
+                continue;
+            }
+            
+            if((ret == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            
+            break;
+        }
+        
+        //the next calls choose to block or not
+        if((ret == 0) && (deadline != noDeadline) && (fcntl(data_socket, F_SETFL, 0) == -1))
+        {
+            ret = -1;
+        }
+        
+        if (ret == -1)
+        {
+            std::string error(strerror(errno));
+            close(data_socket);
+            throw std::runtime_error("Impossible to connect to server using the socket "+path+": " + error);
+        }
+        
+        return data_socket;
+    }
+    
+    // Write the buffers until done or, with MSG_DONTWAIT in flags, until the
+    // socket would block. iov and count are updated to what is left.
+    // The descriptors are sent with the first bytes written.
+    static size_t writeBuffers(int socket, struct iovec * & iov, size_t & count, int flags,
+                               const std::vector<int> & descriptors = std::vector<int>(),
+                               SocketDeadline deadline = noDeadline)
+    {
+        //with a deadline, block in poll() rather than in the write
+        int sendFlags = (deadline == noDeadline) ? flags : (flags | MSG_DONTWAIT);
+        
+        bool started = false;
+        size_t total = 0;
+        
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(int) * maxSharedFrames)];
+            struct cmsghdr align;
+        } control;
+        
+        //the peer takes one message of descriptors at most with each message
+        if(descriptors.size() > maxSharedFrames)
+        {
+            throw std::runtime_error("Error while writing frames: more than " + std::to_string(maxSharedFrames) + " shared frames");
+        }
+        
+        while(count > 0)
+        {
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = iov;
+            message.msg_iovlen = std::min(count, (size_t) IOV_MAX);
+            
+            if(!started && !descriptors.empty())
+            {
+                memset(&control, 0, sizeof(control));
+                message.msg_control = control.buffer;
+                message.msg_controllen = CMSG_SPACE(sizeof(int) * descriptors.size());
+                
+                struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(sizeof(int) * descriptors.size());
+                memcpy(CMSG_DATA(header), descriptors.data(), sizeof(int) * descriptors.size());
+            }
+            
+            //use MSG_NOSIGNAL: a peer which left must not raise SIGPIPE
+            ssize_t ret = sendmsg(socket, &message, sendFlags | MSG_NOSIGNAL);
+            
+            if(ret == -1)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                
+                if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                {
+                    if(flags & MSG_DONTWAIT)
+                    {
+                        break;
+                    }
+                    
+                    waitSocket(socket, POLLOUT, deadline);
+                    continue;
+                }
+                
+                if(!started && ((errno == EPIPE) || (errno == ECONNRESET)))
+                {
+                    throw ConnectionClosedError("Connection closed by peer");
+                }
+                
+                throw std::runtime_error("Error while writing frames: " + std::string(strerror(errno)));
+            }
+            
+            started = true;
+            total += ret;
+            
+            //skip what was written, the last buffer may be partially sent
+            size_t written = ret;
+            
+            while((count > 0) && (written >= iov->iov_len))
+            {
+                written -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            
+            if(count > 0)
+            {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        
+        return total;
+    }
+    
+    size_t sendBuffers(int socket, struct iovec * iov, size_t count, const std::vector<int> & descriptors,
+                       SocketDeadline deadline)
+    {
+        return writeBuffers(socket, iov, count, 0, descriptors, deadline);
+    }
+    
+    // Buffers of a message: [ Number of frames ], [ <size of frame 1> <data> ], ...
+    // Inline frames are not copied, they must outlive the buffers.
+    // The scratch vectors are taken from the arena of the thread, released
+    // with the buffers.
+    struct PayloadBuffers
+    {
+        // Payload or SocketArenaPayload, frames with a terminating NUL
+        template <typename StringPayload>
+        PayloadBuffers(const StringPayload & payload, const MessageFormat & format)
+        :   scope(SocketArena::threadArena()), numberOfFrame(payload.size()),
+            frameSizes((format.framing == SocketFraming::V2) ? 0 : payload.size(), 0, arenaAllocator()),
+            iov(arenaAllocator()), compact(format.framing == SocketFraming::V2), varints(arenaAllocator())
+        {
+            addHeader(format);
+            
+            for(size_t index = 0; index < payload.size(); index++)
+            {
+                //frames are sent with their terminating NUL
+                addFrame(index, payload[index].c_str(), payload[index].length(), true, format);
+            }
+        }
+        
+        PayloadBuffers(const SocketPayload & payload, const MessageFormat & format)
+        :   scope(SocketArena::threadArena()), numberOfFrame(payload.size()),
+            frameSizes((format.framing == SocketFraming::V2) ? 0 : payload.size(), 0, arenaAllocator()),
+            iov(arenaAllocator()), compact(format.framing == SocketFraming::V2), varints(arenaAllocator())
+        {
+            addHeader(format);
+            
+            for(size_t index = 0; index < payload.size(); index++)
+            {
+                //the terminating NUL is sent from its own buffer, frames don't have one
+                addFrame(index, payload[index].data(), payload[index].size(), false, format);
+            }
+        }
+        
+        ~PayloadBuffers()
+        {
+            closeDescriptors(descriptors);
+        }
+        
+        PayloadBuffers(const PayloadBuffers &) = delete;
+        PayloadBuffers & operator=(const PayloadBuffers &) = delete;
+        
+        static SocketArenaAllocator<char> arenaAllocator()
+        {
+            return SocketArenaAllocator<char>(SocketArena::threadArena());
+        }
+        
+        void addBuffer(const void * data, size_t size)
+        {
+            struct iovec buffer;
+            buffer.iov_base = const_cast<void *>(data);
+            buffer.iov_len = size;
+            iov.push_back(buffer);
+        }
+        
+        // Append a V2 number to the iovec, merged with the previous one when it's a number too
+        void addVarint(uint64_t value)
+        {
+            char * start = &varints[varintsSize];
+            size_t size = encodeVarint(value, start);
+            varintsSize += size;
+            
+            if(!iov.empty() && (static_cast<char *>(iov.back().iov_base) + iov.back().iov_len == start))
+            {
+                iov.back().iov_len += size;
+            }
+            else
+            {
+                addBuffer(start, size);
+            }
+        }
+        
+        void addHeader(const MessageFormat & format)
+        {
+            iov.reserve(1 + 3 * numberOfFrame);
+            
+            if(!compact)
+            {
+                addBuffer(&numberOfFrame, sizeof(uint32_t));
+                return;
+            }
+            
+            //flags, request id and number of frames, then a size of up to 5 bytes per frame.
+            //Sized once: the iovec points in it.
+            varints.resize(1 + 2 * maxVarintSize + 5 * numberOfFrame);
+            
+            varints[0] = static_cast<char>((format.requestId != 0) ? requestIdFlag : 0);
+            varintsSize = 1;
+            addBuffer(varints.data(), 1);
+            
+            if(format.requestId != 0)
+            {
+                addVarint(format.requestId);
+            }
+            
+            addVarint(numberOfFrame);
+        }
+        
+        // Compress a frame in a buffer of its own, return false if it doesn't shrink
+        bool addCompressed(const char * data, size_t size)
+        {
+#ifdef FTY_COMMON_SOCKET_HAVE_LZ4
+            if(size > LZ4_MAX_INPUT_SIZE)
+            {
+                return false;
+            }
+            
+            //[ original size ] [ LZ4 block ]
+            std::vector<char> content(maxVarintSize + LZ4_compressBound(static_cast<int>(size)));
+            size_t header = encodeVarint(size, content.data());
+            
+            int compressed = LZ4_compress_default(data, content.data() + header, static_cast<int>(size),
+                                                  static_cast<int>(content.size() - header));
+            
+            if((compressed <= 0) || (header + compressed >= size))
+            {
+                return false;
+            }
+            
+            content.resize(header + compressed);
+            compressedFrames.push_back(std::move(content));
+            return true;
+#else
+            (void) data;
+            (void) size;
+            return false;
+#endif
+        }
+        
+        void addFrame(size_t index, const char * data, size_t size, bool terminated, const MessageFormat & format)
+        {
+            if((format.sharedFrameSize > 0) && (size >= format.sharedFrameSize) && (descriptors.size() < maxSharedFrames))
+            {
+                descriptors.push_back(createSharedFrame(data, size));
+                
+                if(compact)
+                {
+                    addVarint(1);
+                    return;
+                }
+                
+                frameSizes[index] = sharedFrameFlag;
+                addBuffer(&frameSizes[index], sizeof(uint32_t));
+                return;
+            }
+            
+            bool compression = (format.compressionThreshold > 0);
+            
+            if(compression && (size >= format.compressionThreshold) && addCompressed(data, size))
+            {
+                const std::vector<char> & content = compressedFrames.back();
+                
+                if(compact)
+                {
+                    addVarint((static_cast<uint64_t>(content.size()) << 2) | 2);
+                }
+                else
+                {
+                    frameSizes[index] = static_cast<uint32_t>(content.size()) | compressedFrameFlag;
+                    addBuffer(&frameSizes[index], sizeof(uint32_t));
+                }
+                
+                addBuffer(content.data(), content.size());
+                return;
+            }
+            
+            if(compact)
+            {
+                //no terminator, the size is enough
+                if(size >= sharedFrameFlag)
+                {
+                    throw std::runtime_error("Frame too large");
+                }
+                
+                addVarint(static_cast<uint64_t>(size) << 2);
+                
+                if(size > 0)
+                {
+                    addBuffer(data, size);
+                }
+                return;
+            }
+            
+            //the size of an inline frame must not look compressed
+            if(compression && (size + 1 >= compressedFrameFlag))
+            {
+                throw std::runtime_error("Frame too large");
+            }
+            
+            frameSizes[index] = size + 1;
+            addBuffer(&frameSizes[index], sizeof(uint32_t));
+            
+            if(terminated)
+            {
+                addBuffer(data, size + 1);
+            }
+            else
+            {
+                addBuffer(data, size);
+                addBuffer(&frameTerminator, 1);
+            }
+        }
+        
+        //first, so the arena is rewound once the vectors are gone
+        SocketArena::Scope scope;
+        
+        uint32_t numberOfFrame;
+        std::vector<uint32_t, SocketArenaAllocator<uint32_t>> frameSizes;
+        std::vector<struct iovec, SocketArenaAllocator<struct iovec>> iov;
+        std::vector<int> descriptors;
+        std::vector<std::vector<char>> compressedFrames;
+        
+        //V2 numbers
+        bool compact;
+        std::vector<char, SocketArenaAllocator<char>> varints;
+        size_t varintsSize = 0;
+    };
+    
+    size_t sendFrames(int socket, const Payload & payload, size_t sharedFrameSize, SocketDeadline deadline)
+    {
+        MessageFormat format;
+        format.sharedFrameSize = sharedFrameSize;
+        
+        return sendFrames(socket, payload, format, deadline);
+    }
+    
+    size_t sendFrames(int socket, const SocketPayload & payload, size_t sharedFrameSize, SocketDeadline deadline)
+    {
+        MessageFormat format;
+        format.sharedFrameSize = sharedFrameSize;
+        
+        return sendFrames(socket, payload, format, deadline);
+    }
+    
+    size_t sendFrames(int socket, const Payload & payload, const MessageFormat & format, SocketDeadline deadline)
+    {
+        //Gather the whole message in one call
+        PayloadBuffers buffers(payload, format);
+        
+        return sendBuffers(socket, buffers.iov.data(), buffers.iov.size(), buffers.descriptors, deadline);
+    }
+    
+    size_t sendFrames(int socket, const SocketPayload & payload, const MessageFormat & format, SocketDeadline deadline)
+    {
+        PayloadBuffers buffers(payload, format);
+        
+        return sendBuffers(socket, buffers.iov.data(), buffers.iov.size(), buffers.descriptors, deadline);
+    }
+    
+    std::string encodeMessage(const Payload & payload, SocketFraming framing)
+    {
+        MessageFormat format;
+        format.framing = framing;
+        
+        PayloadBuffers buffers(payload, format);
+        
+        size_t size = 0;
+        
+        for(const struct iovec & buffer : buffers.iov)
+        {
+            size += buffer.iov_len;
+        }
+        
+        std::string encoded;
+        encoded.reserve(size);
+        
+        for(const struct iovec & buffer : buffers.iov)
+        {
+            encoded.append(static_cast<const char *>(buffer.iov_base), buffer.iov_len);
+        }
+        
+        //without the flags of V2, written with the request id
+        if(framing == SocketFraming::V2)
+        {
+            encoded.erase(0, 1);
+        }
+        
+        return encoded;
+    }
+    
+    SocketFrameWriter::SocketFrameWriter(int socket)
+    :   m_socket(socket)
+    {
+    }
+    
+    SocketFrameWriter::~SocketFrameWriter()
+    {
+        for(PendingDescriptors & pending : m_pendingDescriptors)
+        {
+            closeDescriptors(pending.descriptors);
+        }
+    }
+    
+    size_t SocketFrameWriter::sendFrames(const Payload & payload, uint64_t requestId)
+    {
+        MessageFormat format;
+        format.framing = m_framing;
+        format.sharedFrameSize = m_sharedFrameSize;
+        format.compressionThreshold = m_compressionThreshold;
+        format.requestId = requestId;
+        
+        PayloadBuffers buffers(payload, format);
+        return queueBuffers(buffers.iov.data(), buffers.iov.size(), buffers.descriptors);
+    }
+    
+    size_t SocketFrameWriter::sendFrames(const SocketPayload & payload, uint64_t requestId)
+    {
+        MessageFormat format;
+        format.framing = m_framing;
+        format.sharedFrameSize = m_sharedFrameSize;
+        format.compressionThreshold = m_compressionThreshold;
+        format.requestId = requestId;
+        
+        PayloadBuffers buffers(payload, format);
+        return queueBuffers(buffers.iov.data(), buffers.iov.size(), buffers.descriptors);
+    }
+    
+    size_t SocketFrameWriter::sendFrames(const SocketArenaPayload & payload, uint64_t requestId)
+    {
+        MessageFormat format;
+        format.framing = m_framing;
+        format.sharedFrameSize = m_sharedFrameSize;
+        format.compressionThreshold = m_compressionThreshold;
+        format.requestId = requestId;
+        
+        PayloadBuffers buffers(payload, format);
+        return queueBuffers(buffers.iov.data(), buffers.iov.size(), buffers.descriptors);
+    }
+    
+    size_t SocketFrameWriter::sendFrames(const SocketEncodedMessage & message, uint64_t requestId)
+    {
+        const std::string & encoded = message.encoded(m_framing);
+        std::vector<int> descriptors;
+        
+        //[ flags ] [ request id ] in V2, the rest is encoded
+        char header[1 + maxVarintSize];
+        size_t headerSize = 0;
+        
+        if(m_framing == SocketFraming::V2)
+        {
+            header[0] = static_cast<char>((requestId != 0) ? requestIdFlag : 0);
+            headerSize = 1;
+            
+            if(requestId != 0)
+            {
+                headerSize += encodeVarint(requestId, header + 1);
+            }
+        }
+        
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = headerSize;
+        iov[1].iov_base = const_cast<char *>(encoded.data());
+        iov[1].iov_len = encoded.size();
+        
+        return (headerSize > 0) ? queueBuffers(iov, 2, descriptors) : queueBuffers(iov + 1, 1, descriptors);
+    }
+    
+    size_t SocketFrameWriter::queueBuffers(struct iovec * iov, size_t count, std::vector<int> & descriptors)
+    {
+        size_t written = 0;
+        
+        //the descriptors of a corked message would wait behind the bytes queued before it
+        if(m_corked && !descriptors.empty())
+        {
+            flush();
+        }
+        
+        //queue behind the pending bytes, the message is written straight otherwise
+        if(!hasPending() && (!m_corked || !descriptors.empty()))
+        {
+            written = writeBuffers(m_socket, iov, count, MSG_DONTWAIT, descriptors);
+            m_bytesSent += written;
+        }
+        
+        //descriptors not sent yet go with the first byte of their message
+        if((written == 0) && !descriptors.empty())
+        {
+            m_pendingDescriptors.push_back(PendingDescriptors{m_pending.size(), std::move(descriptors)});
+            descriptors.clear();
+        }
+        
+        for(size_t index = 0; index < count; index++)
+        {
+            const char * data = static_cast<const char *>(iov[index].iov_base);
+            m_pending.insert(m_pending.end(), data, data + iov[index].iov_len);
+        }
+        
+        return written;
+    }
+    
+    size_t SocketFrameWriter::flush()
+    {
+        if(!hasPending())
+        {
+            return 0;
+        }
+        
+        static const std::vector<int> noDescriptors;
+        size_t written = 0;
+        
+        //one write by message with descriptors, so each message gets its own
+        while(hasPending())
+        {
+            const std::vector<int> * descriptors = &noDescriptors;
+            size_t end = m_pending.size();
+            
+            if(!m_pendingDescriptors.empty())
+            {
+                if(m_pendingDescriptors.front().offset == m_begin)
+                {
+                    descriptors = &m_pendingDescriptors.front().descriptors;
+                    
+                    if(m_pendingDescriptors.size() > 1)
+                    {
+                        end = m_pendingDescriptors[1].offset;
+                    }
+                }
+                else
+                {
+                    end = m_pendingDescriptors.front().offset;
+                }
+            }
+            
+            struct iovec buffer;
+            buffer.iov_base = m_pending.data() + m_begin;
+            buffer.iov_len = end - m_begin;
+            
+            struct iovec * iov = &buffer;
+            size_t count = 1;
+            
+            size_t bufferWritten = writeBuffers(m_socket, iov, count, MSG_DONTWAIT, *descriptors);
+            m_begin += bufferWritten;
+            m_bytesSent += bufferWritten;
+            written += bufferWritten;
+            
+            if((bufferWritten > 0) && !descriptors->empty())
+            {
+                closeDescriptors(m_pendingDescriptors.front().descriptors);
+                m_pendingDescriptors.pop_front();
+            }
+            
+            //the socket is full
+            if(m_begin < end)
+            {
+                break;
+            }
+        }
+        
+        if(m_begin == m_pending.size())
+        {
+            m_pending.clear();
+            m_begin = 0;
+        }
+        
+        return written;
+    }
+    
+    size_t SocketFrameWriter::uncork()
+    {
+        m_corked = false;
+        
+        return flush();
+    }
+    
+    size_t SocketFrameWriter::waitFlushed(SocketDeadline deadline)
+    {
+        size_t written = flush();
+        
+        while(hasPending())
+        {
+            waitSocket(m_socket, POLLOUT, deadline);
+            written += flush();
+        }
+        
+        return written;
     }
     
 } //namespace fty
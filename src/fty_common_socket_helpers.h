@@ -22,16 +22,333 @@
 #ifndef FTY_COMMON_SOCKET_HELPERS_H_INCLUDED
 #define FTY_COMMON_SOCKET_HELPERS_H_INCLUDED
 
+#include "fty_common_socket_arena.h"
+#include "fty_common_socket_encoded_message.h"
+#include "fty_common_socket_frame.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <string>
 #include <vector>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 namespace fty
 {
     using Payload = std::vector<std::string>;
+    
+    // Time after which a blocking call gives up with SocketTimeoutError.
+    // The socket stays in blocking mode, calls with a deadline poll it.
+    using SocketDeadline = std::chrono::steady_clock::time_point;
+    const SocketDeadline noDeadline = SocketDeadline::max();
+    
+    // Raised when the peer closed the connection before a message started.
+    class ConnectionClosedError : public std::runtime_error
+    {
+    public:
+        explicit ConnectionClosedError(const std::string & what)
+        :   std::runtime_error(what)
+        {}
+    };
+    
+    // Raised when a message doesn't fit in the buffer limit of a reader.
+    class BufferLimitError : public std::runtime_error
+    {
+    public:
+        explicit BufferLimitError(const std::string & what)
+        :   std::runtime_error(what)
+        {}
+    };
         
+    // Frames of at least sharedFrameSize bytes can be passed in a sealed
+    // memfd, sent along with the message, instead of being copied through
+    // the socket. The size of such a frame has sharedFrameFlag set, and its
+    // content is in the next received descriptor.
+    //
+    // A peer must accept it first: the client sends the request
+    // { capabilitiesFrame, sharedFramesCapability } and the server replies
+    // with the same payload when it accepts shared frames on this
+    // connection. An older server takes it for an application request, with
+    // an empty first frame since it stops at the NUL: it may reply anything
+    // but capabilitiesFrame, close the connection, or not reply at all.
+    static const uint32_t sharedFrameFlag = 0x80000000;
+    extern const std::string capabilitiesFrame;
+    extern const std::string sharedFramesCapability;
+    
+    // Reply of a server refusing a request because one of its limits is
+    // reached: a single frame starting with NUL.
+    extern const std::string overloadedFrame;
+    bool isOverloadedReply(const Payload & reply);
+    bool isOverloadedReply(const SocketPayload & reply);
+    
+    // A streamed request starts with the request { streamFrame }, which a
+    // server with a SocketStreamServer accepts with { streamAcceptedFrame }.
+    // Then the client sends the request as messages of frames, and the
+    // server the reply the same way, each one ended by an empty message.
+    // The server ends its reply once it read the whole request.
+    extern const std::string streamFrame;
+    extern const std::string streamAcceptedFrame;
+    
+    // Frames of at least compressionThreshold bytes can be compressed with
+    // LZ4, once the peer accepted compressionCapability the same way as
+    // the shared frames. The content of a compressed frame is its original
+    // size as a varint, then the LZ4 block, without terminator. In V1 its
+    // size has compressedFrameFlag set, so inline frames must stay below
+    // 1 GB on such connections. Frames which don't shrink are sent as is.
+    static const uint32_t compressedFrameFlag = 0x40000000;
+    extern const std::string compressionCapability;
+    
+    // False when the library is built without LZ4
+    bool isCompressionAvailable();
+    
+    // Framing V2: the client starts the connection with framingPreamble,
+    // magic and version, a server detects it on the first bytes. Then
+    // each message is
+    //     [ flags ] [ request id ] [ number of frames ] [ size 1 ] [ data 1 ] ...
+    // with the request id only if requestIdFlag is set. Numbers are LEB128
+    // varints, least significant group first. A frame size is
+    // (length << 2) | (compressed << 1) | shared, a shared frame has no
+    // data in the stream.
+    // The reply to a request with an id carries the same id.
+    extern const std::string framingPreamble;
+    static const uint8_t requestIdFlag = 0x01;
+    
+    // Format of a message to send
+    struct MessageFormat
+    {
+        SocketFraming framing = SocketFraming::V1;
+        size_t sharedFrameSize = 0;
+        size_t compressionThreshold = 0;
+        
+        // V2 only, 0 for none
+        uint64_t requestId = 0;
+    };
+    
     //functions
+    //receive functions without buffer only support inline frames
     Payload recvFrames(int socket);
-    void sendFrames(int socket, const Payload & payload);
+    //send functions return the number of bytes written
+    size_t sendFrames(int socket, const Payload & payload, size_t sharedFrameSize = 0,
+                      SocketDeadline deadline = noDeadline);
+    
+    // Binary safe variants, each received frame is read in its own buffer
+    void recvFrames(int socket, SocketPayload & frames);
+    size_t sendFrames(int socket, const SocketPayload & payload, size_t sharedFrameSize = 0,
+                      SocketDeadline deadline = noDeadline);
+    
+    // Any framing, the V2 preamble must have been sent on the connection
+    size_t sendFrames(int socket, const Payload & payload, const MessageFormat & format,
+                      SocketDeadline deadline = noDeadline);
+    size_t sendFrames(int socket, const SocketPayload & payload, const MessageFormat & format,
+                      SocketDeadline deadline = noDeadline);
+    
+    // Bytes of a SocketEncodedMessage: those following the header which
+    // carries the request id in V2, the whole message in V1. Frames are
+    // inline and not compressed.
+    std::string encodeMessage(const Payload & payload, SocketFraming framing);
+    
+    // Buffered reader of the messages of one connection.
+    // Each read pulls as much as available into one buffer, reused for the
+    // life of the connection, and the frames are built straight out of it.
+    // The pending message is parsed incrementally, so receive() can resume
+    // it across readiness events without blocking.
+    // Shared frames are mapped read only, and released with their frames.
+    class SocketFrameReader
+    {
+    public:
+        explicit SocketFrameReader(int socket);
+        
+        SocketFrameReader(SocketFrameReader &&) = default;
+        SocketFrameReader & operator=(SocketFrameReader &&) = default;
+        
+        ~SocketFrameReader();
+        
+        // Block until a whole message is received, and return it.
+        // Throw ConnectionClosedError if the peer left before a message started.
+        Payload recvFrames();
+        
+        // Same, with frames viewing the receive buffer instead of copies.
+        // The buffer is left to the frames; a new one is used for next reads.
+        void recvFrames(SocketPayload & frames);
+        
+        // True when a whole message is already buffered.
+        bool hasMessage();
+        
+        // Read what the socket has without blocking.
+        // Return true when a whole message is buffered.
+        bool receive();
+        
+        // Total of the bytes read on the connection
+        uint64_t bytesReceived() const { return m_bytesReceived; }
+        
+        // Throw BufferLimitError instead of buffering more than maxBufferSize
+        // bytes for a message. 0 for no limit.
+        void setMaxBufferSize(size_t maxBufferSize) { m_maxBufferSize = maxBufferSize; }
+        
+        // Blocking reads throw SocketTimeoutError once the deadline is passed
+        void setDeadline(SocketDeadline deadline) { m_deadline = deadline; }
+        
+        // V1 by default. With detectFraming(), V2 is used if the connection
+        // starts with the preamble, V1 otherwise.
+        void setFraming(SocketFraming framing) { m_framing = framing; }
+        void detectFraming() { m_state = ParseState::PREAMBLE; }
+        SocketFraming framing() const { return m_framing; }
+        
+        // Accept compressed frames, once negotiated
+        void setCompression(bool compression) { m_compression = compression; }
+        
+        // Accept shared frames, once negotiated. Their size counts in the
+        // limit of setMaxBufferSize().
+        void setSharedFrames(bool sharedFrames) { m_sharedFrames = sharedFrames; }
+        
+        // Id of the last message returned, 0 if it had none
+        uint64_t requestId() const { return m_requestId; }
+        
+        // True when received bytes are not handed out yet, e.g. the
+        // beginning of a message
+        bool hasBufferedBytes() const { return m_end > m_begin; }
+        
+    private:
+        enum class ParseState
+        {
+            PREAMBLE,
+            HEADER,
+            FRAME_SIZE,
+            FRAME_BODY,
+            COMPLETE
+        };
+        
+        // Parse the buffered bytes from where the last call stopped.
+        // Return the number of bytes to receive before the next message is whole.
+        size_t missingBytes();
+        void waitMessage();
+        
+        // Return false if blocking is false and nothing could be read
+        bool fill(size_t missing, bool blocking);
+        void receiveDescriptors(struct msghdr & message);
+        
+        // Call visit(data, size, owner) for each frame of the next message
+        // and consume it. The message must be whole.
+        template <typename Visitor>
+        void decodeMessage(Visitor visit);
+        
+        //attributs
+        int m_socket;
+        std::shared_ptr<std::vector<char>> m_buffer;
+        size_t m_begin = 0;
+        size_t m_end = 0;
+        uint64_t m_bytesReceived = 0;
+        size_t m_maxBufferSize = 0;
+        SocketDeadline m_deadline = noDeadline;
+        SocketFraming m_framing = SocketFraming::V1;
+        bool m_compression = false;
+        bool m_sharedFrames = false;
+        uint64_t m_requestId = 0;
+        
+        //parsing of the pending message, relative to m_begin
+        ParseState m_state = ParseState::HEADER;
+        size_t m_parsed = 0;
+        uint32_t m_framesLeft = 0;
+        uint32_t m_frameSize = 0;
+        
+        //received descriptors of the shared frames, in order
+        std::vector<int> m_descriptors;
+    };
+    
+    struct PayloadBuffers;
+    
+    // Non blocking writer of the messages of one connection.
+    // What the socket can't take is kept, and sent by flush() once the
+    // socket is writable again. Messages stay in order.
+    class SocketFrameWriter
+    {
+    public:
+        explicit SocketFrameWriter(int socket);
+        
+        SocketFrameWriter(SocketFrameWriter &&) = default;
+        SocketFrameWriter & operator=(SocketFrameWriter &&) = default;
+        
+        ~SocketFrameWriter();
+        
+        // Return the number of bytes written now.
+        // With framing V2, the message carries requestId if not 0.
+        size_t sendFrames(const Payload & payload, uint64_t requestId = 0);
+        size_t sendFrames(const SocketPayload & payload, uint64_t requestId = 0);
+        size_t sendFrames(const SocketArenaPayload & payload, uint64_t requestId = 0);
+        
+        size_t sendFrames(const SocketEncodedMessage & message, uint64_t requestId = 0);
+        
+        size_t flush();
+        
+        // Block until all the pending bytes are written, throw
+        // SocketTimeoutError at the deadline
+        size_t waitFlushed(SocketDeadline deadline = noDeadline);
+        
+        bool hasPending() const { return m_begin < m_pending.size(); }
+        size_t pendingBytes() const { return m_pending.size() - m_begin; }
+        
+        // Total of the bytes written on the connection
+        uint64_t bytesSent() const { return m_bytesSent; }
+        
+        // While corked, messages are queued without being written, and
+        // uncork() writes them together with as few system calls as the
+        // socket allows. Messages with shared frames are not held back.
+        void cork() { m_corked = true; }
+        size_t uncork();
+        bool isCorked() const { return m_corked; }
+        
+        // Once the peer accepted shared frames, see sendFrames()
+        void setSharedFrameSize(size_t sharedFrameSize) { m_sharedFrameSize = sharedFrameSize; }
+        size_t sharedFrameSize() const { return m_sharedFrameSize; }
+        
+        // Framing of the messages, V1 by default. The V2 preamble is not sent.
+        void setFraming(SocketFraming framing) { m_framing = framing; }
+        
+        // Once the peer accepted compressed frames, see sendFrames()
+        void setCompressionThreshold(size_t compressionThreshold) { m_compressionThreshold = compressionThreshold; }
+        
+    private:
+        // Write what the socket takes now, and keep the rest
+        size_t queueBuffers(struct iovec * iov, size_t count, std::vector<int> & descriptors);
+        
+        //attributs
+        int m_socket;
+        std::vector<char> m_pending;
+        size_t m_begin = 0;
+        size_t m_sharedFrameSize = 0;
+        size_t m_compressionThreshold = 0;
+        SocketFraming m_framing = SocketFraming::V1;
+        bool m_corked = false;
+        uint64_t m_bytesSent = 0;
+        
+        //descriptors of the shared frames of a pending message, sent with
+        //the first byte of the message, at offset in m_pending
+        struct PendingDescriptors
+        {
+            size_t offset;
+            std::vector<int> descriptors;
+        };
+        
+        std::deque<PendingDescriptors> m_pendingDescriptors;
+    };
+    
+    // Open a connection to the server listening on the unix socket path.
+    // A full listen backlog is retried until the deadline.
+    int connectToServer(const std::string & path, SocketDeadline deadline = noDeadline);
+    
+    // Wait until the socket is ready for some of events, and return them.
+    // Throw SocketTimeoutError once the deadline is passed.
+    short waitSocket(int socket, short events, SocketDeadline deadline = noDeadline);
+    
+    // Write all the buffers, with as few system calls as possible.
+    // The iovec array is modified to track partial writes.
+    // The descriptors, if any, are sent with the first bytes.
+    size_t sendBuffers(int socket, struct iovec * iov, size_t count,
+                       const std::vector<int> & descriptors = std::vector<int>(),
+                       SocketDeadline deadline = noDeadline);
     
 } //namespace fty
 
@@ -0,0 +1,229 @@
+/*  =========================================================================
+    fty_common_socket_metrics - Per thread counters and latency histograms of the server
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_metrics - Per thread counters and latency histograms of the server
+@discuss
+    Each block has a single writer, its thread, so updates are plain relaxed
+    loads and stores: no lock and no read-modify-write on the request path.
+@end
+*/
+
+#include "fty_common_socket_metrics.h"
+
+#include <thread>
+
+namespace fty
+{
+    static std::atomic<uint64_t> s_nextMetricsId(1);
+    
+    uint64_t SocketLatencyHistogram::percentile(double quantile) const
+    {
+        uint64_t rank = static_cast<uint64_t>(quantile * count);
+        uint64_t seen = 0;
+        
+        for(size_t index = 0; index < buckets.size(); index++)
+        {
+            seen += buckets[index];
+            
+            if((seen > rank) || (seen == count))
+            {
+                return uint64_t(1) << index;
+            }
+        }
+        
+        return 0;
+    }
+    
+    SocketMetrics::ThreadBlock::ThreadBlock()
+    :   owner(std::this_thread::get_id())
+    {
+        for(std::atomic<uint64_t> & counter : counters)
+        {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        
+        for(size_t timer = 0; timer < static_cast<size_t>(SocketTimer::COUNT); timer++)
+        {
+            totalNs[timer].store(0, std::memory_order_relaxed);
+            
+            for(std::atomic<uint64_t> & bucket : buckets[timer])
+            {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    SocketMetrics::SocketMetrics()
+    :   m_id(s_nextMetricsId++)
+    {
+    }
+    
+    SocketMetrics::ThreadBlock & SocketMetrics::localBlock()
+    {
+        //last block used by this thread, registries are told apart by their unique id
+        static thread_local uint64_t t_id = 0;
+        static thread_local ThreadBlock * t_block = nullptr;
+        
+        if(t_id != m_id)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::thread::id self = std::this_thread::get_id();
+            
+            t_id = m_id;
+            t_block = nullptr;
+            
+            for(const std::unique_ptr<ThreadBlock> & block : m_blocks)
+            {
+                if(block->owner == self)
+                {
+                    t_block = block.get();
+                }
+            }
+            
+            if(t_block == nullptr)
+            {
+                m_blocks.push_back(std::unique_ptr<ThreadBlock>(new ThreadBlock()));
+                t_block = m_blocks.back().get();
+            }
+        }
+        
+        return *t_block;
+    }
+    
+    void SocketMetrics::add(SocketCounter counter, uint64_t value)
+    {
+        std::atomic<uint64_t> & total = localBlock().counters[static_cast<size_t>(counter)];
+        total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    
+    void SocketMetrics::record(SocketTimer timer, std::chrono::steady_clock::duration duration)
+    {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        uint64_t us = ns / 1000;
+        
+        //number of significant bits of the duration in us
+        size_t index = 0;
+        while((us != 0) && (index < BUCKETS - 1))
+        {
+            us >>= 1;
+            index++;
+        }
+        
+        ThreadBlock & block = localBlock();
+        std::atomic<uint64_t> & bucket = block.buckets[static_cast<size_t>(timer)][index];
+        std::atomic<uint64_t> & total = block.totalNs[static_cast<size_t>(timer)];
+        
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    }
+    
+    SocketServerMetrics SocketMetrics::snapshot() const
+    {
+        SocketServerMetrics metrics;
+        
+        SocketLatencyHistogram * histograms[] =
+        {
+            &metrics.receiveTime, &metrics.queueTime, &metrics.handlerTime, &metrics.sendTime
+        };
+        
+        uint64_t counters[static_cast<size_t>(SocketCounter::COUNT)] = {};
+        
+        for(SocketLatencyHistogram * histogram : histograms)
+        {
+            histogram->buckets.assign(BUCKETS, 0);
+        }
+        
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        for(const std::unique_ptr<ThreadBlock> & block : m_blocks)
+        {
+            for(size_t counter = 0; counter < static_cast<size_t>(SocketCounter::COUNT); counter++)
+            {
+                counters[counter] += block->counters[counter].load(std::memory_order_relaxed);
+            }
+            
+            for(size_t timer = 0; timer < static_cast<size_t>(SocketTimer::COUNT); timer++)
+            {
+                histograms[timer]->totalNs += block->totalNs[timer].load(std::memory_order_relaxed);
+                
+                for(size_t index = 0; index < BUCKETS; index++)
+                {
+                    uint64_t count = block->buckets[timer][index].load(std::memory_order_relaxed);
+                    histograms[timer]->buckets[index] += count;
+                    histograms[timer]->count += count;
+                }
+            }
+        }
+        
+        metrics.connectionsAccepted = counters[static_cast<size_t>(SocketCounter::CONNECTIONS_ACCEPTED)];
+        metrics.connectionsClosed = counters[static_cast<size_t>(SocketCounter::CONNECTIONS_CLOSED)];
+        metrics.requests = counters[static_cast<size_t>(SocketCounter::REQUESTS)];
+        metrics.failedRequests = counters[static_cast<size_t>(SocketCounter::FAILED_REQUESTS)];
+        metrics.overloadedRequests = counters[static_cast<size_t>(SocketCounter::OVERLOADED_REQUESTS)];
+        metrics.timedOutConnections = counters[static_cast<size_t>(SocketCounter::TIMED_OUT_CONNECTIONS)];
+        metrics.bytesReceived = counters[static_cast<size_t>(SocketCounter::BYTES_RECEIVED)];
+        metrics.bytesSent = counters[static_cast<size_t>(SocketCounter::BYTES_SENT)];
+        
+        return metrics;
+    }
+    
+    std::vector<std::string> SocketMetrics::toFrames(const SocketServerMetrics & metrics)
+    {
+        std::vector<std::string> frames =
+        {
+            "connections_accepted", std::to_string(metrics.connectionsAccepted),
+            "connections_closed", std::to_string(metrics.connectionsClosed),
+            "requests", std::to_string(metrics.requests),
+            "failed_requests", std::to_string(metrics.failedRequests),
+            "overloaded_requests", std::to_string(metrics.overloadedRequests),
+            "timed_out_connections", std::to_string(metrics.timedOutConnections),
+            "bytes_received", std::to_string(metrics.bytesReceived),
+            "bytes_sent", std::to_string(metrics.bytesSent)
+        };
+        
+        const std::pair<const char *, const SocketLatencyHistogram *> histograms[] =
+        {
+            {"receive", &metrics.receiveTime},
+            {"queue", &metrics.queueTime},
+            {"handler", &metrics.handlerTime},
+            {"send", &metrics.sendTime}
+        };
+        
+        for(const std::pair<const char *, const SocketLatencyHistogram *> & histogram : histograms)
+        {
+            std::string name(histogram.first);
+            
+            frames.push_back(name + "_count");
+            frames.push_back(std::to_string(histogram.second->count));
+            frames.push_back(name + "_total_ns");
+            frames.push_back(std::to_string(histogram.second->totalNs));
+            frames.push_back(name + "_p50_us");
+            frames.push_back(std::to_string(histogram.second->percentile(0.50)));
+            frames.push_back(name + "_p99_us");
+            frames.push_back(std::to_string(histogram.second->percentile(0.99)));
+        }
+        
+        return frames;
+    }
+    
+} //namespace fty
@@ -0,0 +1,100 @@
+/*  =========================================================================
+    fty_common_socket_metrics - Per thread counters and latency histograms of the server
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_METRICS_H_INCLUDED
+#define FTY_COMMON_SOCKET_METRICS_H_INCLUDED
+
+#include "fty_common_socket_basic_mailbox_server.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fty
+{
+    enum class SocketCounter
+    {
+        CONNECTIONS_ACCEPTED,
+        CONNECTIONS_CLOSED,
+        REQUESTS,
+        FAILED_REQUESTS,
+        OVERLOADED_REQUESTS,
+        TIMED_OUT_CONNECTIONS,
+        BYTES_RECEIVED,
+        BYTES_SENT,
+        COUNT
+    };
+    
+    enum class SocketTimer
+    {
+        RECEIVE,
+        QUEUE,
+        HANDLER,
+        SEND,
+        COUNT
+    };
+    
+    // Accumulate counters and durations without locks: each thread updates
+    // its own block, snapshot() sums the blocks of all threads.
+    
+    class SocketMetrics
+    {
+    public:
+        SocketMetrics();
+        
+        SocketMetrics(const SocketMetrics &) = delete;
+        SocketMetrics & operator=(const SocketMetrics &) = delete;
+        
+        void add(SocketCounter counter, uint64_t value = 1);
+        void record(SocketTimer timer, std::chrono::steady_clock::duration duration);
+        
+        SocketServerMetrics snapshot() const;
+        
+        // Snapshot as pairs of name and value frames
+        static std::vector<std::string> toFrames(const SocketServerMetrics & metrics);
+        
+        static const size_t BUCKETS = 32;
+        
+    private:
+        struct ThreadBlock
+        {
+            std::thread::id owner;
+            std::atomic<uint64_t> counters[static_cast<size_t>(SocketCounter::COUNT)];
+            std::atomic<uint64_t> buckets[static_cast<size_t>(SocketTimer::COUNT)][BUCKETS];
+            std::atomic<uint64_t> totalNs[static_cast<size_t>(SocketTimer::COUNT)];
+            
+            ThreadBlock();
+        };
+        
+        ThreadBlock & localBlock();
+        
+        //attributs
+        uint64_t m_id;
+        mutable std::mutex m_mutex;
+        std::vector<std::unique_ptr<ThreadBlock>> m_blocks;
+    };
+    
+} //namespace fty
+
+#endif
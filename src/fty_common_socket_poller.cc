@@ -0,0 +1,562 @@
+/*  =========================================================================
+    fty_common_socket_poller - Readiness notification backends for the server loop
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_poller - Readiness notification backends for the server loop
+@discuss
+    select() is the portable fallback and is limited to FD_SETSIZE. epoll
+    scales with the number of ready sockets and has no descriptor limit.
+    io_uring queues the poll requests of the sockets and submits them with
+    the wait, in one system call for each loop iteration.
+@end
+*/
+
+#include "platform.h"
+#include "fty_common_socket_poller.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+
+#ifdef FTY_COMMON_SOCKET_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unordered_map>
+#endif
+
+namespace fty
+{
+    class SelectPoller : public SocketPoller
+    {
+    public:
+        SelectPoller()
+        {
+            FD_ZERO(&m_socketsSet);
+            FD_ZERO(&m_writeSet);
+        }
+        
+        void add(int socket) override
+        {
+            if(socket >= FD_SETSIZE)
+            {
+                throw std::runtime_error("Socket "+std::to_string(socket)+" is out of the select range, use epoll engine");
+            }
+            
+            FD_SET(socket, &m_socketsSet);
+            m_sockets.insert(socket);
+        }
+        
+        void addShared(int socket) override
+        {
+            add(socket);
+        }
+        
+        void remove(int socket) override
+        {
+            FD_CLR(socket, &m_socketsSet);
+            FD_CLR(socket, &m_writeSet);
+            m_sockets.erase(socket);
+        }
+        
+        void watchWrite(int socket, bool write) override
+        {
+            if(write)
+            {
+                FD_CLR(socket, &m_socketsSet);
+                FD_SET(socket, &m_writeSet);
+            }
+            else
+            {
+                FD_CLR(socket, &m_writeSet);
+                FD_SET(socket, &m_socketsSet);
+            }
+        }
+        
+        const std::vector<int> & wait(int timeout) override
+        {
+            m_ready.clear();
+            
+            if(m_sockets.empty())
+            {
+                return m_ready;
+            }
+            
+            int lastSocket = *m_sockets.rbegin();
+            fd_set tmpSockets = m_socketsSet;
+            fd_set tmpWrite = m_writeSet;
+            
+            struct timeval tv;
+            tv.tv_sec = timeout / 1000;
+            tv.tv_usec = (timeout % 1000) * 1000;
+            
+            if (select(lastSocket+1, &tmpSockets, &tmpWrite, NULL, (timeout < 0) ? NULL : &tv) <= 0)
+            {
+                return m_ready;
+            }
+            
+            for (int socket : m_sockets)
+            {
+                if (FD_ISSET(socket, &tmpSockets) || FD_ISSET(socket, &tmpWrite))
+                {
+                    m_ready.push_back(socket);
+                }
+            }
+            
+            return m_ready;
+        }
+        
+    private:
+        fd_set m_socketsSet;
+        fd_set m_writeSet;
+        std::set<int> m_sockets;
+        std::vector<int> m_ready;
+    };
+    
+    class EpollPoller : public SocketPoller
+    {
+    public:
+        EpollPoller()
+        :   m_events(64)
+        {
+            m_epoll = epoll_create1(EPOLL_CLOEXEC);
+            
+            if(m_epoll == -1)
+            {
+                throw std::runtime_error("Impossible to create epoll instance: " + std::string(strerror(errno)));
+            }
+        }
+        
+        ~EpollPoller()
+        {
+            close(m_epoll);
+        }
+        
+        void add(int socket) override
+        {
+            watch(socket, EPOLLIN);
+        }
+        
+        void addShared(int socket) override
+        {
+#ifdef EPOLLEXCLUSIVE
+            watch(socket, EPOLLIN | EPOLLEXCLUSIVE);
+#else
+            watch(socket, EPOLLIN);
+#endif
+        }
+        
+        void remove(int socket) override
+        {
+            //the socket may already be closed, in which case the kernel dropped it
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, socket, NULL);
+        }
+        
+        void watchWrite(int socket, bool write) override
+        {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = write ? EPOLLOUT : EPOLLIN;
+            event.data.fd = socket;
+            
+            if(epoll_ctl(m_epoll, EPOLL_CTL_MOD, socket, &event) == -1)
+            {
+                throw std::runtime_error("Impossible to watch socket: " + std::string(strerror(errno)));
+            }
+        }
+        
+        const std::vector<int> & wait(int timeout) override
+        {
+            m_ready.clear();
+            
+            int count = epoll_wait(m_epoll, m_events.data(), m_events.size(), timeout);
+            
+            for(int index = 0; index < count; index++)
+            {
+                m_ready.push_back(m_events[index].data.fd);
+            }
+            
+            return m_ready;
+        }
+        
+    private:
+        void watch(int socket, uint32_t events)
+        {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = events;
+            event.data.fd = socket;
+            
+            if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &event) == -1)
+            {
+                throw std::runtime_error("Impossible to watch socket: " + std::string(strerror(errno)));
+            }
+        }
+        
+        //attributs
+        int m_epoll;
+        std::vector<struct epoll_event> m_events;
+        std::vector<int> m_ready;
+    };
+    
+#ifdef FTY_COMMON_SOCKET_HAVE_IO_URING
+    // One shot poll requests, armed again after each completion, behave as
+    // level triggered notifications.
+    class UringPoller : public SocketPoller
+    {
+    public:
+        UringPoller()
+        {
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            
+            m_ring = syscall(__NR_io_uring_setup, ringEntries, &params);
+            
+            if(m_ring == -1)
+            {
+                throw std::runtime_error("Impossible to create io_uring instance: " + std::string(strerror(errno)));
+            }
+            
+            m_sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+            m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            
+            m_sq = mmap(NULL, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+            m_cq = mmap(NULL, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+            m_sqes = static_cast<struct io_uring_sqe *>(
+                mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES));
+            
+            if((m_sq == MAP_FAILED) || (m_cq == MAP_FAILED) || (m_sqes == MAP_FAILED))
+            {
+                std::string error(strerror(errno));
+                release();
+                throw std::runtime_error("Impossible to map io_uring instance: " + error);
+            }
+            
+            char * sq = static_cast<char *>(m_sq);
+            m_sqTail = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+            m_sqMask = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+            m_sqArray = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+            m_sqEntries = params.sq_entries;
+            
+            char * cq = static_cast<char *>(m_cq);
+            m_cqHead = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+            m_cqTail = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+            m_cqMask = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+        }
+        
+        ~UringPoller()
+        {
+            release();
+        }
+        
+        void add(int socket) override
+        {
+            Watch & watch = m_watches[socket];
+            watch.generation = ++m_generation;
+            watch.write = false;
+            watch.armed = false;
+            
+            arm(socket, watch);
+        }
+        
+        void addShared(int socket) override
+        {
+            add(socket);
+        }
+        
+        void remove(int socket) override
+        {
+            std::unordered_map<int, Watch>::iterator it = m_watches.find(socket);
+            
+            if(it == m_watches.end())
+            {
+                return;
+            }
+            
+            //the completion of the cancelled request is dropped with the watch
+            if(it->second.armed)
+            {
+                cancel(socket, it->second);
+            }
+            
+            m_watches.erase(it);
+        }
+        
+        void watchWrite(int socket, bool write) override
+        {
+            Watch & watch = m_watches.at(socket);
+            
+            if(watch.armed)
+            {
+                cancel(socket, watch);
+            }
+            
+            watch.generation = ++m_generation;
+            watch.write = write;
+            watch.armed = false;
+            
+            arm(socket, watch);
+        }
+        
+        const std::vector<int> & wait(int timeout) override
+        {
+            m_ready.clear();
+            
+            //watch again the sockets reported by the previous call
+            for(int socket : m_rearm)
+            {
+                std::unordered_map<int, Watch>::iterator it = m_watches.find(socket);
+                
+                if((it != m_watches.end()) && !it->second.armed)
+                {
+                    arm(socket, it->second);
+                }
+            }
+            
+            m_rearm.clear();
+            
+            bool timerArmed = false;
+            
+            if(timeout >= 0)
+            {
+                m_timeout.tv_sec = timeout / 1000;
+                m_timeout.tv_nsec = (timeout % 1000) * 1000000LL;
+                
+                struct io_uring_sqe * sqe = nextSqe();
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = reinterpret_cast<uint64_t>(&m_timeout);
+                sqe->len = 1;
+                sqe->user_data = timeoutTag;
+                timerArmed = true;
+            }
+            
+            //submit the queued requests and wait, in one call
+            if(enter(m_toSubmit, 1, IORING_ENTER_GETEVENTS) == -1)
+            {
+                return m_ready;
+            }
+            
+            uint32_t head = *m_cqHead;
+            uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            
+            for(; head != tail; head++)
+            {
+                const struct io_uring_cqe & cqe = m_cqes[head & m_cqMask];
+                
+                if(cqe.user_data == timeoutTag)
+                {
+                    timerArmed = false;
+                    continue;
+                }
+                
+                if(cqe.user_data == cancelTag)
+                {
+                    continue;
+                }
+                
+                int socket = static_cast<int>(cqe.user_data & 0xffffffff);
+                uint32_t generation = static_cast<uint32_t>(cqe.user_data >> 32);
+                
+                std::unordered_map<int, Watch>::iterator it = m_watches.find(socket);
+                
+                //completion of a request cancelled or replaced since
+                if((it == m_watches.end()) || (it->second.generation != generation))
+                {
+                    continue;
+                }
+                
+                it->second.armed = false;
+                m_rearm.push_back(socket);
+                
+                //errors are reported as ready, the next read or write tells which one
+                m_ready.push_back(socket);
+            }
+            
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+            
+            //the timer is not needed anymore
+            if(timerArmed)
+            {
+                struct io_uring_sqe * sqe = nextSqe();
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = timeoutTag;
+                sqe->user_data = cancelTag;
+            }
+            
+            return m_ready;
+        }
+        
+    private:
+        struct Watch
+        {
+            uint32_t generation;
+            bool write;
+            bool armed;
+        };
+        
+        static const unsigned ringEntries = 256;
+        static const uint64_t timeoutTag = ~0ULL;
+        static const uint64_t cancelTag = ~0ULL - 1;
+        
+        static uint64_t tag(int socket, const Watch & watch)
+        {
+            return (static_cast<uint64_t>(watch.generation) << 32) | static_cast<uint32_t>(socket);
+        }
+        
+        void arm(int socket, Watch & watch)
+        {
+            struct io_uring_sqe * sqe = nextSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = socket;
+            sqe->poll_events = watch.write ? POLLOUT : POLLIN;
+            sqe->user_data = tag(socket, watch);
+            
+            watch.armed = true;
+        }
+        
+        void cancel(int socket, const Watch & watch)
+        {
+            struct io_uring_sqe * sqe = nextSqe();
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = tag(socket, watch);
+            sqe->user_data = cancelTag;
+        }
+        
+        // Cleared entry of the submission queue, submitting the queued ones when full
+        struct io_uring_sqe * nextSqe()
+        {
+            if(m_toSubmit == m_sqEntries)
+            {
+                if(enter(m_toSubmit, 0, 0) == -1)
+                {
+                    throw std::runtime_error("Impossible to submit to io_uring: " + std::string(strerror(errno)));
+                }
+            }
+            
+            uint32_t tail = *m_sqTail;
+            uint32_t index = tail & m_sqMask;
+            
+            struct io_uring_sqe * sqe = &m_sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            
+            m_sqArray[index] = index;
+            __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+            m_toSubmit++;
+            
+            return sqe;
+        }
+        
+        // Return -1 on error, e.g. EINTR
+        int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+        {
+            int ret = syscall(__NR_io_uring_enter, m_ring, toSubmit, minComplete, flags, NULL, 0);
+            
+            if(ret >= 0)
+            {
+                //requests not consumed on error stay queued for the next call
+                m_toSubmit -= std::min<unsigned>(ret, m_toSubmit);
+            }
+            
+            return (ret < 0) ? -1 : ret;
+        }
+        
+        void release()
+        {
+            if(m_sqes && (m_sqes != MAP_FAILED))
+            {
+                munmap(m_sqes, m_sqesSize);
+            }
+            
+            if(m_cq && (m_cq != MAP_FAILED))
+            {
+                munmap(m_cq, m_cqSize);
+            }
+            
+            if(m_sq && (m_sq != MAP_FAILED))
+            {
+                munmap(m_sq, m_sqSize);
+            }
+            
+            close(m_ring);
+        }
+        
+        //attributs
+        int m_ring = -1;
+        
+        void * m_sq = NULL;
+        void * m_cq = NULL;
+        struct io_uring_sqe * m_sqes = NULL;
+        size_t m_sqSize = 0;
+        size_t m_cqSize = 0;
+        size_t m_sqesSize = 0;
+        
+        uint32_t * m_sqTail = NULL;
+        uint32_t * m_sqArray = NULL;
+        uint32_t m_sqMask = 0;
+        uint32_t m_sqEntries = 0;
+        
+        uint32_t * m_cqHead = NULL;
+        uint32_t * m_cqTail = NULL;
+        uint32_t m_cqMask = 0;
+        struct io_uring_cqe * m_cqes = NULL;
+        
+        unsigned m_toSubmit = 0;
+        uint32_t m_generation = 0;
+        struct __kernel_timespec m_timeout;
+        
+        std::unordered_map<int, Watch> m_watches;
+        std::vector<int> m_rearm;
+        std::vector<int> m_ready;
+    };
+#endif
+    
+    std::unique_ptr<SocketPoller> SocketPoller::create(SocketEventEngine engine)
+    {
+        switch(engine)
+        {
+            case SocketEventEngine::SELECT:
+                return std::unique_ptr<SocketPoller>(new SelectPoller());
+            case SocketEventEngine::EPOLL:
+                return std::unique_ptr<SocketPoller>(new EpollPoller());
+            case SocketEventEngine::IO_URING:
+#ifdef FTY_COMMON_SOCKET_HAVE_IO_URING
+                return std::unique_ptr<SocketPoller>(new UringPoller());
+#else
+                throw std::runtime_error("io_uring engine is not available in this build");
+#endif
+        }
+        
+        throw std::runtime_error("Unknown event engine");
+    }
+    
+} //namespace fty
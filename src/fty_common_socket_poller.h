@@ -0,0 +1,60 @@
+/*  =========================================================================
+    fty_common_socket_poller - Readiness notification backends for the server loop
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_POLLER_H_INCLUDED
+#define FTY_COMMON_SOCKET_POLLER_H_INCLUDED
+
+#include "fty_common_socket_basic_mailbox_server.h"
+
+#include <memory>
+#include <vector>
+
+namespace fty
+{
+    // Wait for ready sockets on behalf of SocketBasicServer::run.
+    // Not thread safe: a poller belongs to the thread running the loop.
+    
+    class SocketPoller
+    {
+    public:
+        static std::unique_ptr<SocketPoller> create(SocketEventEngine engine);
+        
+        virtual ~SocketPoller() = default;
+        
+        virtual void add(int socket) = 0;
+        
+        // Add a socket watched by the pollers of several threads, e.g. the
+        // listening one. When possible only one of them is woken up.
+        virtual void addShared(int socket) = 0;
+        virtual void remove(int socket) = 0;
+        
+        // Wait for a socket already added to be writable instead of
+        // readable, or readable again when write is false.
+        virtual void watchWrite(int socket, bool write) = 0;
+        
+        // Block until sockets are ready or timeout (ms, -1 for no timeout)
+        // expires. Return the ready sockets, empty on timeout or signal.
+        virtual const std::vector<int> & wait(int timeout) = 0;
+    };
+    
+} //namespace fty
+
+#endif
@@ -0,0 +1,457 @@
+/*  =========================================================================
+    fty_common_socket_response_cache - Cache of the replies to idempotent requests
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_response_cache - Cache of the replies to idempotent requests
+@discuss
+    SocketBasicServer looks up the requests of the types opted in before
+    calling its SyncServer. A hit writes the reply kept in wire form, a
+    miss calls the handler and keeps its reply encoded in both framings.
+    Only the SyncServer handlers use the cache.
+@end
+*/
+
+#include "fty_common_socket_response_cache.h"
+
+#include <cstring>
+
+namespace fty
+{
+    // Key of a request: the sender, empty if the reply is the same for all,
+    // then the frames, each one as [ size ] [ data ]
+    static void appendPart(std::string & key, const char * data, size_t size)
+    {
+        uint32_t partSize = static_cast<uint32_t>(size);
+        key.append(reinterpret_cast<const char *>(&partSize), sizeof(partSize));
+        key.append(data, size);
+    }
+    
+    // Offset of the frames in a key
+    static size_t framesOffset(const std::string & key)
+    {
+        uint32_t senderSize;
+        memcpy(&senderSize, key.data(), sizeof(senderSize));
+        
+        return sizeof(senderSize) + senderSize;
+    }
+    
+    SocketResponseCache::SocketResponseCache(size_t maxBytes)
+    :   m_maxBytes(maxBytes)
+    {
+    }
+    
+    void SocketResponseCache::cacheRequests(const std::string & type, std::chrono::milliseconds ttl, bool perSender)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            
+            if(ttl > std::chrono::milliseconds(0))
+            {
+                m_rules[type] = Rule{ttl, perSender};
+            }
+            else
+            {
+                m_rules.erase(type);
+            }
+        }
+        
+        //the replies kept under the previous rule
+        invalidateType(type);
+    }
+    
+    void SocketResponseCache::invalidateType(const std::string & type)
+    {
+        std::string typePart;
+        appendPart(typePart, type.data(), type.size());
+        
+        eraseIf([&typePart](const std::string & key)
+        {
+            return key.compare(framesOffset(key), typePart.size(), typePart) == 0;
+        });
+    }
+    
+    void SocketResponseCache::invalidate(const Payload & request)
+    {
+        std::string frames;
+        
+        for(const std::string & frame : request)
+        {
+            appendPart(frames, frame.data(), frame.size());
+        }
+        
+        eraseIf([&frames](const std::string & key)
+        {
+            return key.compare(framesOffset(key), std::string::npos, frames) == 0;
+        });
+    }
+    
+    void SocketResponseCache::clear()
+    {
+        eraseIf([](const std::string &)
+        {
+            return true;
+        });
+    }
+    
+    size_t SocketResponseCache::entries() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.size();
+    }
+    
+    size_t SocketResponseCache::bytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bytes;
+    }
+    
+    uint64_t SocketResponseCache::hits() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_hits;
+    }
+    
+    uint64_t SocketResponseCache::misses() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_misses;
+    }
+    
+    template <typename Predicate>
+    void SocketResponseCache::eraseIf(Predicate predicate)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        //replies being computed may predate what is invalidated
+        m_generation++;
+        
+        for(Entries::iterator entry = m_entries.begin(); entry != m_entries.end();)
+        {
+            Entries::iterator next = std::next(entry);
+            
+            if(predicate(entry->first))
+            {
+                erase(entry);
+            }
+            
+            entry = next;
+        }
+    }
+    
+    void SocketResponseCache::erase(Entries::iterator entry)
+    {
+        m_bytes -= entry->first.size() + entry->second.reply.size();
+        m_uses.erase(entry->second.use);
+        m_entries.erase(entry);
+    }
+    
+    const std::string * SocketResponseCache::makeKey(const std::string & sender, const SocketPayload & request, Rule & rule)
+    {
+        //reused by the requests of the thread
+        static thread_local std::string t_type;
+        static thread_local std::string t_key;
+        
+        if(request.empty() || m_rules.empty())
+        {
+            return nullptr;
+        }
+        
+        t_type.assign(request[0].data(), request[0].size());
+        
+        auto found = m_rules.find(t_type);
+        
+        if(found == m_rules.end())
+        {
+            return nullptr;
+        }
+        
+        rule = found->second;
+        
+        t_key.clear();
+        
+        if(rule.perSender)
+        {
+            appendPart(t_key, sender.data(), sender.size());
+        }
+        else
+        {
+            appendPart(t_key, "", 0);
+        }
+        
+        for(const SocketFrame & frame : request)
+        {
+            appendPart(t_key, frame.data(), frame.size());
+        }
+        
+        return &t_key;
+    }
+    
+    bool SocketResponseCache::find(const std::string & sender, const SocketPayload & request,
+                                   SocketEncodedMessage & reply, uint64_t & generation)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        Rule rule;
+        const std::string * key = makeKey(sender, request, rule);
+        
+        if(!key)
+        {
+            return false;
+        }
+        
+        Entries::iterator entry = m_entries.find(*key);
+        
+        if((entry != m_entries.end()) && (std::chrono::steady_clock::now() >= entry->second.expiry))
+        {
+            erase(entry);
+            entry = m_entries.end();
+        }
+        
+        if(entry == m_entries.end())
+        {
+            m_misses++;
+            reply = SocketEncodedMessage();
+            generation = m_generation;
+            return true;
+        }
+        
+        m_hits++;
+        reply = entry->second.reply;
+        
+        //most recently used
+        m_uses.splice(m_uses.begin(), m_uses, entry->second.use);
+        
+        return true;
+    }
+    
+    SocketEncodedMessage SocketResponseCache::store(const std::string & sender, const SocketPayload & request,
+                                                    const Payload & reply, uint64_t generation)
+    {
+        SocketEncodedMessage encoded(reply);
+        
+        std::lock_guard<std::mutex> lock(m_mutex);
+        
+        Rule rule;
+        const std::string * key = makeKey(sender, request, rule);
+        
+        //invalidated while the reply was computed
+        if(!key || (generation != m_generation))
+        {
+            return encoded;
+        }
+        
+        size_t size = key->size() + encoded.size();
+        
+        if(size > m_maxBytes)
+        {
+            return encoded;
+        }
+        
+        Entries::iterator entry = m_entries.find(*key);
+        
+        if(entry != m_entries.end())
+        {
+            erase(entry);
+        }
+        
+        //room for the new entry, from the least recently used
+        while(m_bytes + size > m_maxBytes)
+        {
+            erase(m_entries.find(*m_uses.back()));
+        }
+        
+        entry = m_entries.emplace(*key, Entry()).first;
+        entry->second.reply = encoded;
+        entry->second.expiry = std::chrono::steady_clock::now() + rule.ttl;
+        entry->second.use = m_uses.insert(m_uses.begin(), &entry->first);
+        
+        m_bytes += size;
+        
+        return encoded;
+    }
+
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_sync_client.h"
+#include "fty_common_socket_test_server.h"
+#include <cassert>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+
+namespace
+{
+    // Echo server adding to the reply the number of the call
+    class CountingServer : public fty::SyncServer
+    {
+    public:
+        fty::Payload handleRequest(const fty::Sender & /*sender*/, const fty::Payload & payload) override
+        {
+            fty::Payload reply = payload;
+            reply.push_back(std::to_string(++calls));
+
+            return reply;
+        }
+
+        std::atomic<int> calls{0};
+    };
+}
+
+void
+fty_common_socket_response_cache_test (bool verbose)
+{
+    printf (" * fty_common_socket_response_cache: ");
+
+    //  @selftest
+    //  Nothing is cached without rules, and rules can be taken back
+    {
+        fty::SocketResponseCache cache(1024);
+
+        cache.cacheRequests("GET", std::chrono::seconds(1));
+        cache.cacheRequests("LIST", std::chrono::seconds(1), true);
+        cache.cacheRequests("GET", std::chrono::milliseconds(0));
+
+        cache.invalidateType("LIST");
+        cache.invalidate({"LIST", "assets"});
+        cache.clear();
+
+        assert(cache.entries() == 0);
+        assert(cache.bytes() == 0);
+        assert(cache.hits() == 0);
+        assert(cache.misses() == 0);
+    }
+
+    //  Response cache: replies kept for the request types opted in, for both framings, until invalidated or expired
+    {
+        CountingServer server;
+        fty::SocketResponseCache cache;
+
+        cache.cacheRequests("GET", std::chrono::seconds(60));
+        cache.cacheRequests("SHORT", std::chrono::milliseconds(50));
+
+        fty::SocketServerConfig config;
+        config.responseCache = &cache;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+
+        fty::SocketClientConfig clientConfig;
+        clientConfig.maxConnections = 1;
+        clientConfig.framing = fty::SocketFraming::V2;
+
+        fty::SocketSyncClient v2Client("test.socket", clientConfig);
+
+        assert(syncClient.syncRequestWithReply({"GET", "assets"}) == fty::Payload({"GET", "assets", "1"}));
+        assert(syncClient.syncRequestWithReply({"GET", "assets"}) == fty::Payload({"GET", "assets", "1"}));
+        assert(v2Client.syncRequestWithReply({"GET", "assets"}) == fty::Payload({"GET", "assets", "1"}));
+        assert(v2Client.syncRequestWithReply({"GET", "assets"}) == fty::Payload({"GET", "assets", "1"}));
+        assert(syncClient.syncRequestWithReply({"GET", "config"}) == fty::Payload({"GET", "config", "2"}));
+        assert(cache.hits() == 3);
+        assert(cache.entries() == 2);
+
+        //not opted in
+        assert(syncClient.syncRequestWithReply({"SET", "config"}) == fty::Payload({"SET", "config", "3"}));
+        assert(syncClient.syncRequestWithReply({"SET", "config"}) == fty::Payload({"SET", "config", "4"}));
+
+        cache.invalidate({"GET", "assets"});
+        assert(v2Client.syncRequestWithReply({"GET", "assets"}) == fty::Payload({"GET", "assets", "5"}));
+        assert(syncClient.syncRequestWithReply({"GET", "config"}) == fty::Payload({"GET", "config", "2"}));
+
+        cache.invalidateType("GET");
+        assert(cache.entries() == 0);
+        assert(syncClient.syncRequestWithReply({"GET", "config"}) == fty::Payload({"GET", "config", "6"}));
+
+        assert(syncClient.syncRequestWithReply({"SHORT"}) == fty::Payload({"SHORT", "7"}));
+        assert(syncClient.syncRequestWithReply({"SHORT"}) == fty::Payload({"SHORT", "7"}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(syncClient.syncRequestWithReply({"SHORT"}) == fty::Payload({"SHORT", "8"}));
+
+        //a batch on workers calls the handler once
+        cache.clear();
+        server.calls = 0;
+
+        serverThread.stop();
+
+        config.workers = 2;
+
+        fty::SocketBasicServer workersAgent(  server,
+                                              "test.socket",
+                                              30,
+                                              config);
+
+        fty::SocketTestServer workersThread(workersAgent);
+
+        std::vector<fty::Payload> replies = syncClient.syncRequestBatch(std::vector<fty::Payload>(100, {"GET", "assets"}));
+        assert(replies == std::vector<fty::Payload>(100, {"GET", "assets", "1"}));
+        assert(server.calls == 1);
+    }
+
+    //  Response cache: the least recently used replies make room within the budget
+    {
+        CountingServer server;
+        fty::SocketResponseCache cache(5000);
+
+        cache.cacheRequests("GET", std::chrono::seconds(60));
+
+        fty::SocketServerConfig config;
+        config.responseCache = &cache;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+        std::string large(600, 'x');
+
+        //room for two entries
+        assert(syncClient.syncRequestWithReply({"GET", "first", large}).back() == "1");
+        assert(syncClient.syncRequestWithReply({"GET", "second", large}).back() == "2");
+        assert(syncClient.syncRequestWithReply({"GET", "first", large}).back() == "1");
+        assert(syncClient.syncRequestWithReply({"GET", "third", large}).back() == "3");
+        assert(cache.entries() == 2);
+        assert(cache.bytes() <= 5000);
+
+        assert(syncClient.syncRequestWithReply({"GET", "first", large}).back() == "1");
+        assert(syncClient.syncRequestWithReply({"GET", "second", large}).back() == "4");
+
+        //too large to be kept
+        assert(syncClient.syncRequestWithReply({"GET", std::string(4000, 'x')}).back() == "5");
+        assert(syncClient.syncRequestWithReply({"GET", std::string(4000, 'x')}).back() == "6");
+        assert(cache.entries() == 2);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
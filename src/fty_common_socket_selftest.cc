@@ -42,6 +42,13 @@ all_tests [] = {
 // Tests for stable public classes:
     { "fty_common_socket_sync_client", fty_common_socket_sync_client_test, true, true, NULL },
     { "fty_common_socket_basic_mailbox_server", fty_common_socket_basic_mailbox_server_test, true, true, NULL },
+    { "fty_common_socket_frame", fty_common_socket_frame_test, true, true, NULL },
+    { "fty_common_socket_async_client", fty_common_socket_async_client_test, true, true, NULL },
+    { "fty_common_socket_stream", fty_common_socket_stream_test, true, true, NULL },
+    { "fty_common_socket_arena", fty_common_socket_arena_test, true, true, NULL },
+    { "fty_common_socket_async_server", fty_common_socket_async_server_test, true, true, NULL },
+    { "fty_common_socket_response_cache", fty_common_socket_response_cache_test, true, true, NULL },
+    { "fty_common_socket_encoded_message", fty_common_socket_encoded_message_test, true, true, NULL },
     {NULL, NULL, 0, 0, NULL}          //  Sentinel
 };
 
@@ -0,0 +1,554 @@
+/*  =========================================================================
+    fty_common_socket_stream - Streamed requests and replies, read and written chunk by chunk
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_stream - Streamed requests and replies, read and written chunk by chunk
+@discuss
+    A SocketStreamServer given to SocketBasicServer handles the requests
+    of SocketSyncClient::streamRequest. It reads the request frames and
+    writes the reply frames one at a time, so the memory used on both
+    ends depends on the chunk size rather than on the size of the payload.
+@end
+*/
+
+#include "fty_common_socket_stream.h"
+#include "fty_common_socket_helpers.h"
+
+namespace fty
+{
+    // Deadline of the next read or write, none without timeout
+    static SocketDeadline idleDeadline(std::chrono::milliseconds idleTimeout)
+    {
+        if(idleTimeout <= std::chrono::milliseconds(0))
+        {
+            return noDeadline;
+        }
+        
+        return std::chrono::steady_clock::now() + idleTimeout;
+    }
+    
+    SocketStreamReader::SocketStreamReader(SocketFrameReader & reader, std::chrono::milliseconds idleTimeout)
+    :   m_reader(reader), m_idleTimeout(idleTimeout)
+    {
+    }
+    
+    bool SocketStreamReader::next(SocketFrame & frame)
+    {
+        while(m_next == m_chunk.size())
+        {
+            if(m_ended)
+            {
+                return false;
+            }
+            
+            //release the previous chunk first, so its buffer is reused
+            m_chunk.clear();
+            m_next = 0;
+            
+            m_reader.setDeadline(idleDeadline(m_idleTimeout));
+            m_reader.recvFrames(m_chunk);
+            
+            //the request ends with an empty message
+            m_ended = m_chunk.empty();
+        }
+        
+        frame = m_chunk[m_next++];
+        return true;
+    }
+    
+    void SocketStreamReader::skip()
+    {
+        SocketFrame frame;
+        
+        while(next(frame))
+        {
+        }
+    }
+    
+    SocketStreamWriter::SocketStreamWriter(SocketFrameWriter & writer, size_t chunkSize, std::chrono::milliseconds idleTimeout)
+    :   m_writer(writer), m_chunkSize(chunkSize), m_idleTimeout(idleTimeout)
+    {
+    }
+    
+    void SocketStreamWriter::send(const SocketFrame & frame)
+    {
+        m_chunk.push_back(frame);
+        m_chunkBytes += frame.size();
+        
+        if(m_chunkBytes >= m_chunkSize)
+        {
+            flush();
+        }
+    }
+    
+    void SocketStreamWriter::send(const std::string & frame)
+    {
+        send(SocketFrame(frame));
+    }
+    
+    void SocketStreamWriter::flush()
+    {
+        if(!m_chunk.empty())
+        {
+            m_bytesSent += m_writer.sendFrames(m_chunk);
+            
+            m_chunk.clear();
+            m_chunkBytes = 0;
+        }
+        
+        //what the socket didn't take waits for the client
+        m_bytesSent += m_writer.waitFlushed(idleDeadline(m_idleTimeout));
+    }
+    
+    void SocketStreamWriter::finish()
+    {
+        flush();
+        
+        m_bytesSent += m_writer.sendFrames(SocketPayload());
+        m_bytesSent += m_writer.waitFlushed(idleDeadline(m_idleTimeout));
+    }
+
+} //namespace fty
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#include "fty_common_unit_tests.h"
+#include "fty_common_socket_basic_mailbox_server.h"
+#include "fty_common_socket_sync_client.h"
+#include "fty_common_socket_test_server.h"
+#include <cassert>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+
+namespace
+{
+    // Stream the request back frame by frame, fail on a frame "fail".
+    // A frame "count N" replies N frames instead, without reading the rest.
+    class StreamEchoServer : public fty::SocketStreamServer
+    {
+    public:
+        void handleStream(const std::string & /*sender*/, fty::SocketStreamReader & request, fty::SocketStreamWriter & reply) override
+        {
+            fty::SocketFrame frame;
+
+            while(request.next(frame))
+            {
+                if(frame.str() == "fail")
+                {
+                    throw std::runtime_error("Stream failed");
+                }
+
+                if(frame.str().compare(0, 6, "count ") == 0)
+                {
+                    for(size_t index = 0, count = std::stoul(frame.str().substr(6)); index < count; index++)
+                    {
+                        reply.send(std::to_string(index));
+                    }
+
+                    return;
+                }
+
+                reply.send(frame);
+            }
+        }
+    };
+}
+
+void
+fty_common_socket_stream_test (bool verbose)
+{
+    printf (" * fty_common_socket_stream: ");
+
+    //  @selftest
+    //  The reply is sent in chunks of about the chunk size, and ended by an empty message
+    {
+        int sockets[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+        std::thread producer([&sockets]()
+        {
+            fty::SocketFrameWriter writer(sockets[0]);
+            fty::SocketStreamWriter reply(writer, 100);
+
+            for(int index = 0; index < 1000; index++)
+            {
+                reply.send("frame-" + std::to_string(index));
+            }
+
+            reply.finish();
+        });
+
+        fty::SocketFrameReader reader(sockets[1]);
+        int received = 0;
+
+        for(;;)
+        {
+            fty::Payload chunk = reader.recvFrames();
+
+            if(chunk.empty())
+            {
+                break;
+            }
+
+            size_t size = 0;
+
+            for(const std::string & frame : chunk)
+            {
+                assert(frame == "frame-" + std::to_string(received++));
+                size += frame.size();
+            }
+
+            assert(size < 100 + 10);
+        }
+
+        assert(received == 1000);
+
+        producer.join();
+
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    //  The request is read frame by frame across its chunks, the rest can be skipped
+    {
+        int sockets[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+        fty::sendFrames(sockets[0], fty::Payload({"a", "b"}));
+        fty::sendFrames(sockets[0], fty::Payload({"c"}));
+        fty::sendFrames(sockets[0], fty::Payload());
+        fty::sendFrames(sockets[0], fty::Payload({"d"}));
+        fty::sendFrames(sockets[0], fty::Payload({"e"}));
+        fty::sendFrames(sockets[0], fty::Payload());
+        fty::sendFrames(sockets[0], fty::Payload({"next"}));
+
+        fty::SocketFrameReader reader(sockets[1]);
+        fty::SocketFrame frame;
+
+        fty::SocketStreamReader first(reader);
+        std::string content;
+
+        while(first.next(frame))
+        {
+            content += frame.str();
+        }
+
+        assert(content == "abc");
+        assert(!first.next(frame));
+
+        fty::SocketStreamReader second(reader);
+        assert(second.next(frame) && (frame.str() == "d"));
+        second.skip();
+
+        //the connection is back to plain messages
+        assert(reader.recvFrames() == fty::Payload({"next"}));
+
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    //  A client which doesn't read holds the writer back, instead of the frames piling up
+    {
+        int sockets[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+        fty::SocketFrameWriter writer(sockets[0]);
+        fty::SocketStreamWriter reply(writer, 64 * 1024, std::chrono::milliseconds(100));
+        fty::SocketFrame frame(std::string(16 * 1024, 'x'));
+        size_t sent = 0;
+
+        try
+        {
+            for(;;)
+            {
+                reply.send(frame);
+                sent++;
+            }
+        }
+        catch(fty::SocketTimeoutError &)
+        {
+        }
+
+        //the socket buffers and one chunk at most
+        assert(!writer.hasPending() || (writer.pendingBytes() < 128 * 1024));
+        assert(sent < 1024);
+
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    //  Streamed requests, the reply overlapping the request
+    for(size_t workers : {0, 2})
+    {
+        fty::EchoServer server;
+        StreamEchoServer streamServer;
+
+        fty::SocketServerConfig config;
+        config.workers = workers;
+        config.streamServer = &streamServer;
+        config.streamChunkSize = 16 * 1024;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::Payload expectedPayload = {"after", "the", "stream"};
+
+        for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+        {
+            fty::SocketClientConfig clientConfig;
+            clientConfig.maxConnections = 1;
+            clientConfig.framing = framing;
+            clientConfig.streamChunkSize = 16 * 1024;
+
+            fty::SocketSyncClient syncClient( "test.socket", clientConfig);
+
+            //64 MB each way, only a few chunks ahead
+            const size_t frames = 64 * 1024;
+            const std::string content(1024, 'x');
+            size_t produced = 0;
+            size_t consumed = 0;
+            size_t ahead = 0;
+
+            syncClient.streamRequest([&](fty::SocketFrame & frame)
+            {
+                if(produced == frames)
+                {
+                    return false;
+                }
+
+                frame = fty::SocketFrame(std::to_string(produced++) + content);
+                ahead = std::max(ahead, produced - consumed);
+                return true;
+            },
+            [&](const fty::SocketFrame & frame)
+            {
+                assert(frame.str() == std::to_string(consumed++) + content);
+            });
+
+            assert(consumed == frames);
+            assert(ahead < frames / 64);
+
+            //the connection is back to plain requests
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+
+            //the reply may end before the request is read, the rest is dropped
+            std::vector<std::string> request = {"count 1000", "dropped", "dropped"};
+            std::vector<std::string> reply;
+
+            syncClient.streamRequest([&request](fty::SocketFrame & frame)
+            {
+                if(request.empty())
+                {
+                    return false;
+                }
+
+                frame = fty::SocketFrame(request.front());
+                request.erase(request.begin());
+                return true;
+            },
+            [&reply](const fty::SocketFrame & frame)
+            {
+                reply.push_back(frame.str());
+            });
+
+            assert(reply.size() == 1000);
+            assert(reply.back() == "999");
+
+            //a failing handler closes the connection, not the server
+            bool failed = false;
+
+            try
+            {
+                syncClient.streamRequest([](fty::SocketFrame & frame)
+                {
+                    frame = fty::SocketFrame(std::string("fail"));
+                    return true;
+                },
+                [](const fty::SocketFrame &)
+                {
+                });
+            }
+            catch(std::runtime_error &)
+            {
+                failed = true;
+            }
+
+            assert(failed);
+            assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+        }
+
+        //a stream in progress doesn't hold the other clients
+        {
+            fty::SocketSyncClient streamClient( "test.socket");
+            fty::SocketSyncClient syncClient( "test.socket");
+            std::atomic<bool> streaming(true);
+
+            std::thread streamThread([&streamClient, &streaming]()
+            {
+                streamClient.streamRequest([&streaming](fty::SocketFrame & frame)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    frame = fty::SocketFrame(std::string("slow"));
+                    return streaming.load();
+                },
+                [](const fty::SocketFrame &)
+                {
+                });
+            });
+
+            for(int index = 0; index < 10; index++)
+            {
+                assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+            }
+
+            streaming = false;
+            streamThread.join();
+        }
+    }
+
+    //  Streams beyond the stream threads, or beyond the in-flight limit, get the overload reply
+    for(size_t maxInflightRequests : {0, 1})
+    {
+        fty::EchoServer server;
+        StreamEchoServer streamServer;
+
+        fty::SocketServerConfig config;
+        config.streamServer = &streamServer;
+        config.maxStreams = (maxInflightRequests > 0) ? 4 : 1;
+        config.maxInflightRequests = maxInflightRequests;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30,
+                                       config);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient streamClient( "test.socket");
+        fty::SocketSyncClient syncClient( "test.socket");
+        std::atomic<bool> started(false);
+        std::atomic<bool> streaming(true);
+
+        std::thread streamThread([&streamClient, &started, &streaming]()
+        {
+            streamClient.streamRequest([&started, &streaming](fty::SocketFrame & frame)
+            {
+                started = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                frame = fty::SocketFrame(std::string("slow"));
+                return streaming.load();
+            },
+            [](const fty::SocketFrame &)
+            {
+            });
+        });
+
+        while(!started)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        auto emptyStream = [&syncClient]()
+        {
+            syncClient.streamRequest([](fty::SocketFrame &)
+            {
+                return false;
+            },
+            [](const fty::SocketFrame &)
+            {
+            });
+        };
+
+        bool overloaded = false;
+
+        try
+        {
+            emptyStream();
+        }
+        catch(fty::SocketOverloadedError &)
+        {
+            overloaded = true;
+        }
+
+        assert(overloaded);
+        assert(syncClient.syncRequestWithReply({"plain"}) == fty::Payload({"plain"}));
+
+        streaming = false;
+        streamThread.join();
+
+        //the thread is free again once the loop saw the end of the stream
+        while(overloaded)
+        {
+            try
+            {
+                emptyStream();
+                overloaded = false;
+            }
+            catch(fty::SocketOverloadedError &)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    //  A server without stream handler refuses the streams
+    {
+        fty::EchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket",
+                                       30);
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket");
+        bool refused = false;
+
+        try
+        {
+            syncClient.streamRequest([](fty::SocketFrame &)
+            {
+                return false;
+            },
+            [](const fty::SocketFrame &)
+            {
+            });
+        }
+        catch(std::runtime_error &)
+        {
+            refused = true;
+        }
+
+        assert(refused);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -26,6 +26,7 @@
 @end
 */
 
+#include <algorithm>
 #include <stdexcept>
 
 #include "fty_common_socket_sync_client.h"
@@ -38,64 +39,664 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
 
 namespace fty
 {
-    SocketSyncClient::SocketSyncClient(const std::string & path)
-    :   m_path(path)
+    // Capabilities a server accepted on a connection
+    static const unsigned sharedFramesAccepted = 0x01;
+    static const unsigned compressionAccepted = 0x02;
+    
+    // Format of a new request, with an id in V2
+    static MessageFormat requestFormat(SocketFraming framing, size_t sharedFrameSize, size_t compressionThreshold,
+                                       std::atomic<uint64_t> & lastRequestId)
     {
+        MessageFormat format;
+        format.framing = framing;
+        format.sharedFrameSize = sharedFrameSize;
+        format.compressionThreshold = compressionThreshold;
+        
+        if(framing == SocketFraming::V2)
+        {
+            format.requestId = ++lastRequestId;
+        }
+        
+        return format;
     }
     
-       
-    std::vector<std::string> SocketSyncClient::syncRequestWithReply(const std::vector<std::string> & payload)
+    // Receive the reply of a request sent: the server may have handled it,
+    // so a connection closed now is not one to retry the request on
+    template <typename Receive>
+    static void receiveReply(Receive receive)
+    {
+        try
+        {
+            receive();
+        }
+        catch(ConnectionClosedError & e)
+        {
+            throw std::runtime_error("Connection closed before the reply: " + std::string(e.what()));
+        }
+    }
+    
+    static void checkReply(const SocketFrameReader & reader, const MessageFormat & format)
+    {
+        if(reader.requestId() != format.requestId)
+        {
+            throw std::runtime_error("Read error: reply to another request");
+        }
+    }
+    
+    // Send the request of an accepted stream and receive its reply at the same time,
+    // producing the next chunk only once the previous one is in the socket
+    static void exchangeStream(int socket, SocketFrameReader & reader, const MessageFormat & format, size_t chunkSize,
+                               const std::function<bool(SocketFrame &)> & produce,
+                               const std::function<void(const SocketFrame &)> & consume)
+    {
+        SocketFrameWriter writer(socket);
+        writer.setFraming(format.framing);
+        writer.setSharedFrameSize(format.sharedFrameSize);
+        writer.setCompressionThreshold(format.compressionThreshold);
+        
+        bool sending = true;
+        bool receiving = true;
+        
+        while(receiving)
+        {
+            if(sending && !writer.hasPending())
+            {
+                SocketPayload chunk;
+                size_t chunkBytes = 0;
+                
+                while(sending && (chunkBytes < chunkSize))
+                {
+                    SocketFrame frame;
+                    sending = produce(frame);
+                    
+                    if(sending)
+                    {
+                        chunkBytes += frame.size();
+                        chunk.push_back(std::move(frame));
+                    }
+                }
+                
+                if(!chunk.empty())
+                {
+                    writer.sendFrames(chunk);
+                }
+                
+                //the request ends with an empty message
+                if(!sending)
+                {
+                    writer.sendFrames(SocketPayload());
+                }
+            }
+            
+            //don't wait while there is a chunk to produce
+            struct pollfd watched = { socket, static_cast<short>(POLLIN | (writer.hasPending() ? POLLOUT : 0)), 0 };
+            int ret = poll(&watched, 1, (sending && !writer.hasPending()) ? 0 : -1);
+            
+            if((ret == -1) && (errno != EINTR))
+            {
+                throw std::runtime_error("Error while waiting on the socket: " + std::string(strerror(errno)));
+            }
+            
+            if(ret <= 0)
+            {
+                continue;
+            }
+            
+            if(watched.revents & POLLOUT)
+            {
+                writer.flush();
+            }
+            
+            if(watched.revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                reader.receive();
+                
+                //the reply ends with an empty message
+                while(receiving && reader.hasMessage())
+                {
+                    SocketPayload chunk;
+                    reader.recvFrames(chunk);
+                    receiving = !chunk.empty();
+                    
+                    for(const SocketFrame & frame : chunk)
+                    {
+                        consume(frame);
+                    }
+                }
+            }
+        }
+        
+        //the server ends its reply after the whole request
+        if(sending || writer.hasPending())
+        {
+            throw std::runtime_error("Read error: reply ended before the request");
+        }
+    }
+    
+    SocketSyncClient::SocketSyncClient(const std::string & path, size_t maxConnections, size_t sharedFrameSize)
+    :   m_path(path), m_maxConnections(maxConnections), m_sharedFrameSize(sharedFrameSize),
+        m_compressionThreshold(0), m_framing(SocketFraming::V1), m_streamChunkSize(SocketClientConfig().streamChunkSize),
+        m_handshakeTimeout(SocketClientConfig().handshakeTimeout), m_negotiate(sharedFrameSize > 0), m_lastRequestId(0)
+    {
+    }
+    
+    SocketSyncClient::SocketSyncClient(const std::string & path, const SocketClientConfig & config)
+    :   m_path(path), m_maxConnections(config.maxConnections), m_sharedFrameSize(config.sharedFrameSize),
+        m_compressionThreshold(isCompressionAvailable() ? config.compressionThreshold : 0),
+        m_framing(config.framing), m_streamChunkSize(config.streamChunkSize), m_handshakeTimeout(config.handshakeTimeout),
+        m_negotiate((m_sharedFrameSize > 0) || (m_compressionThreshold > 0)), m_lastRequestId(0)
     {
-        int data_socket = -1;
+    }
+    
+    SocketSyncClient::~SocketSyncClient()
+    {
+        for(int socket : m_idleConnections)
+        {
+            close(socket);
+        }
+    }
+    
+    int SocketSyncClient::connectWithFraming(Deadline deadline)
+    {
+        int socket = connectToServer(m_path, deadline);
+        
+        if(m_framing == SocketFraming::V2)
+        {
+            try
+            {
+                struct iovec preamble = { const_cast<char *>(framingPreamble.data()), framingPreamble.size() };
+                sendBuffers(socket, &preamble, 1, std::vector<int>(), deadline);
+            }
+            catch(std::exception &)
+            {
+                close(socket);
+                throw;
+            }
+        }
+        
+        return socket;
+    }
+    
+    int SocketSyncClient::openConnection(unsigned & capabilities, Deadline deadline)
+    {
+        int socket = connectWithFraming(deadline);
+        capabilities = 0;
+        
+        if(!m_negotiate)
+        {
+            return socket;
+        }
+        
+        //an older server may not reply at all
+        Deadline handshakeDeadline = std::min(deadline, std::chrono::steady_clock::now() + m_handshakeTimeout);
         
         try
         {
-            struct sockaddr_un addr;
-            int ret;
-
-            /* Create local socket. */
-            data_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-            if (data_socket == -1)
+            MessageFormat format;
+            format.framing = m_framing;
+            
+            Payload request = {capabilitiesFrame};
+            
+            if(m_sharedFrameSize > 0)
             {
-                throw std::runtime_error("Impossible to create the socket "+m_path+": " + std::string(strerror(errno)));
+                request.push_back(sharedFramesCapability);
             }
+            
+            if(m_compressionThreshold > 0)
+            {
+                request.push_back(compressionCapability);
+            }
+            
+            sendFrames(socket, request, format, handshakeDeadline);
+            
+            SocketFrameReader reader(socket);
+            reader.setFraming(m_framing);
+            reader.setDeadline(handshakeDeadline);
+            Payload reply = reader.recvFrames();
+            
+            if(isOverloadedReply(reply))
+            {
+                throw SocketOverloadedError("Server overloaded");
+            }
+            
+            //an older server replied as to an application request, the connection is usable
+            if(reply.empty() || (reply[0] != capabilitiesFrame))
+            {
+                m_negotiate = false;
+                return socket;
+            }
+            
+            for(size_t index = 1; index < reply.size(); index++)
+            {
+                if(reply[index] == sharedFramesCapability)
+                {
+                    capabilities |= sharedFramesAccepted;
+                }
+                else if(reply[index] == compressionCapability)
+                {
+                    capabilities |= compressionAccepted;
+                }
+            }
+            
+            return socket;
+        }
+        catch(SocketTimeoutError &)
+        {
+            close(socket);
+            
+            if(handshakeDeadline == deadline)
+            {
+                throw;
+            }
+        }
+        catch(ConnectionClosedError &)
+        {
+            close(socket);
+        }
+        catch(std::exception &)
+        {
+            close(socket);
+            throw;
+        }
+        
+        //an older server which didn't reply, or closed the connection: a late
+        //reply must not be taken for the one of a request
+        m_negotiate = false;
+        
+        return connectWithFraming(deadline);
+    }
+    
+    int SocketSyncClient::acquireConnection(bool & reused, unsigned & capabilities, Deadline deadline)
+    {
+        std::unique_lock<std::mutex> lock(m_poolMutex);
+        
+        //wait until we have an idle connection or the right to open a new one
+        auto available = [this]()
+        {
+            return !m_idleConnections.empty() || (m_openConnections < m_maxConnections);
+        };
+        
+        if(deadline == noDeadline)
+        {
+            m_poolAvailable.wait(lock, available);
+        }
+        else if(!m_poolAvailable.wait_until(lock, deadline, available))
+        {
+            throw SocketTimeoutError("Timeout while waiting for a connection");
+        }
+        
+        while(!m_idleConnections.empty())
+        {
+            int socket = m_idleConnections.back();
+            m_idleConnections.pop_back();
+            
+            //an idle connection must have nothing to read: readable means closed by the server
+            struct pollfd pfd = { socket, POLLIN, 0 };
+            
+            if(poll(&pfd, 1, 0) == 0)
+            {
+                reused = true;
+                auto it = m_connectionCapabilities.find(socket);
+                capabilities = (it != m_connectionCapabilities.end()) ? it->second : 0;
+                return socket;
+            }
+            
+            m_connectionCapabilities.erase(socket);
+            close(socket);
+            m_openConnections--;
+        }
+        
+        //open a new connection, without holding the lock during connect
+        m_openConnections++;
+        lock.unlock();
+        
+        try
+        {
+            reused = false;
+            int socket = openConnection(capabilities, deadline);
+            
+            if(capabilities != 0)
+            {
+                std::lock_guard<std::mutex> capabilitiesLock(m_poolMutex);
+                m_connectionCapabilities[socket] = capabilities;
+            }
+            
+            return socket;
+        }
+        catch(std::exception &)
+        {
+            releaseConnection(-1, false);
+            throw;
+        }
+    }
+    
+    void SocketSyncClient::releaseConnection(int socket, bool keep)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_poolMutex);
+            
+            if(keep)
+            {
+                m_idleConnections.push_back(socket);
+            }
+            else
+            {
+                if(socket != -1)
+                {
+                    m_connectionCapabilities.erase(socket);
+                    close(socket);
+                }
+                m_openConnections--;
+            }
+        }
+        
+        m_poolAvailable.notify_one();
+    }
+       
+    void SocketSyncClient::execute(const std::function<void(int, size_t, size_t)> & exchange, Deadline deadline)
+    {
+        auto run = [this, &exchange](int socket, unsigned capabilities)
+        {
+            exchange(socket, (capabilities & sharedFramesAccepted) ? m_sharedFrameSize : 0,
+                     (capabilities & compressionAccepted) ? m_compressionThreshold : 0);
+        };
+        
+        if(m_maxConnections == 0)
+        {
+            //one connection per request
+            unsigned capabilities = 0;
+            int data_socket = openConnection(capabilities, deadline);
+            
+            try
+            {
+                run(data_socket, capabilities);
 
-            memset(&addr, 0, sizeof(struct sockaddr_un));
-
-            /* Connect socket to socket address */
-
-            addr.sun_family = AF_UNIX;
-            strncpy(addr.sun_path, m_path.c_str(), sizeof(addr.sun_path) - 1);
-
-            ret = connect (data_socket, (const struct sockaddr *) &addr, sizeof(struct sockaddr_un));
-            if (ret == -1)
+                close(data_socket);
+                
+                return;
+            }
+            catch(std::exception &)
             {
-                throw std::runtime_error("Impossible to connect to server using the socket "+m_path+": " + std::string(strerror(errno)));
+                close(data_socket);
+                throw;
             }
+        }
+        
+        for(;;)
+        {
+            bool reused = false;
+            unsigned capabilities = 0;
+            int data_socket = acquireConnection(reused, capabilities, deadline);
+            
+            try
+            {
+                run(data_socket, capabilities);
+                
+                releaseConnection(data_socket, true);
 
-            sendFrames(data_socket, payload);
+                return;
+            }
+            catch(ConnectionClosedError &)
+            {
+                releaseConnection(data_socket, false);
+                
+                //the server closed a connection from the pool before the request was
+                //sent, see receiveReply(): retry with another one
+                if(!reused)
+                {
+                    throw;
+                }
+            }
+            catch(SocketOverloadedError &)
+            {
+                //the connection stays usable, or is seen closed on its next use
+                releaseConnection(data_socket, true);
+                throw;
+            }
+            catch(std::exception &)
+            {
+                releaseConnection(data_socket, false);
+                throw;
+            }
+        }
+    }
+       
+    std::vector<std::string> SocketSyncClient::syncRequestWithReply(const std::vector<std::string> & payload)
+    {
+        return request(payload, noDeadline);
+    }
+    
+    void SocketSyncClient::syncRequestWithReply(const SocketPayload & payload, SocketPayload & reply)
+    {
+        request(payload, reply, noDeadline);
+    }
+    
+    std::vector<std::string> SocketSyncClient::syncRequestWithReply(const std::vector<std::string> & payload, std::chrono::milliseconds timeout)
+    {
+        return request(payload, std::chrono::steady_clock::now() + timeout);
+    }
+    
+    void SocketSyncClient::syncRequestWithReply(const SocketPayload & payload, SocketPayload & reply, std::chrono::milliseconds timeout)
+    {
+        request(payload, reply, std::chrono::steady_clock::now() + timeout);
+    }
+    
+    std::vector<std::vector<std::string>> SocketSyncClient::syncRequestBatch(const std::vector<std::vector<std::string>> & requests)
+    {
+        return requestBatch(requests, noDeadline);
+    }
+    
+    std::vector<std::vector<std::string>> SocketSyncClient::syncRequestBatch(const std::vector<std::vector<std::string>> & requests,
+                                                                             std::chrono::milliseconds timeout)
+    {
+        return requestBatch(requests, std::chrono::steady_clock::now() + timeout);
+    }
+    
+    void SocketSyncClient::streamRequest(const std::function<bool(SocketFrame &)> & produce,
+                                         const std::function<void(const SocketFrame &)> & consume)
+    {
+        execute([this, &produce, &consume](int data_socket, size_t sharedFrameSize, size_t compressionThreshold)
+        {
+            MessageFormat format = requestFormat(m_framing, sharedFrameSize, compressionThreshold, m_lastRequestId);
+            sendFrames(data_socket, Payload({streamFrame}), format);
+            
+            SocketFrameReader reader(data_socket);
+            reader.setFraming(m_framing);
+            reader.setCompression(compressionThreshold > 0);
+            reader.setSharedFrames(sharedFrameSize > 0);
+            
+            Payload accepted;
+            
+            receiveReply([&reader, &accepted]()
+            {
+                accepted = reader.recvFrames();
+            });
+            
+            checkReply(reader, format);
+            
+            if(isOverloadedReply(accepted))
+            {
+                throw SocketOverloadedError("Server overloaded");
+            }
+            
+            if((accepted.size() != 1) || (accepted[0] != streamAcceptedFrame))
+            {
+                throw std::runtime_error("Streamed requests not accepted by the server");
+            }
+            
+            //frames were produced: a closed connection can't be retried from here
+            try
+            {
+                exchangeStream(data_socket, reader, format, m_streamChunkSize, produce, consume);
+            }
+            catch(ConnectionClosedError & e)
+            {
+                throw std::runtime_error("Stream interrupted: " + std::string(e.what()));
+            }
+        }, noDeadline);
+    }
+    
+    std::vector<std::string> SocketSyncClient::request(const std::vector<std::string> & payload, Deadline deadline)
+    {
+        std::vector<std::string> data;
+        
+        execute([this, &payload, &data, deadline](int data_socket, size_t sharedFrameSize, size_t compressionThreshold)
+        {
+            MessageFormat format = requestFormat(m_framing, sharedFrameSize, compressionThreshold, m_lastRequestId);
+            sendFrames(data_socket, payload, format, deadline);
 
-            std::vector<std::string> data = recvFrames(data_socket);
+            //the reply is the only data expected on the connection
+            SocketFrameReader reader(data_socket);
+            reader.setFraming(m_framing);
+            reader.setCompression(compressionThreshold > 0);
+            reader.setSharedFrames(sharedFrameSize > 0);
+            reader.setDeadline(deadline);
+            
+            receiveReply([&reader, &data]()
+            {
+                data = reader.recvFrames();
+            });
+            
+            checkReply(reader, format);
             
-            close(data_socket);
+            if(isOverloadedReply(data))
+            {
+                throw SocketOverloadedError("Server overloaded");
+            }
+        }, deadline);
+        
+        return data;
+    }
+    
+    void SocketSyncClient::request(const SocketPayload & payload, SocketPayload & reply, Deadline deadline)
+    {
+        execute([this, &payload, &reply, deadline](int data_socket, size_t sharedFrameSize, size_t compressionThreshold)
+        {
+            MessageFormat format = requestFormat(m_framing, sharedFrameSize, compressionThreshold, m_lastRequestId);
+            sendFrames(data_socket, payload, format, deadline);
 
-            return data;
+            //the reply frames keep the receive buffer of the request
+            SocketFrameReader reader(data_socket);
+            reader.setFraming(m_framing);
+            reader.setCompression(compressionThreshold > 0);
+            reader.setSharedFrames(sharedFrameSize > 0);
+            reader.setDeadline(deadline);
+            
+            receiveReply([&reader, &reply]()
+            {
+                reader.recvFrames(reply);
+            });
+            
+            checkReply(reader, format);
+            
+            if(isOverloadedReply(reply))
+            {
+                throw SocketOverloadedError("Server overloaded");
+            }
+        }, deadline);
+    }
+    
+    std::vector<std::vector<std::string>> SocketSyncClient::requestBatch(const std::vector<std::vector<std::string>> & requests,
+                                                                         Deadline deadline)
+    {
+        std::vector<std::vector<std::string>> replies;
+        
+        if(requests.empty())
+        {
+            return replies;
         }
-        catch(std::exception &)
+        
+        execute([this, &requests, &replies, deadline](int data_socket, size_t sharedFrameSize, size_t compressionThreshold)
         {
-            if(data_socket != -1)
+            replies.clear();
+            replies.reserve(requests.size());
+            
+            SocketFrameWriter writer(data_socket);
+            writer.setFraming(m_framing);
+            writer.setSharedFrameSize(sharedFrameSize);
+            writer.setCompressionThreshold(compressionThreshold);
+            
+            SocketFrameReader reader(data_socket);
+            reader.setFraming(m_framing);
+            reader.setCompression(compressionThreshold > 0);
+            reader.setSharedFrames(sharedFrameSize > 0);
+            reader.setDeadline(deadline);
+            
+            //consecutive ids in V2
+            uint64_t firstRequestId = 0;
+            
+            if(m_framing == SocketFraming::V2)
             {
-                close(data_socket);
+                firstRequestId = m_lastRequestId.fetch_add(requests.size()) + 1;
             }
             
-            throw;
-        }
+            bool overloaded = false;
+            
+            try
+            {
+                writer.cork();
+                
+                for(size_t index = 0; index < requests.size(); index++)
+                {
+                    writer.sendFrames(requests[index], firstRequestId ? (firstRequestId + index) : 0);
+                }
+                
+                writer.uncork();
+                
+                while(replies.size() < requests.size())
+                {
+                    //the server stops reading while its replies are not read: read them while writing the rest
+                    if(writer.hasPending() && !reader.hasMessage())
+                    {
+                        short events = waitSocket(data_socket, POLLIN | POLLOUT, deadline);
+                        
+                        if(events & POLLOUT)
+                        {
+                            writer.flush();
+                        }
+                        
+                        if(events & (POLLIN | POLLHUP | POLLERR))
+                        {
+                            reader.receive();
+                        }
+                        
+                        continue;
+                    }
+                    
+                    replies.push_back(reader.recvFrames());
+                    
+                    if(reader.requestId() != (firstRequestId ? (firstRequestId + replies.size() - 1) : 0))
+                    {
+                        throw std::runtime_error("Read error: reply to another request");
+                    }
+                    
+                    overloaded = overloaded || isOverloadedReply(replies.back());
+                }
+            }
+            catch(ConnectionClosedError & e)
+            {
+                //the requests already sent can't be sent again
+                if(writer.bytesSent() > 0)
+                {
+                    throw std::runtime_error("Batch interrupted: " + std::string(e.what()));
+                }
+                
+                throw;
+            }
+            
+            if(overloaded)
+            {
+                throw SocketOverloadedError("Server overloaded");
+            }
+        }, deadline);
         
-     }
+        return replies;
+    }
         
 } //namespace fty
 
@@ -104,6 +705,141 @@ namespace fty
 #define SELFTEST_DIR_RO "src/selftest-ro"
 #define SELFTEST_DIR_RW "src/selftest-rw"
 
+#include "fty_common_unit_tests.h"
+#include "fty_common_socket_async_server.h"
+#include "fty_common_socket_test_server.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace
+{
+    // Echo server failing the requests with a frame "fail", counting the calls
+    class FailingEchoServer : public fty::SyncServer
+    {
+    public:
+        fty::Payload handleRequest(const fty::Sender & /*sender*/, const fty::Payload & payload) override
+        {
+            calls++;
+
+            for(const std::string & frame : payload)
+            {
+                if(frame == "fail")
+                {
+                    throw std::runtime_error("Request failed");
+                }
+            }
+
+            return payload;
+        }
+
+        std::atomic<int> calls{0};
+    };
+
+    // Server of the protocol before the capabilities were added: frames stop
+    // at their first NUL, and all the requests go to the handler. The
+    // capabilities request, seen with an empty first frame, is echoed,
+    // ignored or closes the connection; the other requests are echoed.
+    class BaselineServer
+    {
+    public:
+        enum class Unknown
+        {
+            ECHO,
+            IGNORE,
+            CLOSE
+        };
+
+        BaselineServer(const std::string & path, Unknown unknown)
+        :   m_unknown(unknown)
+        {
+            m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+            assert(m_socket != -1);
+
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+            unlink(path.c_str());
+            int bound = bind(m_socket, (const struct sockaddr *) &addr, sizeof(addr));
+            assert(bound == 0);
+            int listening = listen(m_socket, 10);
+            assert(listening == 0);
+
+            m_acceptor = std::thread([this]()
+            {
+                for(int client = accept(m_socket, NULL, NULL); client != -1; client = accept(m_socket, NULL, NULL))
+                {
+                    m_connections.emplace_back(&BaselineServer::serve, this, client);
+                }
+            });
+        }
+
+        // The clients must be gone
+        ~BaselineServer()
+        {
+            shutdown(m_socket, SHUT_RDWR);
+            m_acceptor.join();
+
+            for(std::thread & connection : m_connections)
+            {
+                connection.join();
+            }
+
+            close(m_socket);
+        }
+
+        std::atomic<int> unknownRequests{0};
+
+    private:
+        void serve(int client)
+        {
+            try
+            {
+                for(;;)
+                {
+                    fty::Payload request;
+
+                    for(const std::string & frame : fty::recvFrames(client))
+                    {
+                        request.push_back(frame.c_str());
+                    }
+
+                    if(!request.empty() && request[0].empty())
+                    {
+                        unknownRequests++;
+
+                        if(m_unknown == Unknown::IGNORE)
+                        {
+                            continue;
+                        }
+
+                        if(m_unknown == Unknown::CLOSE)
+                        {
+                            break;
+                        }
+                    }
+
+                    fty::sendFrames(client, request);
+                }
+            }
+            catch(std::exception &)
+            {
+            }
+
+            close(client);
+        }
+
+        int m_socket;
+        Unknown m_unknown;
+        std::thread m_acceptor;
+        std::vector<std::thread> m_connections;
+    };
+}
+
 void
 fty_common_socket_sync_client_test (bool verbose)
 {
@@ -112,6 +848,176 @@ fty_common_socket_sync_client_test (bool verbose)
     //  @selftest
     //  Simple create/destroy test
     fty::SocketSyncClient(std::string(SELFTEST_DIR_RW"/test.socket"));
+
+    //  Pooled client: connections are reused and replaced when the server closes them
+    {
+        fty::EchoServer server;
+        fty::SocketSyncClient syncClient( "test.socket", 2);
+        fty::Payload expectedPayload = {"This", "is", "a", "test"};
+
+        for(int restart = 0; restart < 2; restart++)
+        {
+            fty::SocketBasicServer agent(  server,
+                                           "test.socket");
+
+            fty::SocketTestServer serverThread(agent);
+
+            std::vector<std::thread> clients;
+
+            for(int index = 0; index < 4; index++)
+            {
+                clients.push_back(std::thread([&]()
+                {
+                    for(int request = 0; request < 10; request++)
+                    {
+                        assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+                    }
+                }));
+            }
+
+            for(std::thread & client : clients)
+            {
+                client.join();
+            }
+        }
+    }
+
+    //  Batches of requests, on the loop, on workers and through the adapter, in both framings.
+    //  The batch is larger than the socket buffers: the replies are read while it is written.
+    for(int handler = 0; handler < 3; handler++)
+    {
+        for(fty::SocketFraming framing : {fty::SocketFraming::V1, fty::SocketFraming::V2})
+        {
+            fty::EchoServer echoServer;
+            fty::SocketSyncServerAdapter asyncServer(echoServer);
+
+            fty::SocketServerConfig config;
+            config.workers = (handler == 1) ? 2 : 0;
+
+            std::unique_ptr<fty::SocketBasicServer> agent;
+
+            if(handler == 2)
+            {
+                agent.reset(new fty::SocketBasicServer(asyncServer, "test.socket", 30, config));
+            }
+            else
+            {
+                agent.reset(new fty::SocketBasicServer(echoServer, "test.socket", 30, config));
+            }
+
+            fty::SocketTestServer serverThread(*agent);
+
+            fty::SocketClientConfig clientConfig;
+            clientConfig.maxConnections = 1;
+            clientConfig.framing = framing;
+
+            fty::SocketSyncClient syncClient("test.socket", clientConfig);
+
+            std::vector<fty::Payload> requests;
+
+            for(int request = 0; request < 2000; request++)
+            {
+                requests.push_back({"request", std::to_string(request), std::string(1000, 'x')});
+            }
+
+            assert(syncClient.syncRequestBatch(requests) == requests);
+            assert(syncClient.syncRequestBatch(requests, std::chrono::seconds(10)) == requests);
+            assert(syncClient.syncRequestBatch(std::vector<fty::Payload>()).empty());
+
+            //the connection goes on with single requests
+            assert(syncClient.syncRequestWithReply({"single"}) == fty::Payload({"single"}));
+        }
+    }
+
+    //  A failed request of a batch closes the connection, the batch fails
+    {
+        FailingEchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+
+        try
+        {
+            syncClient.syncRequestBatch({{"first"}, {"fail"}, {"last"}});
+            assert(false);
+        }
+        catch(std::exception &)
+        {
+        }
+
+        assert(syncClient.syncRequestBatch({{"first"}, {"last"}}) == std::vector<fty::Payload>({{"first"}, {"last"}}));
+    }
+
+    //  A request on a pooled connection closed once the server read it is not sent again
+    {
+        FailingEchoServer server;
+
+        fty::SocketBasicServer agent(  server,
+                                       "test.socket");
+
+        fty::SocketTestServer serverThread(agent);
+
+        fty::SocketSyncClient syncClient( "test.socket", 1);
+        assert(syncClient.syncRequestWithReply({"first"}) == fty::Payload({"first"}));
+
+        for(bool batch : {false, true})
+        {
+            server.calls = 0;
+
+            try
+            {
+                if(batch)
+                {
+                    syncClient.syncRequestBatch({{"fail"}});
+                }
+                else
+                {
+                    syncClient.syncRequestWithReply({"fail"});
+                }
+
+                assert(false);
+            }
+            catch(std::runtime_error &)
+            {
+            }
+
+            assert(server.calls == 1);
+
+            //the next request gets a new connection
+            assert(syncClient.syncRequestWithReply({"next"}) == fty::Payload({"next"}));
+        }
+    }
+
+    //  A server of the protocol before the capabilities is detected, whatever it does with their request,
+    //  and not asked again
+    for(BaselineServer::Unknown unknown : {BaselineServer::Unknown::ECHO, BaselineServer::Unknown::IGNORE, BaselineServer::Unknown::CLOSE})
+    {
+        BaselineServer server("test.socket", unknown);
+
+        {
+            fty::SocketClientConfig clientConfig;
+            clientConfig.sharedFrameSize = 1024;
+            clientConfig.handshakeTimeout = std::chrono::milliseconds(100);
+
+            fty::SocketSyncClient syncClient("test.socket", clientConfig);
+            fty::Payload expectedPayload = {"inline", std::string(4096, 'x')};
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            for(int request = 0; request < 3; request++)
+            {
+                assert(syncClient.syncRequestWithReply(expectedPayload) == expectedPayload);
+            }
+
+            assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+        }
+
+        assert(server.unknownRequests == 1);
+    }
     //  @end
     printf ("OK\n");
 }
@@ -0,0 +1,64 @@
+/*  =========================================================================
+    fty_common_socket_test_server - Server running on a thread for the selftests
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_test_server - Server running on a thread for the selftests
+@discuss
+@end
+*/
+
+#include "fty_common_socket_test_server.h"
+
+#include <chrono>
+
+namespace fty
+{
+    SocketTestServer::SocketTestServer(SocketBasicServer & server)
+    :   m_server(server), m_thread(&SocketBasicServer::run, &server)
+    {
+        //a stop requested before run() starts would be lost
+        while(!m_server.isRunning())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    
+    SocketTestServer::~SocketTestServer()
+    {
+        stop();
+    }
+    
+    void SocketTestServer::stop()
+    {
+        m_server.requestStop();
+        join();
+    }
+    
+    void SocketTestServer::join()
+    {
+        if(m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+    
+} //namespace fty
@@ -0,0 +1,58 @@
+/*  =========================================================================
+    fty_common_socket_test_server - Server running on a thread for the selftests
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_TEST_SERVER_H_INCLUDED
+#define FTY_COMMON_SOCKET_TEST_SERVER_H_INCLUDED
+
+#include "fty_common_socket_basic_mailbox_server.h"
+
+#include <thread>
+
+namespace fty
+{
+    // Run a server on a thread of its own, serving once constructed, and
+    // stopped and joined when destroyed: declared after the server, the
+    // thread is done before the server goes.
+    
+    class SocketTestServer
+    {
+    public:
+        explicit SocketTestServer(SocketBasicServer & server);
+        ~SocketTestServer();
+        
+        SocketTestServer(const SocketTestServer &) = delete;
+        SocketTestServer & operator=(const SocketTestServer &) = delete;
+        
+        // Request the server to stop, and wait for run() to return
+        void stop();
+        
+        // Wait for run() to return by itself, after a drain
+        void join();
+        
+    private:
+        //attributs
+        SocketBasicServer & m_server;
+        std::thread m_thread;
+    };
+    
+} //namespace fty
+
+#endif
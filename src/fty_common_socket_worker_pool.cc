@@ -0,0 +1,90 @@
+/*  =========================================================================
+    fty_common_socket_worker_pool - Pool of threads running server handlers
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_common_socket_worker_pool - Pool of threads running server handlers
+@discuss
+@end
+*/
+
+#include "fty_common_socket_worker_pool.h"
+
+namespace fty
+{
+    SocketWorkerPool::SocketWorkerPool(size_t workers)
+    {
+        for(size_t index = 0; index < workers; index++)
+        {
+            m_workers.push_back(std::thread(&SocketWorkerPool::workerLoop, this));
+        }
+    }
+    
+    SocketWorkerPool::~SocketWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopRequested = true;
+            m_jobs.clear();
+        }
+        
+        m_jobAvailable.notify_all();
+        
+        for(std::thread & worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+    
+    void SocketWorkerPool::post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        
+        m_jobAvailable.notify_one();
+    }
+    
+    void SocketWorkerPool::workerLoop()
+    {
+        for(;;)
+        {
+            std::function<void()> job;
+            
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_jobAvailable.wait(lock, [this]() { return m_stopRequested || !m_jobs.empty(); });
+                
+                if(m_stopRequested)
+                {
+                    return;
+                }
+                
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            
+            job();
+        }
+    }
+    
+} //namespace fty
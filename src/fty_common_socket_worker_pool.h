@@ -0,0 +1,61 @@
+/*  =========================================================================
+    fty_common_socket_worker_pool - Pool of threads running server handlers
+
+    Copyright (C) 2014 - 2019 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef FTY_COMMON_SOCKET_WORKER_POOL_H_INCLUDED
+#define FTY_COMMON_SOCKET_WORKER_POOL_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fty
+{
+    // Fixed set of threads executing posted jobs in FIFO order.
+    // Destroying the pool waits for the running jobs and drops the queued ones.
+    
+    class SocketWorkerPool
+    {
+    public:
+        explicit SocketWorkerPool(size_t workers);
+        ~SocketWorkerPool();
+        
+        SocketWorkerPool(const SocketWorkerPool &) = delete;
+        SocketWorkerPool & operator=(const SocketWorkerPool &) = delete;
+        
+        void post(std::function<void()> job);
+        
+    private:
+        void workerLoop();
+        
+        //attributs
+        std::mutex m_mutex;
+        std::condition_variable m_jobAvailable;
+        std::deque<std::function<void()>> m_jobs;
+        bool m_stopRequested = false;
+        std::vector<std::thread> m_workers;
+    };
+    
+} //namespace fty
+
+#endif